@@ -1,6 +1,16 @@
 ---------------------------------
 -- [ WORKSPACE CONFIGURATION ] --
 ---------------------------------
+newoption {
+	trigger     = "io-uring",
+	description = "Run the socket I/O on io_uring instead of epoll (Linux, needs liburing)"
+}
+
+newoption {
+	trigger     = "tls",
+	description = "Support TLS connections (needs OpenSSL)"
+}
+
 workspace "LibNet"
 
 	startproject "TestServer"
@@ -31,6 +41,21 @@ workspace "LibNet"
 		system "macosx"
 		defines "HE_SYSTEM_MACOS"
 
+	-- "premake5 --io-uring gmake2" runs the socket I/O on io_uring (Linux only, needs liburing)
+	filter { "options:io-uring", "system:linux" }
+		defines "NETLIB_IO_URING=1"
+		links   "uring"
+
+	-- "premake5 --tls gmake2" adds TLS connections, with the system's OpenSSL
+	filter "options:tls"
+		defines "NETLIB_TLS=1"
+
+	filter { "options:tls", "system:not windows" }
+		links { "ssl", "crypto" }
+
+	filter { "options:tls", "system:windows" }
+		links { "libssl", "libcrypto" }
+
 	filter { "system:windows", "action:vs*" }
 		flags { "MultiProcessorCompile", "NoMinimalRebuild" }
 		systemversion "latest"
@@ -64,6 +89,10 @@ workspace "LibNet"
 	group "Examples"
 		include("projects/TestServer")
 		include("projects/TestClient")
+		include("projects/LoadClient")
+
+	group "Benchmarks"
+		include("projects/LibNetBench")
 
 	group "Misc"
 		include("vendor/premake5")
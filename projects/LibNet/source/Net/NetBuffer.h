@@ -0,0 +1,346 @@
+#pragma once
+
+#include "NetCommon.h"
+
+#include "NetBufferPool.h"
+
+
+namespace NETLIB_NAMESPACE {
+
+
+	// Reference counted storage block, the bytes follow directly behind the header
+	struct BufferBlock
+	{
+		std::atomic<uint32_t> nRefs;
+		size_t nCapacity;
+		BufferPool* pPool;
+
+		uint8_t* Data() { return reinterpret_cast<uint8_t*>(this + 1); }
+
+
+		// Allocates a block with at least nCapacity bytes, the capacity is rounded
+		// up to use the whole memory block the pool hands out anyway
+		static BufferBlock* Allocate(size_t nCapacity, BufferPool& pool)
+		{
+			size_t nBytes = BufferPool::GetBlockSize(sizeof(BufferBlock) + nCapacity);
+			BufferBlock* pBlock = static_cast<BufferBlock*>(pool.allocate(nBytes, alignof(BufferBlock)));
+			pBlock->nRefs.store(1, std::memory_order_relaxed);
+			pBlock->nCapacity = nBytes - sizeof(BufferBlock);
+			pBlock->pPool = &pool;
+			return pBlock;
+		}
+
+
+		static void AddRef(BufferBlock* pBlock)
+		{
+			if (pBlock)
+				pBlock->nRefs.fetch_add(1, std::memory_order_relaxed);
+		}
+
+
+		// The last owner frees the block
+		static void Release(BufferBlock* pBlock)
+		{
+			if (pBlock && pBlock->nRefs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				pBlock->pPool->deallocate(pBlock, sizeof(BufferBlock) + pBlock->nCapacity, alignof(BufferBlock));
+		}
+
+
+		static bool IsShared(const BufferBlock* pBlock)
+		{
+			return pBlock && pBlock->nRefs.load(std::memory_order_acquire) > 1;
+		}
+	};
+
+
+	// Byte storage for message bodies, used like a std::vector<uint8_t>.
+	//
+	// The bytes live in a reference counted block, so copying a buffer only
+	// bumps the reference count. The block is copied on the first write to a
+	// shared buffer (copy-on-write), which means a buffer which has been handed
+	// to several connections is effectively immutable and never copied again.
+	// A buffer may also reference just a slice of a block (see BufferSlab).
+	// The blocks are taken from a BufferPool, and go back to it when released.
+	//
+	// NOTE: Bytes added by resize() are not initialised.
+	class Buffer
+	{
+		friend class BufferSlab;
+
+	public:
+		Buffer() = default;
+
+
+		explicit Buffer(BufferPool& pool)
+			: m_pPool(&pool)
+		{
+		}
+
+
+		explicit Buffer(size_t size, BufferPool& pool = BufferPool::GetDefault())
+			: m_pPool(&pool)
+		{
+			resize(size);
+		}
+
+
+		Buffer(const Buffer& other)
+			: m_pPool(other.m_pPool), m_pBlock(other.m_pBlock), m_nOffset(other.m_nOffset), m_nSize(other.m_nSize)
+		{
+			BufferBlock::AddRef(m_pBlock);
+		}
+
+
+		Buffer(Buffer&& other) noexcept
+			: m_pPool(other.m_pPool), m_pBlock(std::exchange(other.m_pBlock, nullptr)), m_nOffset(std::exchange(other.m_nOffset, 0)), m_nSize(std::exchange(other.m_nSize, 0))
+		{
+		}
+
+
+		Buffer& operator = (const Buffer& other)
+		{
+			if (this != &other)
+			{
+				Buffer copy(other);
+				Swap(copy);
+			}
+			return *this;
+		}
+
+
+		Buffer& operator = (Buffer&& other) noexcept
+		{
+			if (this != &other)
+			{
+				Release();
+				m_pPool = other.m_pPool;
+				m_pBlock = std::exchange(other.m_pBlock, nullptr);
+				m_nOffset = std::exchange(other.m_nOffset, 0);
+				m_nSize = std::exchange(other.m_nSize, 0);
+			}
+			return *this;
+		}
+
+
+		~Buffer()
+		{
+			Release();
+		}
+
+
+	public:
+		size_t size() const { return m_nSize; }
+		bool empty() const { return m_nSize == 0; }
+		size_t capacity() const { return m_pBlock ? m_pBlock->nCapacity - m_nOffset : 0; }
+
+		// Read access never copies the storage...
+		const uint8_t* data() const { return m_pBlock ? m_pBlock->Data() + m_nOffset : nullptr; }
+		const uint8_t* begin() const { return data(); }
+		const uint8_t* end() const { return data() + m_nSize; }
+
+		// ...but write access makes sure this buffer is the only owner
+		uint8_t* data()
+		{
+			MakeUnique(m_nSize);
+			return m_pBlock ? m_pBlock->Data() + m_nOffset : nullptr;
+		}
+
+
+		// Changes the number of bytes, shrinking never copies the storage
+		void resize(size_t size)
+		{
+			if (size > m_nSize)
+				MakeUnique(size);
+			m_nSize = size;
+		}
+
+
+		// Makes sure size bytes fit without another allocation
+		void reserve(size_t size)
+		{
+			if (size > capacity() || IsShared())
+				Reallocate(std::max(size, m_nSize));
+		}
+
+
+		// Removes all bytes, a shared storage is left to the other owners
+		void clear()
+		{
+			if (IsShared())
+				Release();
+			m_nSize = 0;
+		}
+
+
+		// Pool the storage comes from, for buffers which replace this one
+		BufferPool& GetPool() const
+		{
+			return *m_pPool;
+		}
+
+
+		// Returns true if the storage is referenced by other buffers too
+		bool IsShared() const
+		{
+			return BufferBlock::IsShared(m_pBlock);
+		}
+
+
+		void Swap(Buffer& other) noexcept
+		{
+			std::swap(m_pPool, other.m_pPool);
+			std::swap(m_pBlock, other.m_pBlock);
+			std::swap(m_nOffset, other.m_nOffset);
+			std::swap(m_nSize, other.m_nSize);
+		}
+
+
+	private:
+		// References size bytes at offset of an existing block
+		Buffer(BufferBlock* pBlock, size_t offset, size_t size)
+			: m_pPool(pBlock->pPool), m_pBlock(pBlock), m_nOffset(offset), m_nSize(size)
+		{
+			BufferBlock::AddRef(m_pBlock);
+		}
+
+
+		// Makes sure the storage is owned by this buffer only and holds at least size bytes
+		void MakeUnique(size_t size)
+		{
+			if (IsShared())
+			{
+				Reallocate(size);
+			}
+			else if (size > capacity())
+			{
+				// Grow geometrically, so pushing many small items stays cheap
+				Reallocate(std::max(size, capacity() * 2));
+			}
+		}
+
+
+		// Moves the bytes into a new block which is owned by this buffer only
+		void Reallocate(size_t nCapacity)
+		{
+			BufferBlock* pBlock = BufferBlock::Allocate(nCapacity, *m_pPool);
+
+			size_t nKeep = std::min(m_nSize, nCapacity);
+			if (nKeep > 0)
+				std::memcpy(pBlock->Data(), m_pBlock->Data() + m_nOffset, nKeep);
+
+			Release();
+			m_pBlock = pBlock;
+			m_nSize = nKeep;
+		}
+
+
+		// Drops the reference to the storage, the last owner frees it
+		void Release()
+		{
+			BufferBlock::Release(m_pBlock);
+			m_pBlock = nullptr;
+			m_nOffset = 0;
+		}
+
+
+	private:
+		BufferPool* m_pPool = &BufferPool::GetDefault();
+		BufferBlock* m_pBlock = nullptr;
+		size_t m_nOffset = 0;
+		size_t m_nSize = 0;
+	};
+
+
+	// Receive storage of a connection. The socket writes into the free space
+	// behind the received bytes, and complete frames are handed out as buffers
+	// which reference a slice of the slab, so their bytes are never copied.
+	//
+	//   [ handed out | received (ReadData) | free (WriteData) ]
+	class BufferSlab
+	{
+	public:
+		explicit BufferSlab(BufferPool& pool = BufferPool::GetDefault())
+			: m_Pool(pool)
+		{
+		}
+
+
+		BufferSlab(const BufferSlab&) = delete; // no copy constructor
+
+
+		~BufferSlab()
+		{
+			BufferBlock::Release(m_pBlock);
+		}
+
+
+	public:
+		// Bytes which have been received but not handed out yet
+		const uint8_t* ReadData() const { return m_pBlock->Data() + m_nRead; }
+		size_t ReadSize() const { return m_nWrite - m_nRead; }
+
+		// Free space behind the received bytes
+		uint8_t* WriteData() { return m_pBlock->Data() + m_nWrite; }
+		size_t WriteSize() const { return m_pBlock ? m_pBlock->nCapacity - m_nWrite : 0; }
+
+
+		// Marks size bytes of the free space as received
+		void Commit(size_t size)
+		{
+			m_nWrite += size;
+		}
+
+
+		// Drops the next size received bytes
+		void Skip(size_t size)
+		{
+			m_nRead += size;
+		}
+
+
+		// Hands out the next size received bytes as a buffer sharing the slab's storage
+		Buffer Take(size_t size)
+		{
+			Buffer buffer(m_pBlock, m_nRead, size);
+			m_nRead += size;
+			return buffer;
+		}
+
+
+		// Makes sure the received bytes plus the free space behind
+		// them add up to at least nCapacity bytes
+		void Prepare(size_t nCapacity)
+		{
+			size_t nPending = ReadSize();
+
+			if (m_pBlock && !BufferBlock::IsShared(m_pBlock) && m_pBlock->nCapacity >= nCapacity)
+			{
+				// Nothing references the slab anymore, so simply
+				// move the pending bytes to the front and reuse it
+				std::memmove(m_pBlock->Data(), m_pBlock->Data() + m_nRead, nPending);
+			}
+			else
+			{
+				// Handed out buffers still reference the slab (or it's too small),
+				// so continue in a new one. The old block is freed by its last owner.
+				BufferBlock* pBlock = BufferBlock::Allocate(nCapacity, m_Pool);
+				if (nPending > 0)
+					std::memcpy(pBlock->Data(), m_pBlock->Data() + m_nRead, nPending);
+				BufferBlock::Release(m_pBlock);
+				m_pBlock = pBlock;
+			}
+
+			m_nRead = 0;
+			m_nWrite = nPending;
+		}
+
+
+	private:
+		BufferPool& m_Pool;
+		BufferBlock* m_pBlock = nullptr;
+		size_t m_nRead = 0;
+		size_t m_nWrite = 0;
+	};
+
+
+} // namespace Net
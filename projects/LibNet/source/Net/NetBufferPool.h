@@ -0,0 +1,264 @@
+#pragma once
+
+#include "NetCommon.h"
+
+#include <memory_resource>
+#include <bit>
+
+
+namespace NETLIB_NAMESPACE {
+
+
+	// Recycling allocator for message bodies, receive slabs and queue nodes.
+	//
+	// Requests are rounded up to power-of-two size classes (64 B .. 1 MiB), and
+	// freed memory is kept in per-class free lists instead of going back to the
+	// heap. Once the lists are warm, steady-state traffic doesn't hit the heap
+	// anymore, which can be verified with GetHeapAllocationCount().
+	//
+	// The default pool additionally keeps a small free list per thread, so the
+	// I/O threads and the application thread rarely have to take the pool lock.
+	// Other pools (eg. one per connection) only use their shared lists.
+	//
+	// NOTE: A pool must outlive everything which has been allocated from it.
+	class BufferPool : public std::pmr::memory_resource
+	{
+	public:
+		static constexpr size_t MIN_CLASS_SHIFT = 6;  // 64 B
+		static constexpr size_t MAX_CLASS_SHIFT = 20; // 1 MiB
+		static constexpr size_t NUM_CLASSES = MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1;
+
+
+	public:
+		BufferPool()
+			: BufferPool(false)
+		{
+		}
+
+
+		BufferPool(const BufferPool&) = delete; // no copy constructor
+
+
+		~BufferPool()
+		{
+			for (size_t i = 0; i < NUM_CLASSES; i++)
+			{
+				while (m_Shared[i].pHead)
+					::operator delete(Pop(m_Shared[i]));
+			}
+		}
+
+
+		// Pool used by everything which isn't given a pool explicitly
+		static BufferPool& GetDefault()
+		{
+			// Never destroyed, so thread caches can be flushed into it at any time
+			static BufferPool* pPool = new BufferPool(true);
+			return *pPool;
+		}
+
+
+		// Number of allocations which went to the heap, for this pool...
+		uint64_t GetHeapAllocations() const { return m_nHeapAllocations.load(std::memory_order_relaxed); }
+
+		// ...and for all pools together
+		static uint64_t GetHeapAllocationCount() { return GetGlobalHeapAllocations().load(std::memory_order_relaxed); }
+
+
+		// Size of the memory block which is used for a request of nBytes
+		static size_t GetBlockSize(size_t nBytes)
+		{
+			size_t iClass = GetClass(nBytes);
+			return (iClass < NUM_CLASSES) ? (size_t(1) << (iClass + MIN_CLASS_SHIFT)) : nBytes;
+		}
+
+
+	protected:
+		void* do_allocate(size_t nBytes, size_t nAlignment) override
+		{
+			size_t iClass = GetClass(nBytes);
+
+			// Oversized or overaligned requests are not pooled
+			if (iClass >= NUM_CLASSES || nAlignment > alignof(std::max_align_t))
+				return AllocateFromHeap(nBytes, nAlignment);
+
+			// Try the thread's own free list first...
+			if (m_bThreadCaches)
+			{
+				FreeList& cache = GetThreadCache().lists[iClass];
+				if (!cache.pHead)
+					Refill(cache, iClass);
+				if (cache.pHead)
+					return Pop(cache);
+			}
+			// ...then the shared one...
+			else
+			{
+				std::scoped_lock scoped_lock(m_mutexShared);
+				if (m_Shared[iClass].pHead)
+					return Pop(m_Shared[iClass]);
+			}
+
+			// ...and only if both are empty, go to the heap
+			return AllocateFromHeap(size_t(1) << (iClass + MIN_CLASS_SHIFT), nAlignment);
+		}
+
+
+		void do_deallocate(void* p, size_t nBytes, size_t nAlignment) override
+		{
+			size_t iClass = GetClass(nBytes);
+
+			if (iClass >= NUM_CLASSES || nAlignment > alignof(std::max_align_t))
+			{
+				FreeToHeap(p, nAlignment);
+				return;
+			}
+
+			if (m_bThreadCaches)
+			{
+				FreeList& cache = GetThreadCache().lists[iClass];
+				Push(cache, p);
+				// Give half of the list back, if the thread only frees memory
+				// which has been allocated by others (eg. processed messages)
+				if (cache.nCount > GetMaxCached(iClass))
+					Spill(cache, iClass, cache.nCount / 2);
+			}
+			else
+			{
+				std::scoped_lock scoped_lock(m_mutexShared);
+				Push(m_Shared[iClass], p);
+			}
+		}
+
+
+		bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+		{
+			return this == &other;
+		}
+
+
+	private:
+		explicit BufferPool(bool bThreadCaches)
+			: m_bThreadCaches(bThreadCaches)
+		{
+		}
+
+
+		// Intrusive singly linked list of free memory blocks
+		struct FreeList
+		{
+			void* pHead = nullptr;
+			size_t nCount = 0;
+		};
+
+
+		// Free lists of a thread (default pool only), handed back when the thread exits
+		struct ThreadCache
+		{
+			FreeList lists[NUM_CLASSES];
+
+			~ThreadCache()
+			{
+				for (size_t i = 0; i < NUM_CLASSES; i++)
+					GetDefault().Spill(lists[i], i, lists[i].nCount);
+			}
+		};
+
+
+		static ThreadCache& GetThreadCache()
+		{
+			thread_local ThreadCache cache;
+			return cache;
+		}
+
+
+		static std::atomic<uint64_t>& GetGlobalHeapAllocations()
+		{
+			static std::atomic<uint64_t> nCount = 0;
+			return nCount;
+		}
+
+
+		// Index of the size class for nBytes, NUM_CLASSES if it's too large to be pooled
+		static size_t GetClass(size_t nBytes)
+		{
+			if (nBytes <= (size_t(1) << MIN_CLASS_SHIFT))
+				return 0;
+			return std::min<size_t>(std::bit_width(nBytes - 1) - MIN_CLASS_SHIFT, NUM_CLASSES);
+		}
+
+
+		// How many blocks of a class a thread may keep for itself (about 2 MiB per class)
+		static size_t GetMaxCached(size_t iClass)
+		{
+			return std::clamp<size_t>((size_t(2) << MAX_CLASS_SHIFT) >> (iClass + MIN_CLASS_SHIFT), 4, 256);
+		}
+
+
+		static void Push(FreeList& list, void* p)
+		{
+			*static_cast<void**>(p) = list.pHead;
+			list.pHead = p;
+			list.nCount++;
+		}
+
+
+		static void* Pop(FreeList& list)
+		{
+			void* p = list.pHead;
+			list.pHead = *static_cast<void**>(p);
+			list.nCount--;
+			return p;
+		}
+
+
+		// Moves up to half of a thread's maximum from the shared list into its cache
+		void Refill(FreeList& cache, size_t iClass)
+		{
+			std::scoped_lock scoped_lock(m_mutexShared);
+			size_t nMove = std::max<size_t>(GetMaxCached(iClass) / 2, 1);
+			while (nMove-- > 0 && m_Shared[iClass].pHead)
+				Push(cache, Pop(m_Shared[iClass]));
+		}
+
+
+		// Moves nCount blocks from a thread's cache into the shared list
+		void Spill(FreeList& cache, size_t iClass, size_t nCount)
+		{
+			std::scoped_lock scoped_lock(m_mutexShared);
+			while (nCount-- > 0 && cache.pHead)
+				Push(m_Shared[iClass], Pop(cache));
+		}
+
+
+		void* AllocateFromHeap(size_t nBytes, size_t nAlignment)
+		{
+			m_nHeapAllocations.fetch_add(1, std::memory_order_relaxed);
+			GetGlobalHeapAllocations().fetch_add(1, std::memory_order_relaxed);
+			if (nAlignment > alignof(std::max_align_t))
+				return ::operator new(nBytes, std::align_val_t(nAlignment));
+			return ::operator new(nBytes);
+		}
+
+
+		static void FreeToHeap(void* p, size_t nAlignment)
+		{
+			if (nAlignment > alignof(std::max_align_t))
+				::operator delete(p, std::align_val_t(nAlignment));
+			else
+				::operator delete(p);
+		}
+
+
+	private:
+		bool m_bThreadCaches;
+
+		// Free lists shared by all threads
+		FreeList m_Shared[NUM_CLASSES];
+		std::mutex m_mutexShared;
+
+		std::atomic<uint64_t> m_nHeapAllocations = 0;
+	};
+
+
+} // namespace Net
@@ -0,0 +1,273 @@
+#pragma once
+
+#include "NetCommon.h"
+
+#include <array>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#	include <nmmintrin.h>
+#	ifdef _MSC_VER
+#		include <intrin.h>
+#	endif
+#	define NETLIB_CRC32C_SSE42
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#	include <arm_acle.h>
+#	define NETLIB_CRC32C_ARMV8
+#endif
+
+
+namespace NETLIB_NAMESPACE {
+
+
+	// Checksum algorithm used for a message body, chosen per connection at connect time
+	enum class Integrity : uint8_t
+	{
+		// No body checksum at all, TCP alone has to be trusted (loopback or trusted links)
+		None = 0,
+		// CRC-32C (Castagnoli), hardware accelerated where available
+		CRC32C = 1,
+	};
+
+
+	// Bit mask of Integrity values, as announced in the connection handshake
+	inline constexpr uint32_t IntegrityBit(Integrity mode) { return 1u << (uint32_t)mode; }
+
+
+	// CRC-32C (Castagnoli polynomial, as used by iSCSI/ext4/SSE4.2)
+	//
+	// Uses the SSE4.2 (x86-64, detected at runtime) or ARMv8 (at compile time)
+	// crc32c instructions, and falls back to a portable slicing-by-8 table.
+	// On SSE4.2 larger bodies are split into three interleaved streams, which
+	// hides the latency of the instruction, the partial CRCs are then combined
+	// by shifting them with precomputed tables.
+	class CRC32C
+	{
+	public:
+		static uint32_t Compute(const void* pData, size_t nSize, uint32_t crc = 0)
+		{
+#if defined(NETLIB_CRC32C_SSE42)
+			if (HasHardwareSupport())
+				return ComputeSSE42(static_cast<const uint8_t*>(pData), nSize, crc);
+#elif defined(NETLIB_CRC32C_ARMV8)
+			return ComputeARMv8(static_cast<const uint8_t*>(pData), nSize, crc);
+#endif
+			return ComputeSoftware(static_cast<const uint8_t*>(pData), nSize, crc);
+		}
+
+
+		// Portable implementation, always available (also used as reference)
+		static uint32_t ComputeSoftware(const uint8_t* p, size_t nSize, uint32_t crc = 0)
+		{
+			const auto& table = GetTable();
+			crc = ~crc;
+
+			// Eight bytes at a time...
+			while (nSize >= 8)
+			{
+				uint32_t lo, hi;
+				std::memcpy(&lo, p, 4);
+				std::memcpy(&hi, p + 4, 4);
+				lo ^= crc;
+				crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^ table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+				      table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF] ^ table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+				p += 8;
+				nSize -= 8;
+			}
+			// ...and the rest byte by byte
+			while (nSize-- > 0)
+				crc = table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+			return ~crc;
+		}
+
+
+		static bool HasHardwareSupport()
+		{
+#if defined(NETLIB_CRC32C_SSE42)
+			static const bool bSupported = DetectSSE42();
+			return bSupported;
+#elif defined(NETLIB_CRC32C_ARMV8)
+			return true;
+#else
+			return false;
+#endif
+		}
+
+
+	private:
+		using Table = std::array<std::array<uint32_t, 256>, 8>;
+		using ShiftTable = std::array<std::array<uint32_t, 256>, 4>;
+
+		// Reflected Castagnoli polynomial
+		static constexpr uint32_t POLY = 0x82F63B78u;
+
+		// Block sizes of the three-way interleaved streams
+		static constexpr size_t LONG_BLOCK = 8192;
+		static constexpr size_t SHORT_BLOCK = 256;
+
+
+		// Slicing-by-8 lookup tables for the reflected polynomial 0x82F63B78
+		static const Table& GetTable()
+		{
+			static constexpr Table table = []()
+			{
+				Table t{};
+				for (uint32_t i = 0; i < 256; i++)
+				{
+					uint32_t crc = i;
+					for (int bit = 0; bit < 8; bit++)
+						crc = (crc >> 1) ^ (POLY & (0u - (crc & 1u)));
+					t[0][i] = crc;
+				}
+				for (uint32_t i = 0; i < 256; i++)
+				{
+					for (size_t n = 1; n < 8; n++)
+						t[n][i] = (t[n - 1][i] >> 8) ^ t[0][t[n - 1][i] & 0xFF];
+				}
+				return t;
+			}();
+			return table;
+		}
+
+
+		// Multiplies a and b modulo the polynomial (reflected bit order)
+		static uint32_t MultModP(uint32_t a, uint32_t b)
+		{
+			uint32_t m = 1u << 31;
+			uint32_t p = 0;
+			for (;;)
+			{
+				if (a & m)
+				{
+					p ^= b;
+					if ((a & (m - 1)) == 0)
+						break;
+				}
+				m >>= 1;
+				b = (b & 1) ? (b >> 1) ^ POLY : b >> 1;
+			}
+			return p;
+		}
+
+
+		// Table which advances a CRC over nBytes zero bytes
+		static ShiftTable MakeShiftTable(size_t nBytes)
+		{
+			// x^(8 * nBytes) mod P, by repeated squaring of x^8
+			uint32_t op = 1u << 31;    // x^0
+			uint32_t sq = 1u << 23;    // x^8
+			for (size_t n = nBytes; n > 0; n >>= 1)
+			{
+				if (n & 1)
+					op = MultModP(sq, op);
+				sq = MultModP(sq, sq);
+			}
+
+			ShiftTable t{};
+			for (uint32_t i = 0; i < 256; i++)
+			{
+				for (uint32_t k = 0; k < 4; k++)
+					t[k][i] = MultModP(op, i << (8 * k));
+			}
+			return t;
+		}
+
+
+		static uint32_t Shift(const ShiftTable& t, uint32_t crc)
+		{
+			return t[0][crc & 0xFF] ^ t[1][(crc >> 8) & 0xFF] ^ t[2][(crc >> 16) & 0xFF] ^ t[3][crc >> 24];
+		}
+
+
+#if defined(NETLIB_CRC32C_SSE42)
+		static bool DetectSSE42()
+		{
+#	ifdef _MSC_VER
+			int info[4];
+			__cpuid(info, 1);
+			return (info[2] & (1 << 20)) != 0;
+#	else
+			return __builtin_cpu_supports("sse4.2");
+#	endif
+		}
+
+
+#	ifndef _MSC_VER
+		__attribute__((target("sse4.2")))
+#	endif
+		static void InterleavedSSE42(const uint8_t*& p, size_t& nSize, uint64_t& crc64, size_t nBlock, const ShiftTable& shift)
+		{
+			while (nSize >= 3 * nBlock)
+			{
+				uint64_t crc1 = 0, crc2 = 0;
+				for (size_t i = 0; i < nBlock; i += 8)
+				{
+					uint64_t v0, v1, v2;
+					std::memcpy(&v0, p + i, 8);
+					std::memcpy(&v1, p + nBlock + i, 8);
+					std::memcpy(&v2, p + 2 * nBlock + i, 8);
+					crc64 = _mm_crc32_u64(crc64, v0);
+					crc1 = _mm_crc32_u64(crc1, v1);
+					crc2 = _mm_crc32_u64(crc2, v2);
+				}
+				// Append the second and third stream to the first
+				crc64 = Shift(shift, (uint32_t)crc64) ^ (uint32_t)crc1;
+				crc64 = Shift(shift, (uint32_t)crc64) ^ (uint32_t)crc2;
+				p += 3 * nBlock;
+				nSize -= 3 * nBlock;
+			}
+		}
+
+
+#	ifndef _MSC_VER
+		__attribute__((target("sse4.2")))
+#	endif
+		static uint32_t ComputeSSE42(const uint8_t* p, size_t nSize, uint32_t crc)
+		{
+			static const ShiftTable longShift = MakeShiftTable(LONG_BLOCK);
+			static const ShiftTable shortShift = MakeShiftTable(SHORT_BLOCK);
+
+			uint64_t crc64 = ~crc;
+
+			// Three interleaved streams, first with long then with short blocks
+			InterleavedSSE42(p, nSize, crc64, LONG_BLOCK, longShift);
+			InterleavedSSE42(p, nSize, crc64, SHORT_BLOCK, shortShift);
+
+			// Single stream for the rest
+			while (nSize >= 8)
+			{
+				uint64_t v;
+				std::memcpy(&v, p, 8);
+				crc64 = _mm_crc32_u64(crc64, v);
+				p += 8;
+				nSize -= 8;
+			}
+			uint32_t crc32 = (uint32_t)crc64;
+			while (nSize-- > 0)
+				crc32 = _mm_crc32_u8(crc32, *p++);
+			return ~crc32;
+		}
+#endif
+
+
+#if defined(NETLIB_CRC32C_ARMV8)
+		static uint32_t ComputeARMv8(const uint8_t* p, size_t nSize, uint32_t crc)
+		{
+			crc = ~crc;
+			while (nSize >= 8)
+			{
+				uint64_t v;
+				std::memcpy(&v, p, 8);
+				crc = __crc32cd(crc, v);
+				p += 8;
+				nSize -= 8;
+			}
+			while (nSize-- > 0)
+				crc = __crc32cb(crc, *p++);
+			return ~crc;
+		}
+#endif
+	};
+
+
+} // namespace Net
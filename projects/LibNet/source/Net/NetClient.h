@@ -4,12 +4,37 @@
 
 #include "NetConnection.h"
 #include "NetMessage.h"
+#include "NetMessageRegistry.h"
 #include "NetMsgQueue.h"
+#include "NetSerializer.h"
+#include "NetUdpChannel.h"
+
+#include <cmath>
+#include <future>
+#include <random>
 
 
 namespace NETLIB_NAMESPACE {
 
 
+	// How the client reconnects after a failed connect attempt or a lost
+	// connection (see Client::SetReconnect)
+	struct ReconnectPolicy
+	{
+		bool bEnabled = false;
+		// Delay before the first retry, which grows by fFactor with every
+		// failed attempt, up to maxDelay
+		std::chrono::milliseconds initialDelay{ 100 };
+		std::chrono::milliseconds maxDelay{ 10000 };
+		double fFactor = 2.0;
+		// Every delay is randomized by up to +-fJitter of itself, so clients
+		// don't all come back at the same time when a server restarts
+		double fJitter = 0.25;
+		// Give up after this many failed attempts in a row (0 for never)
+		size_t nMaxAttempts = 0;
+	};
+
+
 	class Client
 	{
 	public:
@@ -22,108 +47,655 @@ namespace NETLIB_NAMESPACE {
 
 
 	public:
-		// Connect to server with hostname/ip-address and port
+		// Connect to server with hostname/ip-address and port, and wait until
+		// connected. Returns false if it failed (with reconnect, once it gave up).
 		bool Connect(const std::string& host, const uint16_t port)
 		{
-			try
+			return ConnectAsync(host, port).get();
+		}
+
+
+		// Start connecting to server, without blocking: The hostname is resolved
+		// and connected to by the client's thread. Returns a future which becomes
+		// true once connected, or false if it failed (see SetReconnect). Messages
+		// which are sent in the meantime are queued, and go out once connected.
+		std::future<bool> ConnectAsync(const std::string& host, const uint16_t port)
+		{
+			return StartConnecting(host, port, {});
+		}
+
+
+		// Connect to a server on the same host, which listens on a unix domain
+		// socket at path (see Server::SetLocalPath), and wait until connected
+		bool ConnectLocal(const std::string& path)
+		{
+			return ConnectLocalAsync(path).get();
+		}
+
+
+		// Start connecting to a server's unix domain socket at path, see ConnectAsync
+		std::future<bool> ConnectLocalAsync(const std::string& path)
+		{
+			return StartConnecting({}, 0, path);
+		}
+
+
+	private:
+		std::future<bool> StartConnecting(const std::string& host, const uint16_t port, const std::string& path)
+		{
+			std::promise<bool> promise;
+			std::future<bool> future = promise.get_future();
+
+			// Already connecting or connected
+			if (threadContext.joinable())
 			{
-				// Resolve hostname/ip-address into tangiable physical address
-				asio::ip::tcp::resolver resolver(m_asioContext);
-				asio::ip::tcp::resolver::results_type endpoints = resolver.resolve(host, std::to_string(port));
-				uint16_t port = endpoints->endpoint().port();
+				promise.set_value(false);
+				return future;
+			}
 
-				// Create connection
-				m_Connection = std::make_unique<Connection>(false, m_asioContext, asio::ip::tcp::socket(m_asioContext), m_MessagesIn, port);
+			m_Host = host;
+			m_Port = port;
+			m_LocalPath = path;
+			m_nAttempts = 0;
+			m_bStopping = false;
+			// From here on, the promise is only touched by the client's thread
+			m_ConnectPromise = std::move(promise);
 
-				// Tell the connection object to connect to server
-				m_Connection->ConnectToServer(endpoints);
+			// The connection exists right away, so it can queue messages
+			SetConnection(NewConnection());
 
-				// Start context thread
-				threadContext = std::thread([this]() { m_asioContext.run(); });
+			// Start context thread, the timer wheel ticks on it too
+			m_asioContext.restart();
+			m_WorkGuard.emplace(asio::make_work_guard(m_asioContext));
+			m_TimerTicker.Start();
+			asio::post(m_asioContext, [this]() { Resolve(); });
+			threadContext = std::thread([this]() { m_asioContext.run(); });
+			return future;
+		}
+
+
+	public:
+
+		// Use the server's UDP channel (see Server::EnableUdp), must be called before
+		// Connect. Once connected, the client registers its UDP endpoint with the
+		// server, then SendUdp works (see IsUdpReady).
+		void EnableUdp()
+		{
+			if (!m_pUdp)
+				m_pUdp = std::make_unique<UdpChannel>(m_asioContext,
+					[this](const asio::ip::udp::endpoint& from, const udp_datagram_header& header, Message& msg) { OnUdpDatagram(header, msg); });
+		}
+
+
+		// Exchange messages through shared memory rings of nRingBytes each, when
+		// connected to a server on the same host with ConnectLocal, and it agrees
+		// (see Server::EnableSharedMemory, Linux only), must be called before Connect
+		void EnableSharedMemory(size_t nRingBytes = NETLIB_SHM_RING_SIZE)
+		{
+			m_nShmRingBytes = nRingBytes;
+		}
+
+
+#if NETLIB_TLS
+		// Connect with TLS (see TlsOptions), must be called before Connect. When
+		// reconnecting, the last session with the server is resumed. Returns
+		// false if a file can't be loaded.
+		bool EnableTls(const TlsOptions& options)
+		{
+			try
+			{
+				m_pTlsContext = std::make_shared<TlsContext>(false, options);
 			}
 			catch (std::exception& e)
 			{
-				std::cerr << "Client Exception: " << e.what() << std::endl;
+				std::cerr << "Client TLS Exception: " << e.what() << std::endl;
 				return false;
 			}
 			return true;
 		}
 
 
+		// The TLS setup, for settings which TlsOptions doesn't cover (nullptr without TLS)
+		TlsContext* GetTlsContext() { return m_pTlsContext.get(); }
+#endif
+
+
+		// Reconnect after a failed connect attempt or a lost connection, must be
+		// called before Connect. Messages which are sent while reconnecting are
+		// queued, but the ones which were queued when the connection was lost are gone.
+		void SetReconnect(const ReconnectPolicy& policy)
+		{
+			m_Reconnect = policy;
+		}
+
+
+		// Select the body checksum the client wants to receive (see Connection::SetIntegrity),
+		// must be called before Connect
+		void SetIntegrity(Integrity preferred, bool bTrustLoopback = false)
+		{
+			m_IntegrityPreferred = preferred;
+			m_bTrustLoopback = bTrustLoopback;
+		}
+
+
+		// Select the compression of bodies with at least nThreshold bytes (see
+		// Connection::SetCompression), must be called before Connect
+		void SetCompression(Compression mode, size_t nThreshold = NETLIB_COMPRESS_THRESHOLD)
+		{
+			m_CompressionPreferred = mode;
+			m_nCompressThreshold = nThreshold;
+		}
+
+
+		// Set the watermarks of the outgoing queue, and what happens to messages
+		// sent above them (see SendLimits), must be called before Connect
+		void SetSendLimits(const SendLimits& limits)
+		{
+			m_SendLimits = limits;
+		}
+
+
+		// Set the heartbeat and the timeouts of the connection (see Timeouts),
+		// must be called before Connect
+		void SetTimeouts(const Timeouts& timeouts)
+		{
+			m_Timeouts = timeouts;
+		}
+
+
+		// Conflate messages of type by their key (see ConflationTable),
+		// must be called before Connect
+		void SetConflation(uint32_t type, ConflationKey key = nullptr)
+		{
+			m_Conflation.Add(type, std::move(key));
+		}
+
+
+		// Set the factory which creates a sink for every incoming stream (see
+		// Connection::SetStreamSink), must be called before Connect
+		void SetStreamSink(StreamSinkFactory factory)
+		{
+			m_StreamSinkFactory = std::move(factory);
+		}
+
+
 		// Disconnect from server
 		void Disconnect()
 		{
+			// Don't reconnect anymore
+			m_bStopping = true;
+
 			// If connection exists, and it's connected then...
-			if (IsConnected())
+			std::shared_ptr<Connection> connection = GetConnection();
+			if (threadContext.joinable())
 			{
-				// ...disconnect from server gracefully
-				m_Connection->Disconnect();
+				// ...disconnect from server gracefully. It's closed (and the timers
+				// are cancelled) before the context stops, as handlers which are
+				// still queued would run on the next Connect, and take it down.
+				if (connection && connection->IsConnected())
+					connection->DisconnectAndWait();
+
+				std::promise<void> cancelled;
+				asio::post(m_asioContext,
+					[this, &cancelled]()
+					{
+						m_Resolver.cancel();
+						m_ReconnectTimer.cancel();
+						m_UdpHelloTimer.cancel();
+						cancelled.set_value();
+					});
+				cancelled.get_future().wait();
 			}
 
 			// Either way, we're also done with the asio context...				
+			m_WorkGuard.reset();
 			m_asioContext.stop();
 			// ...and its thread
 			if (threadContext.joinable())
 				threadContext.join();
 
+			if (m_pUdp)
+				m_pUdp->Close();
+			m_nUdpToken = 0;
+			m_bUdpReady = false;
+
+			// A connect which is still waiting for its result has failed
+			if (m_ConnectPromise)
+			{
+				m_ConnectPromise->set_value(false);
+				m_ConnectPromise.reset();
+			}
+
 			// Destroy the connection object
-			m_Connection.release();
+			SetConnection(nullptr);
 		}
 
 
-		// Check if client is actually connected to a server
+		// Check if client is actually connected to a server (or connecting to it)
 		bool IsConnected()
 		{
-			if (m_Connection)
-				return m_Connection->IsConnected();
+			std::shared_ptr<Connection> connection = GetConnection();
+			if (connection)
+				return connection->IsConnected();
 			else
 				return false;
 		}
 
-		// Send message to server
-		void Send(Message& msg)
+		// Send message to server, the caller keeps its message...
+		// Returns false if it wasn't queued (not connected, or see SetSendLimits)
+		bool Send(const Message& msg)
 		{
-			if (IsConnected())
-				m_Connection->Send(msg);
+			std::shared_ptr<Connection> connection = GetConnection();
+			if (connection && connection->IsConnected())
+				return connection->Send(msg);
+			return false;
 		}
 
-//		virtual bool OnConnect() {}
-//		virtual void OnDisconnect() {}
+
+		// ...or hands it over without any copy
+		bool Send(Message&& msg)
+		{
+			std::shared_ptr<Connection> connection = GetConnection();
+			if (connection && connection->IsConnected())
+				return connection->Send(std::move(msg));
+			return false;
+		}
+
+
+		// Send message to server over UDP, it may get lost. Returns false if the UDP
+		// endpoint isn't registered yet, or the message doesn't fit into a datagram.
+		bool SendUdp(const Message& msg)
+		{
+			uint64_t token = m_nUdpToken.load(std::memory_order_acquire);
+			if (!m_pUdp || !m_bUdpReady.load(std::memory_order_acquire) || token == 0)
+				return false;
+
+			Message msgOut(msg);
+			msgOut.UpdateCRC(Integrity::CRC32C);
+			return m_pUdp->Send({}, { m_nUdpID.load(std::memory_order_relaxed), token }, msgOut);
+		}
+
+
+		// The server knows the client's UDP endpoint, so datagrams work both ways
+		bool IsUdpReady() const { return m_bUdpReady.load(std::memory_order_acquire); }
+
+
+		// Send a payload of any size as a stream (see Connection::SendStream),
+		// returns the ID of the stream, 0 if not connected
+		uint32_t SendStream(uint32_t type, StreamSource source)
+		{
+			std::shared_ptr<Connection> connection = GetConnection();
+			if (connection && connection->IsConnected())
+				return connection->SendStream(type, std::move(source));
+			return 0;
+		}
+
+
+		uint32_t SendStream(uint32_t type, Buffer data)
+		{
+			std::shared_ptr<Connection> connection = GetConnection();
+			if (connection && connection->IsConnected())
+				return connection->SendStream(type, std::move(data));
+			return 0;
+		}
+
+		// Called by Update when the connection is up (again), and when it's lost
+		virtual void OnConnect() {}
+		virtual void OnDisconnect() {}
 		virtual void OnMessage(Message& msg) {}
 
+		// Called when the outgoing queue, which had been above a high watermark,
+		// has drained below the low watermarks (see SetSendLimits)
+		virtual void OnWritable() {}
+
 		// Process incoming messages
 		void Update(size_t nMaxMessages = -1, bool wait = false)
 		{
-			if (!IsConnected())
+			ProcessMessages([this](Message& msg) { OnMessage(msg); }, nMaxMessages, wait);
+		}
+
+
+		// Process incoming messages with a MessageDispatcher instead of OnMessage
+		template<typename Dispatcher>
+			requires requires(Dispatcher& dispatcher, Message& msg) { dispatcher.Dispatch(msg); }
+		void Update(Dispatcher& dispatcher, size_t nMaxMessages = -1, bool wait = false)
+		{
+			ProcessMessages([&dispatcher](Message& msg) { dispatcher.Dispatch(msg); }, nMaxMessages, wait);
+		}
+
+	private:
+		// Takes the incoming messages and passes them to handler
+		template<typename MessageHandler>
+		void ProcessMessages(MessageHandler&& handler, size_t nMaxMessages, bool wait)
+		{
+			// Without a connection, nothing arrives (the events of a lost
+			// connection are still delivered)
+			if (!GetConnection())
 				return;
 
-			if (wait) m_MessagesIn.Wait();
+			if (wait && m_MessagesPending.empty()) m_MessagesIn.Wait();
+
+			// Take all messages which arrived so far in one go, what isn't
+			// processed this time stays pending for the next Update
+			m_MessagesIn.Drain(m_MessagesPending);
 
 			// Process as many messages as we can up to the value specified
 			size_t nMessageCount = 0;
-			while (nMessageCount < nMaxMessages && !m_MessagesIn.IsEmpty())
+			while (nMessageCount < nMaxMessages && !m_MessagesPending.empty())
 			{
 				// Grab the front message
-				auto msg = m_MessagesIn.PopFront();
+				auto msg = std::move(m_MessagesPending.front());
+				m_MessagesPending.pop_front();
+
+				// Events of the connection itself aren't for the app
+				if (IsControlMessage(msg.header.type))
+				{
+					if (msg.header.type == (uint32_t)ControlMsg::Writable)
+						OnWritable();
+					else if (msg.header.type == (uint32_t)ControlMsg::Connected)
+						OnConnect();
+					else if (msg.header.type == (uint32_t)ControlMsg::Disconnected)
+						OnDisconnect();
+					continue;
+				}
 
 				// Pass to message handler
-				OnMessage(msg);
+				handler(msg);
 
 				nMessageCount++;
 			}
 		}
 
-	private:
-		// Thread safe queue for incoming message packets
-		MsgQueue m_MessagesIn;
+		// Current connection, which is replaced when reconnecting
+		std::shared_ptr<Connection> GetConnection()
+		{
+			std::scoped_lock scoped_lock(m_mutexConnection);
+			return m_Connection;
+		}
+
+
+		void SetConnection(std::shared_ptr<Connection> connection)
+		{
+			std::scoped_lock scoped_lock(m_mutexConnection);
+			m_Connection = std::move(connection);
+		}
+
+
+		std::shared_ptr<Connection> NewConnection()
+		{
+			auto connection = std::make_shared<Connection>(false, m_asioContext, asio::ip::tcp::socket(m_asioContext), m_MessagesIn, m_Port);
+			connection->SetIntegrity(m_IntegrityPreferred, m_bTrustLoopback);
+			connection->SetCompression(m_CompressionPreferred, m_nCompressThreshold);
+			connection->SetStreamSink(m_StreamSinkFactory);
+			connection->SetSendLimits(m_SendLimits);
+			connection->SetConflation(m_Conflation);
+			connection->SetTimeouts(m_Timeouts, m_TimerTicker.GetWheel());
+			connection->SetSharedMemory(m_nShmRingBytes);
+#if NETLIB_TLS
+			connection->SetTls(m_pTlsContext, m_Host, m_Host + ":" + std::to_string(m_Port));
+#endif
+			if (m_pUdp)
+				connection->SetUdpTokenHandler([this](uint64_t id, uint64_t token) { OnUdpToken(id, token); });
+			return connection;
+		}
+
+
+		// Everything below runs on the client's thread
+
+		// ASYNC - Resolve hostname/ip-address into tangiable physical addresses, and connect
+		void Resolve()
+		{
+			// A unix domain socket is connected to right away
+			if (!m_LocalPath.empty())
+			{
+				ConnectTo({ asio::local::stream_protocol::endpoint(m_LocalPath) });
+				return;
+			}
 
-		// The single connection instance
-		std::unique_ptr<Connection> m_Connection;
+			m_Resolver.async_resolve(m_Host, std::to_string(m_Port),
+				[this](std::error_code ec, asio::ip::tcp::resolver::results_type results)
+				{
+					if (m_bStopping)
+						return;
 
-		// asio context handles the data transfer...
+					if (ec)
+					{
+						std::cout << "Resolve error: " << ec.message() << std::endl;
+						OnConnectFailed();
+						return;
+					}
+
+					std::vector<StreamProtocol::endpoint> endpoints;
+					for (const auto& result : results)
+						endpoints.emplace_back(result.endpoint());
+					ConnectTo(endpoints);
+				});
+		}
+
+
+		// ASYNC - Connect the current connection to one of endpoints
+		void ConnectTo(const std::vector<StreamProtocol::endpoint>& endpoints)
+		{
+			std::shared_ptr<Connection> connection = GetConnection();
+			connection->ConnectToServer(endpoints,
+				[this, connection](std::error_code ec)
+				{
+					if (ec)
+					{
+						OnConnectFailed();
+						return;
+					}
+
+					// Connected, reconnect from now on if it's lost
+					m_nAttempts = 0;
+					if (m_Reconnect.bEnabled)
+						connection->SetCloseHandler([this]() { OnConnectionLost(); });
+					if (m_ConnectPromise)
+					{
+						m_ConnectPromise->set_value(true);
+						m_ConnectPromise.reset();
+					}
+
+					Message msg;
+					msg.header.type = (uint32_t)ControlMsg::Connected;
+					msg.remote = connection;
+					m_MessagesIn.PushBack(std::move(msg));
+				});
+		}
+
+
+		// A connect attempt failed, try again later or give up
+		void OnConnectFailed()
+		{
+			m_nAttempts++;
+			if (!m_bStopping && m_Reconnect.bEnabled && (m_Reconnect.nMaxAttempts == 0 || m_nAttempts < m_Reconnect.nMaxAttempts))
+			{
+				ScheduleReconnect();
+				return;
+			}
+
+			if (m_ConnectPromise)
+			{
+				m_ConnectPromise->set_value(false);
+				m_ConnectPromise.reset();
+			}
+			// Drops what has been queued, and reports the disconnect
+			GetConnection()->Disconnect();
+		}
+
+
+		// The connection which was up is lost, start over with a new one (the
+		// handler is called on the strand of the old connection)
+		void OnConnectionLost()
+		{
+			if (m_bStopping)
+				return;
+
+			// The new connection gets a new UDP token
+			m_bUdpReady = false;
+			m_UdpHelloTimer.cancel();
+
+			SetConnection(NewConnection());
+			m_nAttempts = 0;
+			ScheduleReconnect();
+		}
+
+
+		// The server handed out the ID and token of the connection's datagrams,
+		// so register with its UDP channel (which is at the TCP address and port)
+		void OnUdpToken(uint64_t id, uint64_t token)
+		{
+			asio::ip::tcp::endpoint server = GetConnection()->GetRemoteEndpoint();
+			try
+			{
+				m_bUdpReady = false;
+				m_pUdp->Connect(asio::ip::udp::endpoint(server.address(), server.port()));
+			}
+			catch (std::exception& e)
+			{
+				std::cerr << "Client UDP Exception: " << e.what() << std::endl;
+				return;
+			}
+
+			m_nUdpID = id;
+			m_nUdpToken.store(token, std::memory_order_release);
+			m_nUdpHelloAttempts = 0;
+			SendUdpHello();
+		}
+
+
+		// ASYNC - Send UdpHello datagrams until the server answers (they may get lost)
+		void SendUdpHello()
+		{
+			if (m_bUdpReady || m_nUdpHelloAttempts++ >= NETLIB_UDP_HELLO_ATTEMPTS)
+				return;
+
+			Message msg;
+			msg.header.type = (uint32_t)ControlMsg::UdpHello;
+			msg.UpdateCRC(Integrity::CRC32C);
+			m_pUdp->Send({}, { m_nUdpID.load(std::memory_order_relaxed), m_nUdpToken.load(std::memory_order_relaxed) }, msg);
+
+			m_UdpHelloTimer.expires_after(std::chrono::milliseconds(NETLIB_UDP_HELLO_INTERVAL_MS));
+			m_UdpHelloTimer.async_wait(
+				[this](std::error_code ec)
+				{
+					if (!ec && !m_bStopping)
+						SendUdpHello();
+				});
+		}
+
+
+		// A datagram arrived from the server (on the client's thread)
+		void OnUdpDatagram(const udp_datagram_header& header, Message& msg)
+		{
+			if (header.token == 0 || header.token != m_nUdpToken.load(std::memory_order_relaxed) || header.id != m_nUdpID.load(std::memory_order_relaxed))
+				return;
+
+			if (msg.header.type == (uint32_t)ControlMsg::UdpHello)
+			{
+				m_bUdpReady.store(true, std::memory_order_release);
+				m_UdpHelloTimer.cancel();
+				return;
+			}
+			if (IsControlMessage(msg.header.type))
+				return;
+
+			msg.remote = GetConnection();
+			m_MessagesIn.PushBack(std::move(msg));
+		}
+
+
+		// ASYNC - Wait the backoff delay of the current attempt, then connect again
+		void ScheduleReconnect()
+		{
+			// Exponential backoff, with jitter
+			double fDelay = (double)m_Reconnect.initialDelay.count() * std::pow(m_Reconnect.fFactor, (double)(m_nAttempts > 0 ? m_nAttempts - 1 : 0));
+			fDelay = std::min(fDelay, (double)m_Reconnect.maxDelay.count());
+			std::uniform_real_distribution<double> jitter(-m_Reconnect.fJitter, m_Reconnect.fJitter);
+			fDelay *= 1.0 + jitter(m_Random);
+
+			std::cout << "Reconnecting in " << (long long)fDelay << " ms" << std::endl;
+			m_ReconnectTimer.expires_after(std::chrono::milliseconds((long long)std::max(fDelay, 0.0)));
+			m_ReconnectTimer.async_wait(
+				[this](std::error_code ec)
+				{
+					if (!ec && !m_bStopping)
+						Resolve();
+				});
+		}
+
+
+	private:
+		// asio context handles the data transfer (declared first, as it has to
+		// outlive the messages still referencing the connection)...
 		asio::io_context m_asioContext;
 		// ...but needs a thread of its own to execute its work commands
 		std::thread threadContext;
+		// Timer wheel for the timeouts of the connection, ticked by the context
+		TimerWheelTicker m_TimerTicker{ m_asioContext, std::make_shared<TimerWheel>() };
+		// Keeps the context running while the client waits to reconnect
+		std::optional<asio::executor_work_guard<asio::io_context::executor_type>> m_WorkGuard;
+
+		// Where to connect to (host and port, or the path of a unix domain socket),
+		// and the state of the connect attempts (client's thread only)
+		std::string m_Host;
+		uint16_t m_Port = 0;
+		std::string m_LocalPath;
+		asio::ip::tcp::resolver m_Resolver{ m_asioContext };
+		asio::steady_timer m_ReconnectTimer{ m_asioContext };
+		std::minstd_rand m_Random{ std::random_device()() };
+		size_t m_nAttempts = 0;
+		std::optional<std::promise<bool>> m_ConnectPromise;
+		// Set by Disconnect, so nothing is started anymore
+		std::atomic<bool> m_bStopping = false;
+		ReconnectPolicy m_Reconnect;
+
+		// UDP channel to the server (see EnableUdp), the ID and token of its
+		// datagrams, and whether the server has confirmed the registration
+		std::unique_ptr<UdpChannel> m_pUdp;
+		std::atomic<uint64_t> m_nUdpID = 0;
+		std::atomic<uint64_t> m_nUdpToken = 0;
+		std::atomic<bool> m_bUdpReady = false;
+		asio::steady_timer m_UdpHelloTimer{ m_asioContext };
+		size_t m_nUdpHelloAttempts = 0;
+
+		// Thread safe queue for incoming message packets...
+		MsgQueueIn m_MessagesIn;
+		// ...and the ones taken from it, but not processed yet
+		std::pmr::deque<Message> m_MessagesPending{ &BufferPool::GetDefault() };
+
+		// Body checksum wanted for receiving (see SetIntegrity)
+		Integrity m_IntegrityPreferred = Integrity::CRC32C;
+		bool m_bTrustLoopback = false;
+
+		// Compression wanted for sending (see SetCompression)
+		Compression m_CompressionPreferred = Compression::None;
+		size_t m_nCompressThreshold = NETLIB_COMPRESS_THRESHOLD;
+
+		// Creates the sinks of incoming streams (see SetStreamSink)
+		StreamSinkFactory m_StreamSinkFactory;
+
+		// Limits of the outgoing queue (see SetSendLimits)
+		SendLimits m_SendLimits;
+
+		// Message types which are conflated (see SetConflation)
+		ConflationTable m_Conflation;
+
+		// Liveness checks of the connection (see SetTimeouts)
+		Timeouts m_Timeouts;
+
+		// Size of the shared memory rings, 0 if they aren't asked for (see EnableSharedMemory)
+		size_t m_nShmRingBytes = 0;
+
+#if NETLIB_TLS
+		// TLS setup of the connection, which keeps the sessions (see EnableTls)
+		std::shared_ptr<TlsContext> m_pTlsContext;
+#endif
+
+		// The single connection instance, shared with its pending asio handlers
+		// (replaced when reconnecting, hence the mutex)
+		std::shared_ptr<Connection> m_Connection;
+		std::mutex m_mutexConnection;
 	};
 
 
@@ -3,7 +3,13 @@
 #include <memory>
 #include <deque>
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
 #include <vector>
+#include <algorithm>
+#include <cstring>
+#include <optional>
 #include <iostream>
 
 
@@ -15,6 +21,24 @@
 #endif
 
 
+// Run the socket I/O on io_uring instead of epoll (Linux only, needs liburing,
+// can be set by application or with "premake5 --io-uring")
+#ifndef NETLIB_IO_URING
+#	define NETLIB_IO_URING 0
+#endif
+#if NETLIB_IO_URING
+#	define ASIO_HAS_IO_URING
+#	define ASIO_DISABLE_EPOLL
+#endif
+
+
+// Encrypt TCP connections with TLS, if they are set up for it (needs OpenSSL,
+// can be set by application or with "premake5 --tls")
+#ifndef NETLIB_TLS
+#	define NETLIB_TLS 0
+#endif
+
+
 // for ASIO only
 #define _WINSOCK_DEPRECATED_NO_WARNINGS
 // setup ASIO to be used without boost
@@ -28,3 +52,100 @@
 #ifndef NETLIB_NAMESPACE
 #	define NETLIB_NAMESPACE Net
 #endif
+
+
+// Limits for coalescing queued outgoing messages into a single write (can be set by application)
+#ifndef NETLIB_WRITE_BATCH_BYTES
+#	define NETLIB_WRITE_BATCH_BYTES (256 * 1024)
+#endif
+#ifndef NETLIB_WRITE_BATCH_BUFFERS
+#	define NETLIB_WRITE_BATCH_BUFFERS 64
+#endif
+
+// Use the lock-free queue (MsgQueueMPSC) for incoming messages, 0 selects the locked MsgQueue (can be set by application)
+#ifndef NETLIB_LOCKFREE_INCOMING
+#	define NETLIB_LOCKFREE_INCOMING 1
+#endif
+
+// Size of the per-connection receive buffer, which is filled by a single socket read (can be set by application)
+#ifndef NETLIB_RECV_BUFFER_SIZE
+#	define NETLIB_RECV_BUFFER_SIZE (64 * 1024)
+#endif
+
+// Number of receive slabs per io_context which are registered with io_uring as fixed buffers (can be set by application)
+#ifndef NETLIB_IO_URING_RECV_BUFFERS
+#	define NETLIB_IO_URING_RECV_BUFFERS 64
+#endif
+
+// Largest message body which is accepted (and held in memory), a peer announcing
+// a larger one is disconnected. Larger payloads have to be streamed. (can be set by application)
+#ifndef NETLIB_MAX_FRAME_SIZE
+#	define NETLIB_MAX_FRAME_SIZE (16 * 1024 * 1024)
+#endif
+
+// Size of the chunks a stream is sent in, and the number of incoming streams
+// a connection may have open at once (can be set by application)
+#ifndef NETLIB_STREAM_CHUNK_SIZE
+#	define NETLIB_STREAM_CHUNK_SIZE (32 * 1024)
+#endif
+#ifndef NETLIB_MAX_STREAMS
+#	define NETLIB_MAX_STREAMS 64
+#endif
+
+// Default high watermarks of a connection's outgoing queue, in bytes and in
+// messages (see SendLimits, can be set by application)
+#ifndef NETLIB_SEND_QUEUE_HIGH_BYTES
+#	define NETLIB_SEND_QUEUE_HIGH_BYTES (64 * 1024 * 1024)
+#endif
+#ifndef NETLIB_SEND_QUEUE_HIGH_MESSAGES
+#	define NETLIB_SEND_QUEUE_HIGH_MESSAGES (1024 * 1024)
+#endif
+
+// Bodies smaller than this are never compressed (can be set by application)
+#ifndef NETLIB_COMPRESS_THRESHOLD
+#	define NETLIB_COMPRESS_THRESHOLD 256
+#endif
+
+// Resolution of the connection timeouts, and the number of slots of the
+// timer wheel which runs them (can be set by application)
+#ifndef NETLIB_TIMER_TICK_MS
+#	define NETLIB_TIMER_TICK_MS 100
+#endif
+#ifndef NETLIB_TIMER_WHEEL_SLOTS
+#	define NETLIB_TIMER_WHEEL_SLOTS 512
+#endif
+
+// Largest UDP datagram which is sent or received (datagram header, message header
+// and body), small enough to avoid IP fragmentation on common links (can be set by application)
+#ifndef NETLIB_UDP_MAX_DATAGRAM
+#	define NETLIB_UDP_MAX_DATAGRAM 1200
+#endif
+// Datagrams passed to the kernel by a single sendmmsg / recvmmsg call, and the
+// number of datagrams waiting to be sent, above which sending fails (can be set by application)
+#ifndef NETLIB_UDP_SEND_BATCH
+#	define NETLIB_UDP_SEND_BATCH 1024
+#endif
+#ifndef NETLIB_UDP_RECV_BATCH
+#	define NETLIB_UDP_RECV_BATCH 64
+#endif
+#ifndef NETLIB_UDP_SEND_QUEUE_MAX
+#	define NETLIB_UDP_SEND_QUEUE_MAX (64 * 1024)
+#endif
+// How often, and how many times, a client tries to register its UDP endpoint (can be set by application)
+#ifndef NETLIB_UDP_HELLO_INTERVAL_MS
+#	define NETLIB_UDP_HELLO_INTERVAL_MS 200
+#endif
+#ifndef NETLIB_UDP_HELLO_ATTEMPTS
+#	define NETLIB_UDP_HELLO_ATTEMPTS 25
+#endif
+
+// Size of each of the two shared memory rings of a same-host connection (see
+// Server::EnableSharedMemory), rounded up to a power of two (can be set by application)
+#ifndef NETLIB_SHM_RING_SIZE
+#	define NETLIB_SHM_RING_SIZE (4 * 1024 * 1024)
+#endif
+
+// Maximum range of message type ids covered by a MessageDispatcher jump table (can be set by application)
+#ifndef NETLIB_DISPATCH_TABLE_MAX
+#	define NETLIB_DISPATCH_TABLE_MAX 4096
+#endif
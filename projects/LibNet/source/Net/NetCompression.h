@@ -0,0 +1,302 @@
+#pragma once
+
+#include "NetCommon.h"
+
+#include <bit>
+
+
+namespace NETLIB_NAMESPACE {
+
+
+	// Compression of a message body, chosen per connection at connect time
+	enum class Compression : uint8_t
+	{
+		// Body is sent as it is
+		None = 0,
+		// LZ4 block format, preceded by the uncompressed size (uint32_t)
+		LZ4 = 1,
+	};
+
+
+	// Bit mask of Compression values, as announced in the connection handshake
+	inline constexpr uint32_t CompressionBit(Compression mode) { return 1u << (uint32_t)mode; }
+
+
+	// Fast compressor producing the LZ4 block format (greedy matching with a
+	// single-entry hash table, like the reference LZ4 "fast" mode).
+	//
+	// A block is a sequence of
+	//   token (literal length << 4 | match length - 4), [more literal length],
+	//   literals, match offset (uint16_t), [more match length]
+	// and ends with a sequence which only has literals. Lengths of 15 or more
+	// continue in the following bytes, which are added up until one is < 255.
+	//
+	// The decoder checks every length and offset, so a corrupt or malicious
+	// block can't make it read or write outside of its buffers.
+	class LZ4
+	{
+	public:
+		// Space the compressor needs in the worst case (incompressible data)
+		static constexpr size_t GetMaxCompressedSize(size_t nSize)
+		{
+			return nSize + nSize / 255 + 16;
+		}
+
+
+		// Largest size nSize compressed bytes can expand to
+		static constexpr size_t GetMaxDecompressedSize(size_t nSize)
+		{
+			return nSize * 255;
+		}
+
+
+		// Compresses nSrc bytes into pDst, returns the compressed size,
+		// or 0 if it doesn't fit into nDst bytes
+		static size_t Compress(const uint8_t* pSrc, size_t nSrc, uint8_t* pDst, size_t nDst)
+		{
+			const uint8_t* const pEnd = pSrc + nSrc;
+			uint8_t* const pDstEnd = pDst + nDst;
+			const uint8_t* pAnchor = pSrc;
+			uint8_t* pOut = pDst;
+
+			if (nSrc >= MIN_INPUT_SIZE)
+			{
+				// Positions of recently seen 4 byte sequences, by their hash
+				uint32_t table[HASH_SIZE] = {};
+
+				// The format wants the last bytes to be literals
+				const uint8_t* const pMatchStartLimit = pEnd - MATCH_START_LIMIT;
+				const uint8_t* const pMatchEndLimit = pEnd - LAST_LITERALS;
+
+				const uint8_t* p = pSrc + 1;
+				while (p < pMatchStartLimit)
+				{
+					uint32_t nSequence = Read32(p);
+					uint32_t& nEntry = table[Hash(nSequence)];
+					const uint8_t* pMatch = pSrc + nEntry;
+					nEntry = (uint32_t)(p - pSrc);
+
+					if (pMatch >= p || p - pMatch > MAX_OFFSET || Read32(pMatch) != nSequence)
+					{
+						// The longer nothing matches, the larger the steps get,
+						// so incompressible data is skipped quickly
+						p += 1 + ((p - pAnchor) >> SKIP_SHIFT);
+						continue;
+					}
+
+					// The match may start before the bytes which were hashed
+					while (p > pAnchor && pMatch > pSrc && p[-1] == pMatch[-1])
+					{
+						p--;
+						pMatch--;
+					}
+
+					const uint8_t* pMatchEnd = p + MIN_MATCH + CountEqual(p + MIN_MATCH, pMatch + MIN_MATCH, pMatchEndLimit);
+
+					if (!WriteSequence(pOut, pDstEnd, pAnchor, (size_t)(p - pAnchor), (size_t)(p - pMatch), (size_t)(pMatchEnd - p) - MIN_MATCH))
+						return 0;
+
+					p = pMatchEnd;
+					pAnchor = p;
+
+					// Remember a position inside the match too, long matches
+					// would leave the table behind otherwise
+					if (p < pMatchStartLimit)
+						table[Hash(Read32(p - 2))] = (uint32_t)(p - 2 - pSrc);
+				}
+			}
+
+			// Everything behind the last match is a literal
+			size_t nLiterals = (size_t)(pEnd - pAnchor);
+			if ((size_t)(pDstEnd - pOut) < 1 + nLiterals / 255 + 1 + nLiterals)
+				return 0;
+			*pOut++ = (uint8_t)(GetTokenLength(nLiterals) << 4);
+			pOut = WriteLength(pOut, nLiterals);
+			if (nLiterals > 0)
+				std::memcpy(pOut, pAnchor, nLiterals);
+			pOut += nLiterals;
+
+			return (size_t)(pOut - pDst);
+		}
+
+
+		// Decompresses nSrc bytes into exactly nDst bytes at pDst,
+		// returns false if the block is corrupt
+		static bool Decompress(const uint8_t* pSrc, size_t nSrc, uint8_t* pDst, size_t nDst)
+		{
+			const uint8_t* p = pSrc;
+			const uint8_t* const pEnd = pSrc + nSrc;
+			uint8_t* pOut = pDst;
+			uint8_t* const pDstEnd = pDst + nDst;
+
+			while (p < pEnd)
+			{
+				uint8_t nToken = *p++;
+
+				// Literals
+				size_t nLiterals = nToken >> 4;
+				if (nLiterals == 15 && !ReadLength(p, pEnd, nLiterals))
+					return false;
+				if (nLiterals > (size_t)(pEnd - p) || nLiterals > (size_t)(pDstEnd - pOut))
+					return false;
+				if (nLiterals > 0)
+					std::memcpy(pOut, p, nLiterals);
+				p += nLiterals;
+				pOut += nLiterals;
+
+				// The last sequence has no match
+				if (p == pEnd)
+					break;
+
+				// Match
+				if (pEnd - p < 2)
+					return false;
+				size_t nOffset = (size_t)p[0] | ((size_t)p[1] << 8);
+				p += 2;
+				if (nOffset == 0 || nOffset > (size_t)(pOut - pDst))
+					return false;
+
+				size_t nMatch = nToken & 15;
+				if (nMatch == 15 && !ReadLength(p, pEnd, nMatch))
+					return false;
+				nMatch += MIN_MATCH;
+				if (nMatch > (size_t)(pDstEnd - pOut))
+					return false;
+
+				const uint8_t* pMatch = pOut - nOffset;
+				if (nOffset >= nMatch)
+				{
+					std::memcpy(pOut, pMatch, nMatch);
+					pOut += nMatch;
+				}
+				else
+				{
+					// Overlapping match, repeats the last nOffset bytes
+					for (size_t i = 0; i < nMatch; i++)
+						*pOut++ = *pMatch++;
+				}
+			}
+
+			return pOut == pDstEnd;
+		}
+
+
+	private:
+		static constexpr size_t MIN_MATCH = 4;
+		static constexpr size_t LAST_LITERALS = 5;
+		static constexpr size_t MATCH_START_LIMIT = 12;
+		static constexpr size_t MIN_INPUT_SIZE = MATCH_START_LIMIT + 1;
+		static constexpr ptrdiff_t MAX_OFFSET = 65535;
+		static constexpr size_t SKIP_SHIFT = 6;
+		static constexpr uint32_t HASH_BITS = 12;
+		static constexpr size_t HASH_SIZE = size_t(1) << HASH_BITS;
+
+
+		static uint32_t Read32(const uint8_t* p)
+		{
+			uint32_t n;
+			std::memcpy(&n, p, sizeof(n));
+			return n;
+		}
+
+
+		static uint64_t Read64(const uint8_t* p)
+		{
+			uint64_t n;
+			std::memcpy(&n, p, sizeof(n));
+			return n;
+		}
+
+
+		static uint32_t Hash(uint32_t nSequence)
+		{
+			return (nSequence * 2654435761u) >> (32 - HASH_BITS);
+		}
+
+
+		// Number of equal bytes at p and pMatch, p doesn't go beyond pLimit
+		static size_t CountEqual(const uint8_t* p, const uint8_t* pMatch, const uint8_t* pLimit)
+		{
+			const uint8_t* pStart = p;
+
+			// 8 bytes at a time, the first different byte is the lowest set one
+			if constexpr (std::endian::native == std::endian::little)
+			{
+				while (p + 8 <= pLimit)
+				{
+					uint64_t nDiff = Read64(p) ^ Read64(pMatch);
+					if (nDiff)
+						return (size_t)(p - pStart) + (std::countr_zero(nDiff) >> 3);
+					p += 8;
+					pMatch += 8;
+				}
+			}
+
+			while (p < pLimit && *p == *pMatch)
+			{
+				p++;
+				pMatch++;
+			}
+			return (size_t)(p - pStart);
+		}
+
+
+		// 4 bit part of a length in the token
+		static uint8_t GetTokenLength(size_t nLength)
+		{
+			return (uint8_t)std::min<size_t>(nLength, 15);
+		}
+
+
+		// Writes the rest of a length, which didn't fit into the token, returns the end
+		static uint8_t* WriteLength(uint8_t* p, size_t nLength)
+		{
+			if (nLength < 15)
+				return p;
+
+			nLength -= 15;
+			while (nLength >= 255)
+			{
+				*p++ = 255;
+				nLength -= 255;
+			}
+			*p++ = (uint8_t)nLength;
+			return p;
+		}
+
+
+		// Adds the length bytes following a token to nLength
+		static bool ReadLength(const uint8_t*& p, const uint8_t* pEnd, size_t& nLength)
+		{
+			uint8_t n;
+			do
+			{
+				if (p >= pEnd)
+					return false;
+				n = *p++;
+				nLength += n;
+			} while (n == 255);
+			return true;
+		}
+
+
+		static bool WriteSequence(uint8_t*& pOut, uint8_t* pDstEnd, const uint8_t* pLiterals, size_t nLiterals, size_t nOffset, size_t nMatch)
+		{
+			// Token, lengths, literals and offset in the worst case
+			if ((size_t)(pDstEnd - pOut) < 1 + (nLiterals / 255 + 1) + nLiterals + 2 + (nMatch / 255 + 1))
+				return false;
+
+			*pOut++ = (uint8_t)(GetTokenLength(nLiterals) << 4 | GetTokenLength(nMatch));
+			pOut = WriteLength(pOut, nLiterals);
+			std::memcpy(pOut, pLiterals, nLiterals);
+			pOut += nLiterals;
+
+			*pOut++ = (uint8_t)nOffset;
+			*pOut++ = (uint8_t)(nOffset >> 8);
+			pOut = WriteLength(pOut, nMatch);
+			return true;
+		}
+	};
+
+
+} // namespace Net
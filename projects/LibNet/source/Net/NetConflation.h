@@ -0,0 +1,81 @@
+#pragma once
+
+#include "NetCommon.h"
+
+#include "NetMessage.h"
+
+#include <functional>
+#include <unordered_map>
+
+
+namespace NETLIB_NAMESPACE {
+
+
+	// Returns the key of a conflatable message, read from its (plain) body.
+	// Messages of the same type and key carry the latest value of the same
+	// thing (like the position of an entity), so only the newest one matters.
+	using ConflationKey = std::function<uint64_t(const Message& msg)>;
+
+
+	// Message types which are conflated ("latest value wins"): A message which
+	// is sent while an older one of the same type and key is still queued (and
+	// not being written yet) replaces the older one in place. So a slow
+	// consumer gets the newest value of every key, instead of all stale ones.
+	class ConflationTable
+	{
+	public:
+		// Conflate messages of type by their key (without key, all messages
+		// of the type are conflated into one)
+		void Add(uint32_t type, ConflationKey key = nullptr)
+		{
+			m_Keys[type] = std::move(key);
+		}
+
+
+		void Remove(uint32_t type)
+		{
+			m_Keys.erase(type);
+		}
+
+
+		bool IsEmpty() const { return m_Keys.empty(); }
+
+
+		// Returns the key of msg, nothing if its type isn't conflated
+		std::optional<uint64_t> GetKey(const Message& msg) const
+		{
+			if (m_Keys.empty())
+				return std::nullopt;
+
+			auto it = m_Keys.find(msg.header.type);
+			if (it == m_Keys.end())
+				return std::nullopt;
+			return it->second ? it->second(msg) : 0;
+		}
+
+
+	private:
+		std::unordered_map<uint32_t, ConflationKey> m_Keys;
+	};
+
+
+	// Type and key of a conflated message, identifies its place in a queue
+	struct ConflationSlot
+	{
+		uint32_t type = 0;
+		uint64_t key = 0;
+
+		bool operator == (const ConflationSlot&) const = default;
+	};
+
+
+	struct ConflationSlotHash
+	{
+		size_t operator () (const ConflationSlot& slot) const
+		{
+			return std::hash<uint64_t>()(slot.key ^ ((uint64_t)slot.type * 0x9E3779B97F4A7C15ull));
+		}
+	};
+
+
+} // namespace Net
@@ -2,7 +2,17 @@
 
 #include "NetCommon.h"
 
+#include "NetConflation.h"
 #include "NetMsgQueue.h"
+#include "NetMsgQueueMPSC.h"
+#include "NetRegisteredBufferPool.h"
+#include "NetShmTransport.h"
+#include "NetStream.h"
+#include "NetTimerWheel.h"
+#include "NetTls.h"
+
+#include <future>
+#include <unordered_map>
 //#include "NetServer.h"
 
 
@@ -13,23 +23,223 @@ namespace NETLIB_NAMESPACE {
 	class Server;
 
 
+	// What happens to a message which is sent while the outgoing queue of
+	// its connection is above a high watermark
+	enum class OverflowPolicy
+	{
+		// The message isn't queued, Send returns false
+		Reject,
+		// The message is queued, and the oldest unsent messages are dropped
+		// until the queue is below the high watermarks again
+		DropOldest,
+		// The slow consumer is disconnected
+		Disconnect,
+	};
+
+
+	// Watermarks of a connection's outgoing queue. Once the queue gets above a
+	// high watermark, the policy applies to every message sent, and once it's
+	// back below both low watermarks, a ControlMsg::Writable event is queued
+	// (see Server::OnClientWritable, Client::OnWritable).
+	struct SendLimits
+	{
+		size_t nHighBytes = NETLIB_SEND_QUEUE_HIGH_BYTES;
+		size_t nLowBytes = NETLIB_SEND_QUEUE_HIGH_BYTES / 4;
+		size_t nHighMessages = NETLIB_SEND_QUEUE_HIGH_MESSAGES;
+		size_t nLowMessages = NETLIB_SEND_QUEUE_HIGH_MESSAGES / 4;
+		OverflowPolicy policy = OverflowPolicy::Reject;
+	};
+
+
+	// Liveness checks of a connection, 0 turns a check off. A connection which
+	// times out is closed (and reported like any other disconnect). The timeouts
+	// are checked with the resolution of NETLIB_TIMER_TICK_MS.
+	struct Timeouts
+	{
+		// Send a heartbeat if nothing has been sent for this long
+		std::chrono::milliseconds heartbeatInterval{ 0 };
+		// Close if nothing has been received for this long, which catches half-open
+		// connections (should be a few times the peer's heartbeat interval). The TLS
+		// and shared memory handshakes have to be done within it, too.
+		std::chrono::milliseconds readTimeout{ 0 };
+		// Close if a write doesn't make progress for this long (the peer doesn't read).
+		// Over a socket, progress is a whole write batch (up to NETLIB_WRITE_BATCH_BYTES)
+		// being written, so it must leave enough time for one batch.
+		std::chrono::milliseconds writeTimeout{ 0 };
+		// Close if no app message has been sent or received for this long
+		// (heartbeats don't count)
+		std::chrono::milliseconds idleTimeout{ 0 };
+	};
+
+
+	// Connections run over any stream protocol, TCP or unix domain sockets
+	// (asio::local::stream_protocol) for clients on the same host. Their
+	// sockets convert into this one on construction.
+	using StreamProtocol = asio::generic::stream_protocol;
+
+
 	class Connection : public std::enable_shared_from_this<Connection>
 	{
 	public:
-		Connection(bool server, asio::io_context& asioContext, asio::ip::tcp::socket socket, MsgQueue& qIn, uint16_t port)
-			: m_asioContext(asioContext), m_socket(std::move(socket)), m_MessagesIn(qIn), m_IsServer(server), m_port(port)
+		// The outgoing queue and the receive slab take their memory from pool
+		// (a RegisteredBufferPool of asioContext lets the socket read with fixed buffers)
+		Connection(bool server, asio::io_context& asioContext, StreamProtocol::socket socket, MsgQueueIn& qIn, uint16_t port, BufferPool& pool = BufferPool::GetDefault())
+			: m_socket(std::move(socket)), m_asioContext(asioContext), m_strand(asio::make_strand(asioContext)), m_MessagesOut(&pool), m_WriteBatch(&pool), m_MessagesIn(qIn), m_RecvSlab(pool), m_IsServer(server), m_port(port)
 		{
+			// A client's connection is connecting from the start, so it can queue messages
+			m_bOpen = server ? m_socket.is_open() : true;
+			m_pRegisteredPool = dynamic_cast<RegisteredBufferPool*>(&pool);
 		}
 
 
-		virtual ~Connection() {}
+		virtual ~Connection()
+		{
+			if (m_pTimerWheel)
+				m_pTimerWheel->Cancel(m_Timer);
+
+			// Whatever is still queued goes away with the connection
+			if (m_pServerQueuedBytes)
+				m_pServerQueuedBytes->fetch_sub(m_nQueuedBytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+			// Streams which are still open won't be completed anymore
+			for (auto& [id, pSink] : m_InStreams)
+			{
+				if (pSink)
+					pSink->OnEnd(false);
+			}
+		}
 
 
 	public:
-		uint16_t GetID() const { return GetPort(); }
-		std::string GetAddress() const { return m_socket.remote_endpoint().address().to_string(); }
+		// Unique ID of a client on its server (see SlotMap), 0 on the client side
+		uint64_t GetID() const { return m_nID; }
 		uint16_t GetPort() const { return m_port; }
 
+		// IP address of the remote, or the path of a unix domain socket
+		std::string GetAddress() const
+		{
+			std::error_code ec;
+			StreamProtocol::endpoint endpoint = m_socket.remote_endpoint(ec);
+			if (ec)
+				return {};
+			if (IsTcp(endpoint))
+				return FromGenericEndpoint<asio::ip::tcp::endpoint>(endpoint).address().to_string();
+			// The client's end of a unix domain socket has no name, but the server's has
+			std::string path = FromGenericEndpoint<asio::local::stream_protocol::endpoint>(endpoint).path();
+			if (path.empty())
+				path = FromGenericEndpoint<asio::local::stream_protocol::endpoint>(m_socket.local_endpoint(ec)).path();
+			return path;
+		}
+
+
+		// Remote TCP endpoint, empty if it's a unix domain socket (see IsLocal)
+		asio::ip::tcp::endpoint GetRemoteEndpoint() const
+		{
+			std::error_code ec;
+			StreamProtocol::endpoint endpoint = m_socket.remote_endpoint(ec);
+			if (ec || !IsTcp(endpoint))
+				return {};
+			return FromGenericEndpoint<asio::ip::tcp::endpoint>(endpoint);
+		}
+
+
+		// The connection runs over a unix domain socket, so the remote is on the same host
+		bool IsLocal() const
+		{
+			std::error_code ec;
+			StreamProtocol::endpoint endpoint = m_socket.local_endpoint(ec);
+			return !ec && endpoint.protocol().family() == AF_UNIX;
+		}
+
+
+		// Select the body checksum this side wants to receive, must be called
+		// before connecting. Integrity::None trusts TCP on every link, while
+		// bTrustLoopback does so only if the peer is on the same host.
+		void SetIntegrity(Integrity preferred, bool bTrustLoopback = false)
+		{
+			m_IntegrityPreferred = preferred;
+			m_bTrustLoopback = bTrustLoopback;
+		}
+
+
+		// Body checksum which is used for sending, as negotiated with the peer
+		Integrity GetIntegrity() const
+		{
+			return m_IntegritySend.load(std::memory_order_relaxed);
+		}
+
+
+		// Select the compression this side wants to use, must be called before
+		// connecting. Bodies of at least nThreshold bytes are compressed, but only
+		// if the peer selected the same compression (so both sides have to opt in).
+		void SetCompression(Compression mode, size_t nThreshold = NETLIB_COMPRESS_THRESHOLD)
+		{
+			m_CompressionPreferred = mode;
+			m_nCompressThreshold = nThreshold;
+		}
+
+
+		// Compression which is used for sending, as negotiated with the peer
+		Compression GetCompression() const
+		{
+			return m_CompressionSend.load(std::memory_order_relaxed);
+		}
+
+
+		size_t GetCompressThreshold() const { return m_nCompressThreshold; }
+
+
+		// Set the watermarks of the outgoing queue, and what happens above them
+		void SetSendLimits(const SendLimits& limits)
+		{
+			m_SendLimits = limits;
+		}
+
+
+		// Bytes (headers and bodies) and messages in the outgoing queue, including
+		// the ones being written right now
+		size_t GetQueuedBytes() const { return m_nQueuedBytes.load(std::memory_order_relaxed); }
+		size_t GetQueuedMessages() const { return m_nQueuedMessages.load(std::memory_order_relaxed); }
+
+		// Messages dropped by OverflowPolicy::DropOldest
+		uint64_t GetDroppedMessages() const { return m_nDroppedMessages.load(std::memory_order_relaxed); }
+
+
+		// Set the liveness checks, which run on pWheel (the one of the connection's
+		// context), must be called before connecting
+		void SetTimeouts(const Timeouts& timeouts, std::shared_ptr<TimerWheel> pWheel)
+		{
+			m_Timeouts = timeouts;
+			m_pTimerWheel = std::move(pWheel);
+		}
+
+
+		// Conflate messages of type by their key (see ConflationTable), must be
+		// called before connecting. Conflated messages don't count against the
+		// high watermarks, as they replace each other instead of piling up.
+		void SetConflation(uint32_t type, ConflationKey key = nullptr)
+		{
+			m_Conflation.Add(type, std::move(key));
+		}
+
+
+		void SetConflation(const ConflationTable& conflation)
+		{
+			m_Conflation = conflation;
+		}
+
+
+		// Messages which have been replaced by a newer one of the same key
+		uint64_t GetConflatedMessages() const { return m_nConflatedMessages.load(std::memory_order_relaxed); }
+
+
+		// Set the factory which creates a sink for every incoming stream,
+		// must be called before connecting (without, streams are dropped)
+		void SetStreamSink(StreamSinkFactory factory)
+		{
+			m_StreamSinkFactory = std::move(factory);
+		}
+
 
 		void ConnectToClient(uint16_t port = 0)
 		{
@@ -38,269 +248,1423 @@ namespace NETLIB_NAMESPACE {
 			{
 				if (m_socket.is_open())
 				{
-					ASYNC_ReadHeader();
+					asio::dispatch(m_strand, [this, self = this->shared_from_this()]() { StartTransport(); });
 				}
 			}
 		}
 
 
-		void ConnectToServer(const asio::ip::tcp::resolver::results_type& endpoints)
+		// Connect to one of endpoints. Messages which are sent meanwhile are queued,
+		// and go out once connected. onConnect is called on the connection's strand
+		// when the attempt completes. If it failed, the connection stays open with
+		// its queue, so onConnect may try again (or Disconnect), without onConnect
+		// it's closed.
+		void ConnectToServer(const std::vector<StreamProtocol::endpoint>& endpoints, std::function<void(std::error_code ec)> onConnect = nullptr)
 		{
 			// Only clients can connect to servers
 			if (!m_IsServer)
 			{
 				// Request asio attempts to connect to an endpoint
-				asio::async_connect(m_socket, endpoints,
-					[this](std::error_code ec, asio::ip::tcp::endpoint endpoint)
+				m_bOpen.store(true, std::memory_order_relaxed);
+				asio::async_connect(m_socket, endpoints, asio::bind_executor(m_strand,
+					[this, self = this->shared_from_this(), onConnect = std::move(onConnect)](std::error_code ec, const StreamProtocol::endpoint& endpoint)
 					{
+						// Disconnected while connecting
+						if (!IsConnected())
+							return;
+
 						if (!ec)
 						{
 							std::cout << "Connect to server succesfully!" << std::endl;
-							ASYNC_ReadHeader();
+							StartTransport();
 						}
 						else
 						{
 							std::cout << "Connection error: " << ec.message() << std::endl;
-							m_socket.close();
+							if (!onConnect)
+								Close();
 						}
-					});
+
+						if (onConnect)
+							onConnect(ec);
+					}));
 			}
 		}
 
 
+		// Exchange the messages through shared memory rings of nRingBytes each (see
+		// ShmTransport) instead of the socket, if it's a unix domain socket (Linux
+		// only), must be called before connecting. The client asks for it, and
+		// the server agrees if it has set it too.
+		void SetSharedMemory(size_t nRingBytes)
+		{
+			m_nShmRingBytes = nRingBytes;
+		}
+
+
+		// The messages go through shared memory (see SetSharedMemory)
+		bool IsSharedMemory() const { return m_bShm.load(std::memory_order_acquire); }
+
+
+#if NETLIB_TLS
+		// Encrypt the connection with TLS (see TlsContext), if it's over TCP, must be
+		// called before connecting. A client names the host it connects to, and the
+		// peer (host and port) whose last session is resumed.
+		void SetTls(std::shared_ptr<TlsContext> pContext, const std::string& host = {}, const std::string& peer = {})
+		{
+			m_pTlsContext = std::move(pContext);
+			m_TlsHost = host;
+			m_TlsPeer = peer;
+		}
+
+
+		// The TLS handshake has resumed an earlier session (instead of a full one)
+		bool IsTlsSessionReused() const { return m_bTlsResumed.load(std::memory_order_acquire); }
+#endif
+
+
+		// Set a handler which is called on the connection's strand when the server
+		// hands out the ID and token for UDP datagrams (see ControlMsg::UdpToken),
+		// must be called before connecting
+		void SetUdpTokenHandler(std::function<void(uint64_t id, uint64_t token)> onUdpToken)
+		{
+			m_OnUdpToken = std::move(onUdpToken);
+		}
+
+
+		// Set a handler which is called on the connection's strand when the connection
+		// closes (it's called before the Disconnected event is queued), must be set on the strand
+		void SetCloseHandler(std::function<void()> onClose)
+		{
+			m_OnClose = std::move(onClose);
+		}
+
+
 		void Disconnect()
 		{
 			if (IsConnected())
-				asio::post(m_asioContext, [this]() { m_socket.close(); });
+				asio::post(m_strand, [this, self = this->shared_from_this()]() { Close(); });
+		}
+
+
+		// Same, but wait until it's closed, so no close is left queued behind. Must
+		// not be called on the connection's context, which has to be running.
+		void DisconnectAndWait()
+		{
+			std::promise<void> closed;
+			asio::post(m_strand, [this, &closed]() { Close(); closed.set_value(); });
+			closed.get_future().wait();
 		}
 
 
 		bool IsConnected() const
 		{
-			return m_socket.is_open();
+			return m_bOpen.load(std::memory_order_acquire);
 		}
 
 
-		// Send a message
-		void Send(Message& msg)
+		// Send a copy of a message, the caller keeps its message untouched
+		// (the copy shares the body, so the body bytes aren't copied).
+		// Returns false if the message wasn't queued (see SendLimits).
+		bool Send(const Message& msg)
 		{
-			msg.UpdateCRC();
-			ASYNC_Send(msg);
+			return Send(Message(msg));
 		}
 
 
-	private:
-		// ASYNC - Send a message, connections are one-to-one so no need to specifiy
-		// the target, for a client, the target is the server and vice versa
-		void ASYNC_Send(const Message& msg)
+		// Send a message, which is handed over to the connection without any copy
+		bool Send(Message&& msg)
+		{
+			// The key is read from the body before it's compressed
+			std::optional<uint64_t> key = m_Conflation.GetKey(msg);
+			msg.Compress(GetCompression(), m_nCompressThreshold);
+			msg.UpdateCRC(GetIntegrity());
+			return ASYNC_Send(std::move(msg), key);
+		}
+
+
+		// Send a message whose checksums are already up to date. The body is
+		// shared with the caller, so one message can be queued on many connections
+		// without being checksummed or copied again (used by Server::Broadcast).
+		// As its body may be compressed, the caller passes its conflation key.
+		bool SendPrepared(const Message& msg, std::optional<uint64_t> key = std::nullopt)
 		{
-			asio::post(m_asioContext,
-				[this, msg]()
+			return ASYNC_Send(Message(msg), key);
+		}
+
+
+		// Send a payload of any size as a stream. It's sent in chunks of
+		// NETLIB_STREAM_CHUNK_SIZE, one per write, so other messages aren't held
+		// up, and only a single chunk is in memory at a time. The data is taken
+		// from source as it's needed. Returns the ID of the stream.
+		uint32_t SendStream(uint32_t type, StreamSource source)
+		{
+			uint32_t id = m_nNextStreamID.fetch_add(1, std::memory_order_relaxed);
+			asio::post(m_strand,
+				[this, self = this->shared_from_this(), id, type, source = std::move(source)]() mutable
 				{
-					// If the queue has a message in it, then we must assume that it is in the
-					// process of asynchronously being written. Either way add the message to
-					// the queue to be output. If no messages were available to be written,
-					// then start the process of writing the message at the front of the queue.
-					bool bWritingMessage = !m_MessagesOut.IsEmpty();
-					m_MessagesOut.PushBack(msg);
-					if (!bWritingMessage)
+					m_OutStreams.push_back({ id, type, std::move(source) });
+					if (!m_bWriting && m_bSessionStarted)
 					{
-						ASYNC_WriteHeader();
+						QueueStreamChunk();
+						ASYNC_WriteMessages();
 					}
 				});
+			return id;
 		}
 
 
-		// ASYNC - Prime context to write a message header
-		void ASYNC_WriteHeader()
+		// Send a payload which is in memory already as a stream (the buffer is
+		// shared, not copied, until its chunks are sent)
+		uint32_t SendStream(uint32_t type, Buffer data)
 		{
-			// If this function is called, we know the outgoing message queue must have 
-			// at least one message to send. So allocate a transmission buffer to hold
-			// the message, and issue the work - asio, send these bytes
-			asio::async_write(m_socket, asio::buffer(&m_MessagesOut.GetFront().header, sizeof(message_header)),
-				[this](std::error_code ec, std::size_t length)
+			return SendStream(type,
+				[data = std::move(data), nOffset = size_t(0)](uint8_t* pData, size_t nMax) mutable
 				{
-					// asio has now sent the bytes - if there was a problem
-					// an error would be available...
-					if (!ec)
-					{
-						// ... no error, so check if the message header just sent
-						// also has a message body...
-						if (m_MessagesOut.GetFront().body.size() > 0)
-						{
-							// ...it does, so issue the task to write the body bytes
-							ASYNC_WriteBody();
-						}
-						else
-						{
-							// ...it didnt, so we are done with this message. Remove it from 
-							// the outgoing message queue
-							m_MessagesOut.PopFront();
+					size_t nSize = std::min(nMax, data.size() - nOffset);
+					if (nSize > 0)
+						std::memcpy(pData, std::as_const(data).data() + nOffset, nSize);
+					nOffset += nSize;
+					return nSize;
+				});
+		}
+
+
+	private:
+		// Close the socket and report it, by queueing a Disconnected event into the
+		// incoming queue (behind the last message of this connection)
+		void Close()
+		{
+#if NETLIB_TLS
+			// A handshake on another thread may be using the socket, so it's only
+			// shut down, and closed once the handshake has failed
+			if (m_bTlsHandshaking)
+			{
+				std::error_code ec;
+				m_socket.shutdown(asio::socket_base::shutdown_both, ec);
+			}
+			else
+#endif
+			m_socket.close();
+			if (m_pShm)
+				m_pShm->Close();
+
+			if (m_pTimerWheel)
+				m_pTimerWheel->Cancel(m_Timer);
+
+			// Nothing will be sent anymore, so the queue is freed right away
+			size_t nBytes = 0, nMessages = 0;
+			m_MessagesOut.Peek(
+				[&nBytes, &nMessages](const Message& msg)
+				{
+					nBytes += GetQueuedSize(msg);
+					nMessages++;
+					return true;
+				});
+			m_MessagesOut.Clear();
+			m_nOutFront += nMessages;
+			m_ConflatedOut.clear();
+			RemoveQueued(nBytes, nMessages);
+
+			// Streams in both directions are cut off
+			m_OutStreams.clear();
+			for (auto& [id, pSink] : m_InStreams)
+			{
+				if (pSink)
+					pSink->OnEnd(false);
+			}
+			m_InStreams.clear();
+
+			if (m_bOpen.exchange(false, std::memory_order_acq_rel))
+			{
+				if (m_OnClose)
+					m_OnClose();
+
+				Message msg;
+				msg.header.type = (uint32_t)ControlMsg::Disconnected;
+				msg.remote = this->shared_from_this();
+				m_MessagesIn.PushBack(std::move(msg));
+			}
+		}
+
+
+		// The socket is connected, so settle how the messages go through it (TLS,
+		// shared memory or just the socket), then start the session
+		void StartTransport()
+		{
+			// The timeouts cover the handshakes as well, so a peer which never
+			// finishes them doesn't hold the connection forever
+			StartTimer();
 
-							// If the queue is not empty, there are more messages to send, so
-							// make this happen by issuing the task to send the next header.
-							if (!m_MessagesOut.IsEmpty())
+#if NETLIB_TLS
+			if (m_pTlsContext && !IsLocal())
+			{
+				ASYNC_TlsHandshake();
+				return;
+			}
+#endif
+
+			// A client on the same host may ask for shared memory first
+			if (m_IsServer && IsLocal() && ShmTransport::IsSupported())
+				ASYNC_ReceiveShmRequest();
+			else if (!m_IsServer && m_nShmRingBytes && IsLocal() && ShmTransport::SendRequest(m_socket.native_handle(), m_nShmRingBytes))
+				ASYNC_ReceiveShmAnswer();
+			else
+				StartSession();
+		}
+
+
+#if NETLIB_TLS
+		// ASYNC - Run the TLS handshake, then start the session. Its steps run on
+		// the handshake threads (see TlsContext), if there are any.
+		void ASYNC_TlsHandshake()
+		{
+			m_pTls = std::make_unique<TlsStream>(m_socket, m_pTlsContext->GetContext());
+			if (!m_IsServer)
+				m_pTlsContext->PrepareClient(*m_pTls, m_TlsHost, m_TlsPeer);
+
+			m_bTlsHandshaking = true;
+			m_pTls->async_handshake(m_IsServer ? asio::ssl::stream_base::server : asio::ssl::stream_base::client,
+				asio::bind_executor(m_pTlsContext->GetHandshakeExecutor(m_strand),
+					[this, self = this->shared_from_this()](std::error_code ec)
+					{
+						// Back to the connection's strand
+						asio::dispatch(m_strand, [this, self, ec]()
 							{
-								ASYNC_WriteHeader();
-							}
-						}
-					}
-					else
+								m_bTlsHandshaking = false;
+								if (!IsConnected())
+								{
+									m_socket.close();
+									return;
+								}
+								if (ec)
+								{
+									std::cout << "[" << GetID() << "] TLS handshake Failed: " << ec.message() << std::endl;
+									Close();
+									return;
+								}
+
+								m_bTlsResumed.store(SSL_session_reused(m_pTls->native_handle()) == 1, std::memory_order_release);
+								StartSession();
+							});
+					}));
+		}
+#endif
+
+
+		// The socket is connected, so announce which checksums and compressions
+		// we accept and start reading
+		void StartSession()
+		{
+			// CRC-32C is always accepted, not checking at all only if it's wanted
+			m_nIntegrityAccepted = IntegrityBit(Integrity::CRC32C);
+			if (m_IntegrityPreferred == Integrity::None || (m_bTrustLoopback && IsRemoteLoopback()))
+				m_nIntegrityAccepted |= IntegrityBit(Integrity::None);
+
+			m_nCompressionAccepted = CompressionBit(Compression::None);
+			if (m_CompressionPreferred != Compression::None)
+				m_nCompressionAccepted |= CompressionBit(m_CompressionPreferred);
+
+			// Until the peer's hello arrives, everything is sent with CRC-32C and uncompressed
+			Message msg;
+			msg.header.type = (uint32_t)ControlMsg::Hello;
+			msg << PROTOCOL_VERSION << m_nIntegrityAccepted << m_nCompressionAccepted;
+			msg.UpdateCRC(Integrity::CRC32C);
+
+			// The hello goes out first, in front of the messages which have
+			// been sent while connecting
+			AddQueuedUnlimited(GetQueuedSize(msg));
+			m_MessagesOut.PushFront(std::move(msg));
+			m_nOutFront--;
+			m_bSessionStarted = true;
+			QueueStreamChunk();
+			ASYNC_WriteMessages();
+
+			ASYNC_ReadMessages();
+			// With shared memory, the socket only tells when the peer has gone
+			if (m_pShm)
+				ASYNC_WaitSocketClosed();
+		}
+
+
+		// Start the liveness checks, if there are any
+		void StartTimer()
+		{
+			if (!m_pTimerWheel || (m_Timeouts.heartbeatInterval.count() <= 0 && m_Timeouts.readTimeout.count() <= 0 &&
+				m_Timeouts.writeTimeout.count() <= 0 && m_Timeouts.idleTimeout.count() <= 0))
+			{
+				m_pTimerWheel.reset();
+				return;
+			}
+
+			m_nHeartbeatTicks = m_pTimerWheel->ToTicks(m_Timeouts.heartbeatInterval);
+			m_nReadTicks = m_pTimerWheel->ToTicks(m_Timeouts.readTimeout);
+			m_nWriteTicks = m_pTimerWheel->ToTicks(m_Timeouts.writeTimeout);
+			m_nIdleTicks = m_pTimerWheel->ToTicks(m_Timeouts.idleTimeout);
+			m_nLastRead = m_nLastWrite = m_nLastActivity = m_pTimerWheel->GetNow();
+
+			// The wheel calls this on its own thread, the checks run on the strand
+			m_Timer.func = [weak = this->weak_from_this()]()
+			{
+				if (auto self = weak.lock())
+				{
+					asio::strand<asio::io_context::executor_type>& strand = self->m_strand;
+					asio::post(strand, [self = std::move(self)]() { self->OnTimer(); });
+				}
+			};
+			ScheduleTimer();
+		}
+
+
+		// Schedule the timer for the next check which might be due. Activity
+		// doesn't touch the timer, it's only noted (see GetTicks), and when the
+		// timer is due, the checks see whether it really timed out.
+		void ScheduleTimer()
+		{
+			uint64_t nNow = m_pTimerWheel->GetNow();
+			uint64_t nNext = std::numeric_limits<uint64_t>::max();
+			auto check = [nNow, &nNext](uint64_t nLast, uint64_t nTicks)
+			{
+				if (nTicks > 0)
+					nNext = std::min(nNext, nLast + nTicks > nNow ? nLast + nTicks - nNow : 1);
+			};
+			check(m_nLastWrite, m_nHeartbeatTicks);
+			check(m_nLastRead, m_nReadTicks);
+			check(m_bWriting ? m_nLastWrite : nNow, m_nWriteTicks);
+			check(m_nLastActivity, m_nIdleTicks);
+			m_pTimerWheel->Schedule(m_Timer, nNext);
+		}
+
+
+		// Timer is due, close the connection if it timed out, or send a heartbeat
+		void OnTimer()
+		{
+			if (!IsConnected())
+				return;
+
+			uint64_t nNow = m_pTimerWheel->GetNow();
+			const char* pTimeout = nullptr;
+			if (m_nReadTicks > 0 && nNow - m_nLastRead >= m_nReadTicks)
+				pTimeout = "Nothing received";
+			else if (m_nWriteTicks > 0 && m_bWriting && nNow - m_nLastWrite >= m_nWriteTicks)
+				pTimeout = "Write stalled";
+			else if (m_nIdleTicks > 0 && nNow - m_nLastActivity >= m_nIdleTicks)
+				pTimeout = "Idle";
+
+			if (pTimeout)
+			{
+				std::cout << "[" << GetID() << "] Timeout: " << pTimeout << ", disconnecting." << std::endl;
+				Close();
+				return;
+			}
+
+			// Nothing sent for a while, tell the peer we're still there (once the
+			// handshakes are done, until then the peer isn't reading messages)
+			if (m_nHeartbeatTicks > 0 && m_bSessionStarted && !m_bWriting && nNow - m_nLastWrite >= m_nHeartbeatTicks)
+			{
+				Message msg;
+				msg.header.type = (uint32_t)ControlMsg::Heartbeat;
+				msg.UpdateCRC(GetIntegrity());
+
+				// Queued past the send limits (like the hello), a full queue must
+				// not keep a healthy peer from hearing of us. Nothing is being
+				// written, so it goes out right away.
+				AddQueuedUnlimited(GetQueuedSize(msg));
+				m_MessagesOut.PushBack(std::move(msg));
+				ASYNC_WriteMessages();
+			}
+
+			ScheduleTimer();
+		}
+
+
+		// Current tick of the timer wheel, 0 if there are no timeouts
+		uint64_t GetTicks() const
+		{
+			return m_pTimerWheel ? m_pTimerWheel->GetNow() : 0;
+		}
+
+
+		static bool IsTcp(const StreamProtocol::endpoint& endpoint)
+		{
+			int family = endpoint.protocol().family();
+			return family == AF_INET || family == AF_INET6;
+		}
+
+
+		// Converts a generic endpoint into the one of its actual protocol
+		template<typename Endpoint>
+		static Endpoint FromGenericEndpoint(const StreamProtocol::endpoint& endpoint)
+		{
+			Endpoint result;
+			size_t nSize = std::min(endpoint.size(), result.capacity());
+			std::memcpy(result.data(), endpoint.data(), nSize);
+			result.resize(nSize);
+			return result;
+		}
+
+
+		bool IsRemoteLoopback() const
+		{
+			std::error_code ec;
+			StreamProtocol::endpoint endpoint = m_socket.remote_endpoint(ec);
+			if (ec)
+				return false;
+			// Unix domain sockets never leave the host
+			if (!IsTcp(endpoint))
+				return true;
+			asio::ip::address address = FromGenericEndpoint<asio::ip::tcp::endpoint>(endpoint).address();
+			// An IPv6 socket sees IPv4 peers as mapped addresses
+			if (address.is_v6() && address.to_v6().is_v4_mapped())
+				address = asio::ip::make_address_v4(asio::ip::v4_mapped, address.to_v6());
+			return address.is_loopback();
+		}
+
+
+		// Handle a message which is meant for the library itself, returns
+		// false if it was invalid (and the connection has been closed)
+		bool OnControlMessage(Message& msg)
+		{
+			switch ((ControlMsg)msg.header.type)
+			{
+			case ControlMsg::Hello:
+			{
+				// Peers before 1.1 don't know about compression, and send one field less
+				bool bCompression = IsPodBody(msg, { sizeof(uint32_t), sizeof(uint32_t), sizeof(uint32_t) });
+				if (!bCompression && !IsPodBody(msg, { sizeof(uint32_t), sizeof(uint32_t) }))
+				{
+					std::cout << "[" << GetID() << "] OnControlMessage() Failed: Malformed hello." << std::endl;
+					Close();
+					return false;
+				}
+
+				uint32_t version, accepted, compression = CompressionBit(Compression::None);
+				if (bCompression)
+					msg >> compression;
+				msg >> accepted >> version;
+
+				// A different major version frames its messages differently
+				if ((version >> 16) != PROTOCOL_VERSION_MAJOR)
+				{
+					std::cout << "[" << GetID() << "] OnControlMessage() Failed: Protocol version " << (version >> 16) << "." << (version & 0xFFFF)
+						<< " not supported (" << PROTOCOL_VERSION_MAJOR << "." << PROTOCOL_VERSION_MINOR << ")." << std::endl;
+					Close();
+					return false;
+				}
+
+				// Compress only if both sides want the same compression
+				if (m_CompressionPreferred != Compression::None && (compression & CompressionBit(m_CompressionPreferred)))
+					m_CompressionSend.store(m_CompressionPreferred, std::memory_order_relaxed);
+				else
+					m_CompressionSend.store(Compression::None, std::memory_order_relaxed);
+
+				// Skip the body checksum if the peer trusts the link, CRC-32C otherwise
+				if (accepted & IntegrityBit(Integrity::None))
+					m_IntegritySend.store(Integrity::None, std::memory_order_relaxed);
+				else
+					m_IntegritySend.store(Integrity::CRC32C, std::memory_order_relaxed);
+				return true;
+			}
+
+			case ControlMsg::StreamChunk:
+				return OnStreamChunk(msg);
+
+			case ControlMsg::Heartbeat:
+				// Arriving is all it has to do (see Timeouts)
+				return true;
+
+			case ControlMsg::UdpToken:
+			{
+				if (!IsPodBody(msg, { sizeof(uint64_t), sizeof(uint64_t) }))
+				{
+					std::cout << "[" << GetID() << "] OnControlMessage() Failed: Malformed UDP token." << std::endl;
+					Close();
+					return false;
+				}
+
+				uint64_t id, token;
+				msg >> token >> id;
+				if (m_OnUdpToken)
+					m_OnUdpToken(id, token);
+				return true;
+			}
+
+			case ControlMsg::Disconnected:
+			case ControlMsg::Writable:
+			case ControlMsg::Connected:
+			case ControlMsg::UdpHello:
+				// Events queued locally (or datagrams), a peer never sends them
+				std::cout << "[" << GetID() << "] OnControlMessage() Failed: Local event type " << msg.header.type << " received." << std::endl;
+				Close();
+				return false;
+
+			default:
+				// Maybe from a newer version of the library, so it's skipped
+				std::cout << "[" << GetID() << "] OnControlMessage() type: " << msg.header.type << " - Unknown!!!" << std::endl;
+				return true;
+			}
+		}
+
+
+		// Checks that the body is exactly fields of these sizes, each followed by
+		// its size (as operator << writes them), before it's pulled apart. The
+		// pulls only assert the sizes, so a short body would be read out of bounds.
+		static bool IsPodBody(const Message& msg, std::initializer_list<size_t> fields)
+		{
+			size_t nPos = 0;
+			for (size_t nSize : fields)
+			{
+				nPos += nSize;
+				if (nPos + sizeof(uint32_t) > msg.body.size())
+					return false;
+				uint32_t nTag;
+				std::memcpy(&nTag, msg.body.data() + nPos, sizeof(uint32_t));
+				if (nTag != nSize)
+					return false;
+				nPos += sizeof(uint32_t);
+			}
+			return nPos == msg.body.size();
+		}
+
+
+		// Pass the data of a stream chunk on to the stream's sink
+		bool OnStreamChunk(const Message& msg)
+		{
+			stream_chunk_header chunk;
+			if (msg.body.size() < sizeof(stream_chunk_header))
+			{
+				std::cout << "[" << GetID() << "] OnStreamChunk() Failed: Chunk too small." << std::endl;
+				Close();
+				return false;
+			}
+			std::memcpy(&chunk, msg.body.data(), sizeof(stream_chunk_header));
+
+			auto it = m_InStreams.find(chunk.id);
+			if (chunk.flags & StreamBegin)
+			{
+				// The number of open streams is limited, as each has a sink
+				if (it != m_InStreams.end() || m_InStreams.size() >= NETLIB_MAX_STREAMS)
+				{
+					std::cout << "[" << GetID() << "] OnStreamChunk() Failed: Stream already open, or too many streams." << std::endl;
+					Close();
+					return false;
+				}
+				// Without a sink, the stream is dropped (but still tracked)
+				std::unique_ptr<StreamSink> pSink = m_StreamSinkFactory ? m_StreamSinkFactory(*this, chunk.type) : nullptr;
+				it = m_InStreams.emplace(chunk.id, std::move(pSink)).first;
+			}
+			else if (it == m_InStreams.end())
+			{
+				std::cout << "[" << GetID() << "] OnStreamChunk() Failed: Unknown stream." << std::endl;
+				Close();
+				return false;
+			}
+
+			size_t nSize = msg.body.size() - sizeof(stream_chunk_header);
+			if (it->second && nSize > 0)
+				it->second->OnData(msg.body.data() + sizeof(stream_chunk_header), nSize);
+
+			if (chunk.flags & (StreamEnd | StreamAbort))
+			{
+				if (it->second)
+					it->second->OnEnd(!(chunk.flags & StreamAbort));
+				m_InStreams.erase(it);
+			}
+			return true;
+		}
+
+
+		// Queue the next chunk of the outgoing stream whose turn it is (the
+		// streams take turns), returns false if there are no streams
+		bool QueueStreamChunk()
+		{
+			if (m_OutStreams.empty())
+				return false;
+
+			OutStream stream = std::move(m_OutStreams.front());
+			m_OutStreams.pop_front();
+
+			Message msg;
+			msg.header.type = (uint32_t)ControlMsg::StreamChunk;
+			msg.body.resize(sizeof(stream_chunk_header) + NETLIB_STREAM_CHUNK_SIZE);
+			size_t nSize = std::min<size_t>(stream.source(msg.body.data() + sizeof(stream_chunk_header), NETLIB_STREAM_CHUNK_SIZE), NETLIB_STREAM_CHUNK_SIZE);
+
+			stream_chunk_header chunk;
+			chunk.id = stream.id;
+			chunk.type = stream.type;
+			chunk.flags = (stream.bStarted ? 0 : StreamBegin) | (nSize == 0 ? StreamEnd : 0);
+			std::memcpy(msg.body.data(), &chunk, sizeof(stream_chunk_header));
+			msg.body.resize(sizeof(stream_chunk_header) + nSize);
+			msg.header.size = (uint32_t)msg.body.size();
+
+			msg.Compress(GetCompression(), m_nCompressThreshold);
+			msg.UpdateCRC(GetIntegrity());
+
+			// Chunks are paced by the writes, so they don't count against the limits
+			AddQueuedUnlimited(GetQueuedSize(msg));
+			m_MessagesOut.PushBack(std::move(msg));
+
+			// The stream goes to the back of the line, until its source runs dry
+			if (nSize > 0)
+			{
+				stream.bStarted = true;
+				m_OutStreams.push_back(std::move(stream));
+			}
+			return true;
+		}
+
+
+		// ASYNC - Send a message, connections are one-to-one so no need to specifiy
+		// the target, for a client, the target is the server and vice versa.
+		// Returns false if the message has been rejected (see SendLimits).
+		// A message with a conflation key replaces the queued one of the same key.
+		bool ASYNC_Send(Message&& msg, std::optional<uint64_t> key = std::nullopt)
+		{
+			if (key)
+				AddQueuedUnlimited(GetQueuedSize(msg));
+			else if (!AddQueued(GetQueuedSize(msg)))
+				return false;
+
+			asio::post(m_strand,
+				[this, self = this->shared_from_this(), msg = std::move(msg), key]() mutable
+				{
+					// Closed in the meantime, nothing is sent anymore
+					if (!IsConnected())
 					{
-						// ...asio failed to write the message, we could analyse why but 
-						// for now simply assume the connection has died by closing the
-						// socket. When a future attempt to write to this client fails due
-						// to the closed socket, it will be tidied up.
-						std::cout << "[" << GetID() << "] WriteHeader() Failed: " << ec.message() << std::endl;
-						m_socket.close();
+						RemoveQueued(GetQueuedSize(msg), 1);
+						return;
 					}
+
+					// Latest value wins, the older message is dropped right away
+					if (key && Conflate(msg, *key))
+						return;
+
+					// Add the message to the queue to be output. If no write is in
+					// progress, start writing the messages at the front of the queue
+					// (while the client is still connecting, they wait in the queue).
+					m_MessagesOut.PushBack(std::move(msg));
+					if (m_SendLimits.policy == OverflowPolicy::DropOldest)
+						DropOldest();
+					if (!m_bWriting && m_bSessionStarted)
+						ASYNC_WriteMessages();
 				});
+			return true;
+		}
+
+
+		// Bytes a message takes in the outgoing queue
+		static size_t GetQueuedSize(const Message& msg)
+		{
+			return sizeof(message_header) + msg.body.size();
+		}
+
+
+		// Account a message which is about to be queued, and apply the overflow
+		// policy if the queue gets above a high watermark. Returns false if
+		// the message must not be queued.
+		bool AddQueued(size_t nBytes)
+		{
+			size_t nQueuedBytes = m_nQueuedBytes.fetch_add(nBytes, std::memory_order_relaxed) + nBytes;
+			size_t nQueuedMessages = m_nQueuedMessages.fetch_add(1, std::memory_order_relaxed) + 1;
+			if (m_pServerQueuedBytes)
+				m_pServerQueuedBytes->fetch_add(nBytes, std::memory_order_relaxed);
+
+			if (nQueuedBytes <= m_SendLimits.nHighBytes && nQueuedMessages <= m_SendLimits.nHighMessages)
+				return true;
+
+			// Remember to report when the queue has drained
+			m_bOverflowed.store(true, std::memory_order_relaxed);
+
+			switch (m_SendLimits.policy)
+			{
+			case OverflowPolicy::DropOldest:
+				// Queued anyway, the strand makes room
+				return true;
+
+			case OverflowPolicy::Disconnect:
+				if (IsConnected())
+					std::cout << "[" << GetID() << "] Send() Failed: Outgoing queue full, disconnecting." << std::endl;
+				RemoveQueued(nBytes, 1);
+				Disconnect();
+				return false;
+
+			default:
+				RemoveQueued(nBytes, 1);
+				return false;
+			}
 		}
 
 
-		// ASYNC - Prime context to write a message body
-		void ASYNC_WriteBody()
+		// Account a message which is queued regardless of the limits
+		void AddQueuedUnlimited(size_t nBytes)
 		{
-			// If this function is called, a header has just been sent, and that header
-			// indicated a body existed for this message. Fill a transmission buffer
-			// with the body data, and send it!
-			asio::async_write(m_socket, asio::buffer(m_MessagesOut.GetFront().body.data(), m_MessagesOut.GetFront().body.size()),
-				[this](std::error_code ec, std::size_t length)
+			m_nQueuedBytes.fetch_add(nBytes, std::memory_order_relaxed);
+			m_nQueuedMessages.fetch_add(1, std::memory_order_relaxed);
+			if (m_pServerQueuedBytes)
+				m_pServerQueuedBytes->fetch_add(nBytes, std::memory_order_relaxed);
+		}
+
+
+		// Replace the unsent message with the same type and key as msg, if there
+		// is one. Returns true if it has been replaced, otherwise msg is about to be
+		// queued and its place is remembered.
+		bool Conflate(Message& msg, uint64_t key)
+		{
+			auto [it, bInserted] = m_ConflatedOut.try_emplace({ msg.header.type, key }, 0);
+
+			// The place is stale if the message has been taken for writing in the
+			// meantime (its index is then "negative", so out of range)
+			if (!bInserted && m_MessagesOut.Replace((size_t)(it->second - m_nOutFront), msg))
+			{
+				// msg now is the old message
+				RemoveQueued(GetQueuedSize(msg), 1);
+				m_nConflatedMessages.fetch_add(1, std::memory_order_relaxed);
+				return true;
+			}
+
+			it->second = m_nOutFront + m_MessagesOut.GetCount();
+			return false;
+		}
+
+
+		// Account messages which left the outgoing queue (sent or dropped)
+		void RemoveQueued(size_t nBytes, size_t nMessages)
+		{
+			m_nQueuedBytes.fetch_sub(nBytes, std::memory_order_relaxed);
+			m_nQueuedMessages.fetch_sub(nMessages, std::memory_order_relaxed);
+			if (m_pServerQueuedBytes)
+				m_pServerQueuedBytes->fetch_sub(nBytes, std::memory_order_relaxed);
+		}
+
+
+		// Drop the oldest unsent messages until the queue is below the high watermarks
+		// (the newest message always stays, and so do control messages like stream chunks)
+		void DropOldest()
+		{
+			std::vector<Message> vKeep;
+			while ((m_nQueuedBytes.load(std::memory_order_relaxed) > m_SendLimits.nHighBytes ||
+				m_nQueuedMessages.load(std::memory_order_relaxed) > m_SendLimits.nHighMessages) &&
+				m_MessagesOut.GetCount() > 1)
+			{
+				Message msg = m_MessagesOut.PopFront();
+				m_nOutFront++;
+				if (IsControlMessage(msg.header.type))
 				{
-					if (!ec)
-					{
-						// Sending was successful, so we are done with the message
-						// and remove it from the queue
-						m_MessagesOut.PopFront();
+					vKeep.push_back(std::move(msg));
+					continue;
+				}
+				RemoveQueued(GetQueuedSize(msg), 1);
+				m_nDroppedMessages.fetch_add(1, std::memory_order_relaxed);
+			}
 
-						// If the queue still has messages in it, then issue the task to 
-						// send the next messages' header.
-						if (!m_MessagesOut.IsEmpty())
-						{
-							ASYNC_WriteHeader();
-						}
-					}
-					else
-					{
-						// Sending failed, see WriteHeader() equivalent for description :P
-						std::cout << "[" << GetID() << "] WriteBody() Failed: " << ec.message() << std::endl;
-						m_socket.close();
-					}
+			// Put the kept ones back in their order
+			for (auto it = vKeep.rbegin(); it != vKeep.rend(); ++it)
+			{
+				m_MessagesOut.PushFront(std::move(*it));
+				m_nOutFront--;
+			}
+		}
+
+
+		// Queue a Writable event, if the queue has been above a high watermark
+		// and now is below both low watermarks
+		void CheckWritable()
+		{
+			if (m_bOverflowed.load(std::memory_order_relaxed) &&
+				m_nQueuedBytes.load(std::memory_order_relaxed) <= m_SendLimits.nLowBytes &&
+				m_nQueuedMessages.load(std::memory_order_relaxed) <= m_SendLimits.nLowMessages &&
+				m_bOverflowed.exchange(false, std::memory_order_relaxed) && IsConnected())
+			{
+				Message msg;
+				msg.header.type = (uint32_t)ControlMsg::Writable;
+				msg.remote = this->shared_from_this();
+				m_MessagesIn.PushBack(std::move(msg));
+			}
+		}
+
+
+		// The write batch has been written (or failed), so release it
+		void ReleaseWriteBatch()
+		{
+			size_t nBytes = 0;
+			for (const Message& msg : m_WriteBatch)
+				nBytes += GetQueuedSize(msg);
+			RemoveQueued(nBytes, m_WriteBatch.size());
+			m_WriteBatch.clear();
+		}
+
+
+		// ASYNC - Prime context to write all queued messages at once
+		void ASYNC_WriteMessages()
+		{
+			// If this function is called, we know the outgoing message queue must have 
+			// at least one message to send. Move as many queued messages as the batch
+			// limits allow into the write batch, and gather their headers and bodies
+			// into one buffer sequence, so asio can hand them to the socket with a
+			// single (vectored) write. The queue then only holds unsent messages.
+			m_bWriting = true;
+			m_nLastWrite = GetTicks();
+			m_vWriteBuffers.clear();
+			size_t nBatchBytes = 0;
+			while (!m_MessagesOut.IsEmpty())
+			{
+				const Message& next = m_MessagesOut.GetFront();
+				size_t nBuffers = next.body.empty() ? 1 : 2;
+				size_t nBytes = sizeof(message_header) + next.body.size();
+
+				// Always send at least one message, even if it exceeds the limits
+				if (!m_WriteBatch.empty() &&
+					(m_vWriteBuffers.size() + nBuffers > NETLIB_WRITE_BATCH_BUFFERS || nBatchBytes + nBytes > NETLIB_WRITE_BATCH_BYTES))
+					break;
+
+				// A deque doesn't move its items on push_back, so the buffers
+				// remain valid until the batch is released
+				m_WriteBatch.push_back(m_MessagesOut.PopFront());
+				m_nOutFront++;
+				const Message& msg = m_WriteBatch.back();
+				if (!IsControlMessage(msg.header.type))
+					m_nLastActivity = m_nLastWrite;
+				m_vWriteBuffers.push_back(asio::buffer(&msg.header, sizeof(message_header)));
+				if (!msg.body.empty())
+					m_vWriteBuffers.push_back(asio::buffer(msg.body.data(), msg.body.size()));
+
+				nBatchBytes += nBytes;
+			}
+
+			// All places of conflated messages are stale, once the queue is empty
+			if (!m_ConflatedOut.empty() && m_MessagesOut.IsEmpty())
+				m_ConflatedOut.clear();
+
+			// Same-host peers share the rings, so the batch is copied into them
+			if (m_pShm)
+			{
+				m_nShmWritten = 0;
+				m_nShmWriteSize = nBatchBytes;
+				ShmWrite();
+				return;
+			}
+
+			auto handler = asio::bind_executor(m_strand,
+				[this, self = this->shared_from_this()](std::error_code ec, std::size_t length)
+				{
+					OnMessagesWritten(ec);
 				});
+
+#if NETLIB_TLS
+			// TLS encrypts one buffer at a time, so the batch is gathered into one
+			// (otherwise every header would become a record of its own)
+			if (m_pTls)
+			{
+				m_vTlsWriteBuffer.resize(nBatchBytes);
+				asio::buffer_copy(asio::buffer(m_vTlsWriteBuffer), m_vWriteBuffers);
+				asio::async_write(*m_pTls, asio::buffer(m_vTlsWriteBuffer), std::move(handler));
+				return;
+			}
+#endif
+			asio::async_write(m_socket, m_vWriteBuffers, std::move(handler));
 		}
 
 
-		// ASYNC - Prime context ready to read a message header
-		void ASYNC_ReadHeader()
+		// The write batch has been written (or failed)
+		void OnMessagesWritten(std::error_code ec)
 		{
-			// If this function is called, we are expecting asio to wait until it receives
-			// enough bytes to form a header of a message. We know the headers are a fixed
-			// size, so allocate a transmission buffer large enough to store it. In fact, 
-			// we will construct the message in a "temporary" message object as it's 
-			// convenient to work with.
-			asio::async_read(m_socket, asio::buffer(&m_msgTemporaryIn.header, sizeof(message_header)),
-				[this](std::error_code ec, std::size_t length)
+			// Sent or not, the batch is done
+			ReleaseWriteBatch();
+			m_nLastWrite = GetTicks();
+
+			// asio has now sent the bytes - if there was a problem
+			// an error would be available...
+			if (!ec)
+			{
+				// ...no error, so tell the app if it may send again
+				CheckWritable();
+
+				// Every batch takes the next chunk of a stream along,
+				// behind the messages queued in the meantime
+				QueueStreamChunk();
+
+				// If the queue is not empty, more messages were queued while
+				// writing, so make this happen by issuing the next batch.
+				if (!m_MessagesOut.IsEmpty())
+					ASYNC_WriteMessages();
+				else
+					m_bWriting = false;
+			}
+			else
+			{
+				// ...asio failed to write the messages, we could analyse why but 
+				// for now simply assume the connection has died by closing the
+				// socket. When a future attempt to write to this client fails due
+				// to the closed socket, it will be tidied up.
+				std::cout << "[" << GetID() << "] WriteMessages() Failed: " << ec.message() << std::endl;
+				Close();
+			}
+		}
+
+
+		// ASYNC - Prime context ready to read incoming bytes
+		void ASYNC_ReadMessages()
+		{
+			// If this function is called, we are expecting asio to wait until some bytes
+			// arrive. Instead of reading each header and body on its own, we let the
+			// socket fill as much of the receive slab as it can in one go, and then
+			// cut all complete messages out of it.
+			//
+			// Make sure the slab can hold the whole message which is being assembled,
+			// and don't bother the socket with tiny reads at the end of the slab.
+			// (The slab's block header is part of NETLIB_RECV_BUFFER_SIZE, so the
+			// slab fits exactly into one of the buffer pool's size classes.)
+			if (m_RecvSlab.ReadSize() + m_RecvSlab.WriteSize() < m_nRecvFrameSize ||
+				m_RecvSlab.WriteSize() < NETLIB_RECV_BUFFER_SIZE / 4)
+			{
+				m_RecvSlab.Prepare(std::max<size_t>(NETLIB_RECV_BUFFER_SIZE - sizeof(BufferBlock), m_nRecvFrameSize));
+			}
+
+			// The rings of a same-host peer are read without the socket
+			if (m_pShm)
+			{
+				ShmRead();
+				return;
+			}
+
+			auto handler = asio::bind_executor(m_strand,
+				[this, self = this->shared_from_this()](std::error_code ec, std::size_t length)
 				{
-					// check error-flag and checksum
-					if (!ec && m_msgTemporaryIn.IsHeaderValid())
-					{
-						// Check if this message has a body to follow...
-						if (m_msgTemporaryIn.header.size > 0)
-						{
-							// it does, so allocate enough space in the messages' body
-							// vector, and issue asio with the task to read the body.
-							m_msgTemporaryIn.body.resize(m_msgTemporaryIn.header.size);
-							ASYNC_ReadBody();
-						}
-						else
-						{
-							// it doesn't, so add this bodyless message to
-							// the connections incoming message queue
-							AddToIncomingMessageQueue();
-						}
-					}
-					else
-					{
-						// Reading form the client went wrong, most likely a disconnect
-						// has occurred. Close the socket and let the system tidy it up later.
-						if (ec)
-							std::cout << "[" << GetID() << "] ReadHeader() Failed: " << ec.message() << std::endl;
-						else
-							std::cout << "[" << GetID() << "] ReadHeader() Failed: Incorrect checksum." << std::endl;
-						m_socket.close();
-					}
+					OnBytesRead(ec, length);
 				});
+
+#if NETLIB_TLS
+			// TLS decrypts into the slab, from a buffer of its own
+			if (m_pTls)
+			{
+				m_pTls->async_read_some(asio::buffer(m_RecvSlab.WriteData(), m_RecvSlab.WriteSize()), std::move(handler));
+				return;
+			}
+#endif
+
+			// A slab from the registered region is read with a fixed buffer
+			if (m_pRegisteredPool)
+			{
+				if (auto buffer = m_pRegisteredPool->GetRegisteredBuffer(m_RecvSlab.WriteData(), m_RecvSlab.WriteSize()))
+				{
+					m_socket.async_read_some(*buffer, std::move(handler));
+					return;
+				}
+			}
+			m_socket.async_read_some(asio::buffer(m_RecvSlab.WriteData(), m_RecvSlab.WriteSize()), std::move(handler));
 		}
 
 
-		// ASYNC - Prime context ready to read a message body
-		void ASYNC_ReadBody()
+		// Bytes have arrived in the receive slab (or reading failed)
+		void OnBytesRead(std::error_code ec, std::size_t length)
 		{
-			// If this function is called, a header has already been read, and that header
-			// request we read a body. The space for that body has already been allocated
-			// in the temporary message object, so just wait for the bytes to arrive...
-			asio::async_read(m_socket, asio::buffer(m_msgTemporaryIn.body.data(), m_msgTemporaryIn.body.size()),
-				[this](std::error_code ec, std::size_t length)
+			if (!ec)
+			{
+				m_RecvSlab.Commit(length);
+				m_nLastRead = GetTicks();
+
+				// Hand all complete messages to the incoming queue, then wait
+				// for more bytes. The message construction process repeats
+				// itself. Clever huh?
+				if (ReadMessagesFromSlab())
+					ASYNC_ReadMessages();
+			}
+			else
+			{
+				// Reading form the client went wrong, most likely a disconnect
+				// has occurred. Close the socket and let the system tidy it up later.
+				std::cout << "[" << GetID() << "] ReadMessages() Failed: " << ec.message() << std::endl;
+				Close();
+			}
+		}
+
+
+		// Cut all complete messages out of the receive slab and add them to
+		// the incoming queue, returns false if a corrupt message was found
+		bool ReadMessagesFromSlab()
+		{
+			while (m_RecvSlab.ReadSize() >= sizeof(message_header))
+			{
+				Message msg;
+				std::memcpy(&msg.header, m_RecvSlab.ReadData(), sizeof(message_header));
+
+				// check header checksum
+				if (!msg.IsHeaderValid())
 				{
-					// check error-flag and checksum
-					if (!ec && m_msgTemporaryIn.IsBodyValid())
-					{
-						// The message is now complete, so add
-						// the whole message to incoming queue
-						AddToIncomingMessageQueue();
-					}
+					std::cout << "[" << GetID() << "] ReadMessages() Failed: Incorrect header checksum." << std::endl;
+					Close();
+					return false;
+				}
+
+				// Bodies are kept in memory as a whole, so their size is limited
+				if (msg.header.size > NETLIB_MAX_FRAME_SIZE)
+				{
+					std::cout << "[" << GetID() << "] ReadMessages() Failed: Message too large (" << msg.header.size << " bytes)." << std::endl;
+					Close();
+					return false;
+				}
+
+				// Wait for more bytes, if the body isn't complete yet
+				m_nRecvFrameSize = sizeof(message_header) + msg.header.size;
+				if (m_RecvSlab.ReadSize() < m_nRecvFrameSize)
+					return true;
+
+				// The body references the slab, it isn't copied
+				m_RecvSlab.Skip(sizeof(message_header));
+				msg.body = m_RecvSlab.Take(msg.header.size);
+				m_nRecvFrameSize = sizeof(message_header);
+
+				// check body checksum, which must be one we accept
+				if (!(IntegrityBit(msg.header.integrity) & m_nIntegrityAccepted))
+				{
+					std::cout << "[" << GetID() << "] ReadMessages() Failed: Body checksum not accepted." << std::endl;
+					Close();
+					return false;
+				}
+				if (!msg.IsBodyValid())
+				{
+					std::cout << "[" << GetID() << "] ReadMessages() Failed: Incorrect body checksum." << std::endl;
+					Close();
+					return false;
+				}
+
+				// Compressed bodies are restored here, so the app only sees plain ones
+				if (msg.header.compression != Compression::None &&
+					(!(CompressionBit(msg.header.compression) & m_nCompressionAccepted) || !msg.Decompress(NETLIB_MAX_FRAME_SIZE)))
+				{
+					std::cout << "[" << GetID() << "] ReadMessages() Failed: Corrupt or unexpected compression." << std::endl;
+					Close();
+					return false;
+				}
+
+				// Control messages are handled by the connection itself
+				if (IsControlMessage(msg.header.type))
+				{
+					if (!OnControlMessage(msg))
+						return false;
+					continue;
+				}
+
+				// Shove it in queue, converting it to an "owned message", by initialising
+				// with the a shared pointer from this connection object
+				m_nLastActivity = m_nLastRead;
+				msg.remote = this->shared_from_this();
+				m_MessagesIn.PushBack(std::move(msg));
+			}
+			return true;
+		}
+
+
+
+		// Client - ASYNC - Wait for the server's answer to the shared memory request
+		void ASYNC_ReceiveShmAnswer()
+		{
+			m_socket.async_wait(asio::socket_base::wait_read, asio::bind_executor(m_strand,
+				[this, self = this->shared_from_this()](std::error_code ec)
+				{
+					if (!IsConnected())
+						return;
+
+					ShmHandshake result = ec ? ShmHandshake::Failed : ShmTransport::ReceiveAnswer(m_asioContext, m_socket.native_handle(), m_pShm);
+					if (result == ShmHandshake::Pending)
+						ASYNC_ReceiveShmAnswer();
 					else
+						OnShmHandshake(result);
+				}));
+		}
+
+
+		// Server - ASYNC - Wait for the client's first bytes, which are either a
+		// shared memory request (which is answered) or its session
+		void ASYNC_ReceiveShmRequest()
+		{
+			m_socket.async_wait(asio::socket_base::wait_read, asio::bind_executor(m_strand,
+				[this, self = this->shared_from_this()](std::error_code ec)
+				{
+					if (!IsConnected())
+						return;
+
+					ShmHandshake result = ec ? ShmHandshake::Failed : ShmTransport::ReceiveRequest(m_socket.native_handle());
+					if (result == ShmHandshake::Yes)
+						result = ShmTransport::SendAnswer(m_asioContext, m_socket.native_handle(), m_nShmRingBytes, m_pShm);
+					if (result == ShmHandshake::Pending)
+						ASYNC_ReceiveShmRequest();
+					else
+						OnShmHandshake(result);
+				}));
+		}
+
+
+		// The shared memory handshake is done, so the session starts, on the
+		// rings or on the socket
+		void OnShmHandshake(ShmHandshake result)
+		{
+			if (result == ShmHandshake::Failed)
+			{
+				std::cout << "[" << GetID() << "] Shared memory handshake Failed." << std::endl;
+				Close();
+				return;
+			}
+
+			if (result == ShmHandshake::Yes)
+			{
+				std::cout << "[" << GetID() << "] Shared memory: " << m_pShm->GetRingCapacity() / 1024 << " KiB rings" << std::endl;
+				m_bShm.store(true, std::memory_order_release);
+			}
+			StartSession();
+		}
+
+
+		// Copy the rest of the write batch into the outgoing ring, as far as it fits
+		void ShmWrite()
+		{
+			if (!IsConnected())
+			{
+				OnMessagesWritten(asio::error::operation_aborted);
+				return;
+			}
+
+			// The peer has corrupted the ring's indices, so it can't be trusted anymore
+			size_t nWritten = m_nShmWritten;
+			if (!m_pShm->Write(m_vWriteBuffers, m_nShmWritten))
+			{
+				OnMessagesWritten(std::make_error_code(std::errc::protocol_error));
+				return;
+			}
+			// The rings are written piecewise, so every piece is progress
+			if (m_nShmWritten != nWritten)
+				m_nLastWrite = GetTicks();
+			if (m_nShmWritten == m_nShmWriteSize)
+			{
+				// Completes after this handler, like a socket write would
+				asio::post(m_strand, [this, self = this->shared_from_this()]() { OnMessagesWritten({}); });
+				return;
+			}
+
+			// The ring is full, go on once the peer has made room
+			if (m_pShm->WaitForSpace())
+			{
+				m_bShmWriteWaiting = true;
+				ASYNC_WaitShm();
+			}
+			else
+				asio::post(m_strand, [this, self = this->shared_from_this()]() { ShmWrite(); });
+		}
+
+
+		// Copy what has arrived in the incoming ring into the receive slab
+		void ShmRead()
+		{
+			if (!IsConnected())
+				return;
+
+			size_t nBytes = m_pShm->Read(m_RecvSlab.WriteData(), m_RecvSlab.WriteSize());
+			if (nBytes)
+			{
+				// Completes after this handler, like a socket read would
+				asio::post(m_strand, [this, self = this->shared_from_this(), nBytes]() { OnBytesRead({}, nBytes); });
+				return;
+			}
+
+			// Everything the peer has written before it closed has been read
+			if (m_bShmPeerClosed)
+			{
+				std::cout << "[" << GetID() << "] ReadMessages() Failed: End of file" << std::endl;
+				Close();
+				return;
+			}
+
+			// The ring is empty, go on once the peer has written
+			if (m_pShm->WaitForData())
+			{
+				m_bShmReadWaiting = true;
+				ASYNC_WaitShm();
+			}
+			else
+				asio::post(m_strand, [this, self = this->shared_from_this()]() { ShmRead(); });
+		}
+
+
+		// ASYNC - Sleep until the peer wakes us up, then go on reading and/or
+		// writing (whatever has been waiting)
+		void ASYNC_WaitShm()
+		{
+			if (m_bShmWaiting)
+				return;
+
+			m_bShmWaiting = true;
+			m_pShm->ASYNC_WaitWakeup(asio::bind_executor(m_strand,
+				[this, self = this->shared_from_this()](std::error_code ec)
+				{
+					m_bShmWaiting = false;
+					bool bRead = std::exchange(m_bShmReadWaiting, false);
+					bool bWrite = std::exchange(m_bShmWriteWaiting, false);
+					if (ec)
 					{
-						// Reading form the client went wrong, most likely a disconnect
-						// has occurred. Close the socket and let the system tidy it up later.
-						if (ec)
-							std::cout << "[" << GetID() << "] ReadBody() Failed: " << ec.message() << std::endl;
-						else
-							std::cout << "[" << GetID() << "] ReadBody() Failed: Incorrect checksum." << std::endl;
-						m_socket.close();
+						// Closed, so the batch which waited for room is done
+						if (bWrite)
+							OnMessagesWritten(ec);
+						return;
 					}
-				});
+
+					m_pShm->ClearWakeup();
+					if (bRead)
+						ShmRead();
+					if (bWrite)
+						ShmWrite();
+				}));
 		}
 
 
-		// Once a full message is received, add it to the incoming queue
-		void AddToIncomingMessageQueue()
+		// ASYNC - With shared memory, nothing is sent over the socket anymore,
+		// so it only becomes readable once the peer has closed it
+		void ASYNC_WaitSocketClosed()
 		{
-			// Shove it in queue, converting it to an "owned message", by initialising
-			// with the a shared pointer from this connection object
-			if (m_IsServer)
-				m_msgTemporaryIn.remote = this->shared_from_this();
-			m_MessagesIn.PushBack(m_msgTemporaryIn);
+			m_socket.async_wait(asio::socket_base::wait_read, asio::bind_executor(m_strand,
+				[this, self = this->shared_from_this()](std::error_code ec)
+				{
+					if (!IsConnected())
+						return;
 
-			// We must now prime the asio context to receive the next message. It 
-			// wil just sit and wait for bytes to arrive, and the message construction
-			// process repeats itself. Clever huh?
-			ASYNC_ReadHeader();
+					// The rest of the incoming ring is read first
+					m_bShmPeerClosed = true;
+					if (std::exchange(m_bShmReadWaiting, false))
+						ShmRead();
+				}));
 		}
 
-
 	protected:
 		// Each connection has a unique socket to a remote 
-		asio::ip::tcp::socket m_socket;
+		StreamProtocol::socket m_socket;
 
 		// This context is shared with the whole asio instance
 		asio::io_context& m_asioContext;
 
+		// All handlers of this connection are serialized through its strand,
+		// so they stay in order even if the context is run by many threads
+		asio::strand<asio::io_context::executor_type> m_strand;
+
 		// This queue holds all messages to be sent to the remote side
 		// of this connection
 		MsgQueue m_MessagesOut;
 
+		// Messages currently being written, and their buffer sequence
+		// (headers and bodies)
+		std::pmr::deque<Message> m_WriteBatch;
+		std::vector<asio::const_buffer> m_vWriteBuffers;
+
+		// Shared memory transport of a same-host connection (see SetSharedMemory),
+		// how much of the write batch went into it, and what waits for the peer
+		size_t m_nShmRingBytes = 0;
+		std::unique_ptr<ShmTransport> m_pShm;
+		std::atomic<bool> m_bShm = false;
+		size_t m_nShmWritten = 0;
+		size_t m_nShmWriteSize = 0;
+		bool m_bShmWaiting = false;
+		bool m_bShmReadWaiting = false;
+		bool m_bShmWriteWaiting = false;
+		bool m_bShmPeerClosed = false;
+
+#if NETLIB_TLS
+		// TLS on top of the socket (see SetTls), and the write batch gathered for it
+		std::shared_ptr<TlsContext> m_pTlsContext;
+		std::string m_TlsHost;
+		std::string m_TlsPeer;
+		std::unique_ptr<TlsStream> m_pTls;
+		std::vector<uint8_t> m_vTlsWriteBuffer;
+		bool m_bTlsHandshaking = false;
+		std::atomic<bool> m_bTlsResumed = false;
+#endif
+		bool m_bWriting = false;
+		// Nothing is written before the session started (client: connected)
+		bool m_bSessionStarted = false;
+		// See SetCloseHandler, SetUdpTokenHandler
+		std::function<void()> m_OnClose;
+		std::function<void(uint64_t id, uint64_t token)> m_OnUdpToken;
+
+		// Size of the outgoing queue (including the write batch), its limits,
+		// and whether it went above a high watermark since the last Writable event
+		std::atomic<size_t> m_nQueuedBytes = 0;
+		std::atomic<size_t> m_nQueuedMessages = 0;
+		std::atomic<uint64_t> m_nDroppedMessages = 0;
+		SendLimits m_SendLimits;
+		std::atomic<bool> m_bOverflowed = false;
+		// Messages to conflate, and the places of the conflated ones in the
+		// outgoing queue. A place is the number of messages which had been taken
+		// from the front of the queue before it (m_nOutFront), plus its index.
+		ConflationTable m_Conflation;
+		std::unordered_map<ConflationSlot, uint64_t, ConflationSlotHash> m_ConflatedOut;
+		uint64_t m_nOutFront = 0;
+		std::atomic<uint64_t> m_nConflatedMessages = 0;
+		// Total of all outgoing queues of the server (set by Server)
+		std::shared_ptr<std::atomic<size_t>> m_pServerQueuedBytes;
+
 		// This references the incoming queue of the parent object
-		MsgQueue& m_MessagesIn;
+		MsgQueueIn& m_MessagesIn;
 
-		// Incoming messages are constructed asynchronously, so we will
-		// store the part assembled message here, until it is ready
-		Message m_msgTemporaryIn;
+		// Incoming bytes are collected here until they form complete messages,
+		// whose bodies then reference slices of it
+		BufferSlab m_RecvSlab;
+		// Pool of the slab, if its memory is registered with the context
+		RegisteredBufferPool* m_pRegisteredPool = nullptr;
+		// Size of the message which is being assembled (header + body)
+		size_t m_nRecvFrameSize = sizeof(message_header);
+
+		// Body checksum wanted for receiving, the accepted ones...
+		Integrity m_IntegrityPreferred = Integrity::CRC32C;
+		bool m_bTrustLoopback = false;
+		uint32_t m_nIntegrityAccepted = IntegrityBit(Integrity::CRC32C);
+		// ...and the one used for sending, as announced by the peer
+		std::atomic<Integrity> m_IntegritySend = Integrity::CRC32C;
+
+		// Compression wanted, the accepted ones and the one used for sending
+		Compression m_CompressionPreferred = Compression::None;
+		size_t m_nCompressThreshold = NETLIB_COMPRESS_THRESHOLD;
+		uint32_t m_nCompressionAccepted = CompressionBit(Compression::None);
+		std::atomic<Compression> m_CompressionSend = Compression::None;
+
+		// Outgoing streams, taking turns in sending their chunks
+		struct OutStream
+		{
+			uint32_t id;
+			uint32_t type;
+			StreamSource source;
+			bool bStarted = false;
+		};
+		std::deque<OutStream> m_OutStreams;
+		std::atomic<uint32_t> m_nNextStreamID = 1;
+
+		// Liveness checks (see SetTimeouts), in ticks of the timer wheel, and the
+		// ticks of the last read, write (or its progress) and app message
+		Timeouts m_Timeouts;
+		std::shared_ptr<TimerWheel> m_pTimerWheel;
+		TimerWheel::Timer m_Timer;
+		uint64_t m_nHeartbeatTicks = 0, m_nReadTicks = 0, m_nWriteTicks = 0, m_nIdleTicks = 0;
+		uint64_t m_nLastRead = 0, m_nLastWrite = 0, m_nLastActivity = 0;
+
+		// Incoming streams by ID, and where their sinks come from
+		std::unordered_map<uint32_t, std::unique_ptr<StreamSink>> m_InStreams;
+		StreamSinkFactory m_StreamSinkFactory;
 
 		// Decides how some of the connection behaves
 		bool m_IsServer;
 
 		uint16_t m_port = 0;
+
+	private:
+		friend class Server;
+
+		// Set by the server (see GetID)
+		uint64_t m_nID = 0;
+
+		// Open from the start (server side: if the socket is, client side: connecting),
+		// until Close()
+		std::atomic<bool> m_bOpen = false;
+
+		// Messages waiting for a worker of the server (parallel dispatch only).
+		// Only one worker at a time handles them, so they stay in order.
+		MsgQueue m_MessagesHandling;
+		std::atomic<bool> m_bHandlingScheduled = false;
 	};
 
 
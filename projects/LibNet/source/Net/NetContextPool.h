@@ -0,0 +1,191 @@
+#pragma once
+
+#include "NetCommon.h"
+
+#include "NetBufferPool.h"
+#include "NetRegisteredBufferPool.h"
+#include "NetTimerWheel.h"
+
+
+namespace NETLIB_NAMESPACE {
+
+
+	class ContextPool
+	{
+	public:
+		// How the I/O threads are mapped onto asio contexts
+		enum class Mode
+		{
+			// All threads run the same io_context, handlers of a single
+			// connection are kept in order by the connection's strand
+			SharedContext,
+			// Every thread runs its own io_context, connections are spread
+			// round-robin over the contexts
+			ContextPerThread
+		};
+
+
+	public:
+		ContextPool(size_t nThreads = 1, Mode mode = Mode::SharedContext)
+			: m_Mode(mode), m_nThreads(nThreads > 0 ? nThreads : 1)
+		{
+			// Create the contexts up front, so objects which need a context
+			// (like the acceptor) can be bound to it before the pool runs
+			size_t nContexts = (m_Mode == Mode::ContextPerThread) ? m_nThreads : 1;
+			for (size_t i = 0; i < nContexts; i++)
+			{
+				// Tell asio how many threads run the context, a single one lets
+				// its scheduler take some shortcuts. It still locks its queues
+				// (only ASIO_CONCURRENCY_HINT_UNSAFE would drop that), which we
+				// rely on, as the Update and worker threads post into it.
+				int hint = (nContexts == m_nThreads) ? 1 : (int)m_nThreads;
+				m_Contexts.push_back(std::make_unique<asio::io_context>(hint));
+
+				// Timeouts of the connections on this context
+				m_TimerTickers.push_back(std::make_unique<TimerWheelTicker>(*m_Contexts.back(), std::make_shared<TimerWheel>()));
+
+#if NETLIB_IO_URING
+				// Receive slabs of the connections on this context are read with fixed buffers
+				m_ReceivePools.push_back(std::make_unique<RegisteredBufferPool>(*m_Contexts.back(), NETLIB_IO_URING_RECV_BUFFERS));
+#endif
+			}
+		}
+
+
+		ContextPool(const ContextPool&) = delete; // no copy constructor
+
+
+		~ContextPool()
+		{
+			Stop();
+		}
+
+
+	public:
+		// Launch the I/O threads
+		void Start()
+		{
+			// Contexts which were stopped before have to be restarted
+			for (auto& context : m_Contexts)
+			{
+				context->restart();
+				// Keep the context running even if there is no work (yet)
+				m_WorkGuards.push_back(asio::make_work_guard(*context));
+			}
+
+			for (auto& ticker : m_TimerTickers)
+				ticker->Start();
+
+			for (size_t i = 0; i < m_nThreads; i++)
+			{
+				asio::io_context& context = *m_Contexts[i % m_Contexts.size()];
+				m_Threads.emplace_back([&context]() { context.run(); });
+			}
+		}
+
+
+		// Stop all contexts and wait for the I/O threads to exit
+		void Stop()
+		{
+			m_WorkGuards.clear();
+
+			for (auto& ticker : m_TimerTickers)
+				ticker->Stop();
+
+			for (auto& context : m_Contexts)
+				context->stop();
+
+			for (auto& thread : m_Threads)
+			{
+				if (thread.joinable())
+					thread.join();
+			}
+			m_Threads.clear();
+		}
+
+
+		// Context which should be used for things not bound to a connection (eg. the acceptor)
+		asio::io_context& GetPrimaryContext()
+		{
+			return *m_Contexts.front();
+		}
+
+
+		// Context for a new connection, distributed round-robin
+		asio::io_context& GetNextContext()
+		{
+			size_t i = m_nNextContext.fetch_add(1, std::memory_order_relaxed);
+			return *m_Contexts[i % m_Contexts.size()];
+		}
+
+
+		// Pool for the receive slabs of connections on context, which are
+		// registered with the context if it runs on io_uring
+		BufferPool& GetReceivePool(asio::io_context& context)
+		{
+			for (size_t i = 0; i < m_ReceivePools.size(); i++)
+			{
+				if (m_Contexts[i].get() == &context)
+					return *m_ReceivePools[i];
+			}
+			return BufferPool::GetDefault();
+		}
+
+
+		// Timer wheel for the timeouts of connections on context
+		std::shared_ptr<TimerWheel> GetTimerWheel(asio::io_context& context)
+		{
+			for (size_t i = 0; i < m_Contexts.size(); i++)
+			{
+				if (m_Contexts[i].get() == &context)
+					return m_TimerTickers[i]->GetWheel();
+			}
+			return nullptr;
+		}
+
+
+		size_t GetThreadCount() const { return m_nThreads; }
+		Mode GetMode() const { return m_Mode; }
+
+
+		// Name of the mechanism asio uses to wait for socket I/O. It's chosen
+		// when LibNet is compiled (see NETLIB_IO_URING), so it's the same for
+		// every context.
+		static const char* GetBackendName()
+		{
+#if defined(ASIO_HAS_IO_URING_AS_DEFAULT)
+			return "io_uring";
+#elif defined(ASIO_HAS_IOCP)
+			return "iocp";
+#elif defined(ASIO_HAS_EPOLL)
+			return "epoll";
+#elif defined(ASIO_HAS_KQUEUE)
+			return "kqueue";
+#else
+			return "select";
+#endif
+		}
+
+
+	private:
+		Mode m_Mode;
+		size_t m_nThreads;
+
+		// The contexts handle the data transfer...
+		std::vector<std::unique_ptr<asio::io_context>> m_Contexts;
+		// Registered receive pools, one per context (io_uring only), they
+		// have to go before their contexts
+		std::vector<std::unique_ptr<RegisteredBufferPool>> m_ReceivePools;
+		// A timer wheel per context, each ticked by a single timer of its context
+		std::vector<std::unique_ptr<TimerWheelTicker>> m_TimerTickers;
+		// ...and are kept alive by their work guards...
+		std::vector<asio::executor_work_guard<asio::io_context::executor_type>> m_WorkGuards;
+		// ...but need threads of their own to execute the work commands
+		std::vector<std::thread> m_Threads;
+
+		// Round-robin counter for GetNextContext()
+		std::atomic<size_t> m_nNextContext = 0;
+	};
+
+
+} // namespace Net
@@ -2,6 +2,12 @@
 
 #include "NetCommon.h"
 
+#include "NetBuffer.h"
+#include "NetChecksum.h"
+#include "NetCompression.h"
+
+#include <limits>
+
 //#include "NetConnection.h"
 
 
@@ -11,12 +17,72 @@ namespace NETLIB_NAMESPACE {
 	class Connection;
 
 
+	// Version of the wire protocol, exchanged in the handshake. The major version
+	// (the high 16 bits) changes with the framing, peers only talk to the same
+	// major version. The minor version counts additions older peers can skip:
+	//   1.0 - 20 byte header with checksums, hello with the Integrity modes
+	//   1.1 - Compression modes in the hello
+	static constexpr uint32_t PROTOCOL_VERSION_MAJOR = 1;
+	static constexpr uint32_t PROTOCOL_VERSION_MINOR = 1;
+	static constexpr uint32_t PROTOCOL_VERSION = (PROTOCOL_VERSION_MAJOR << 16) | PROTOCOL_VERSION_MINOR;
+
+
+	// Message types from CONTROL_MSG_FIRST on are reserved for the library's
+	// own control messages, which are never passed to the application
+	static constexpr uint32_t CONTROL_MSG_FIRST = 0xFFFFFF00;
+
+	enum class ControlMsg : uint32_t
+	{
+		// Handshake, sent by both sides right after connecting:
+		//   uint32_t protocol version, uint32_t mask of accepted Integrity modes,
+		//   uint32_t mask of accepted Compression modes (left out before 1.1)
+		Hello = CONTROL_MSG_FIRST,
+
+		// Local only, never sent: Queued by a connection when its socket closed
+		Disconnected,
+
+		// Part of a stream: stream_chunk_header, followed by the data
+		StreamChunk,
+
+		// Local only, never sent: Queued by a connection when its outgoing queue
+		// went below the low watermarks, after it had been above a high one
+		Writable,
+
+		// Sent when nothing else has been sent for a while (see Timeouts), so the
+		// peer knows the connection is alive. Has no body.
+		Heartbeat,
+
+		// Local only, never sent: Queued by the client when its connection is up
+		Connected,
+
+		// Sent by a server with UDP to each client: uint64_t connection ID,
+		// uint64_t token, which the client's datagrams have to carry
+		UdpToken,
+
+		// Datagram only: Sent by the client to register its UDP endpoint,
+		// and echoed by the server once it has (no body)
+		UdpHello,
+	};
+
+
+	constexpr bool IsControlMessage(uint32_t type)
+	{
+		return type >= CONTROL_MSG_FIRST && type != ((uint32_t)~((uint32_t)0));
+	}
+
+
 	struct message_header
 	{
 		// App defined type of message
 		uint32_t type = ((uint32_t)~((uint32_t)0));
 		// Size of body storage (0 if header only)
 		uint32_t size = 0;
+		// Checksum algorithm used for crc_body
+		Integrity integrity = Integrity::CRC32C;
+		// Compression of the body as it is sent (size is the compressed size)
+		Compression compression = Compression::None;
+		uint8_t reserved[2] = {};
+		// CRC-32C of the header fields above
 		uint32_t crc_header = 0;
 		uint32_t crc_body = 0;
 	};
@@ -26,50 +92,119 @@ namespace NETLIB_NAMESPACE {
 	{
 	public:
 		Message() {}
+		// The body storage is taken from (and returned to) pool
+		explicit Message(BufferPool& pool) : body(pool) {}
+		// Copies share the body, moves hand it over
+		Message(const Message&) = default;
+		Message(Message&&) noexcept = default;
+		Message& operator = (const Message&) = default;
+		Message& operator = (Message&&) noexcept = default;
 		~Message() {}
 
 	public:
 
 
-		void UpdateCRC()
+		// Checksum header and body, the body with the given algorithm
+		void UpdateCRC(Integrity mode = Integrity::CRC32C)
 		{
-			header.crc_header = 0;
-			header.crc_header += header.type;
-			header.crc_header += header.size;
+			header.integrity = mode;
+			header.crc_header = ComputeHeaderCRC();
+			header.crc_body = ComputeBodyCRC(mode);
+		}
 
-			header.crc_body = 0;
-			for (auto x : body)
-			{
-				header.crc_body += x;
-			}
+
+		bool IsHeaderValid() const
+		{
+			return (ComputeHeaderCRC() == header.crc_header);
 		}
 
 
-		bool IsHeaderValid()
+		bool IsBodyValid() const
 		{
-			uint32_t check = 0;
-			check += header.type;
-			check += header.size;
+			if (!IsHeaderValid())
+				return false;
+
+			// An unknown algorithm is never valid
+			if (header.integrity != Integrity::None && header.integrity != Integrity::CRC32C)
+				return false;
 
-			return (check == header.crc_header);
+			return (ComputeBodyCRC(header.integrity) == header.crc_body);
 		}
 
 
-		bool IsBodyValid()
+		// Compresses the body with mode, if it has at least nThreshold bytes and
+		// gets smaller. Returns false if the body is left as it is.
+		bool Compress(Compression mode, size_t nThreshold = NETLIB_COMPRESS_THRESHOLD)
 		{
-			if (!IsHeaderValid())
+			if (mode != Compression::LZ4 || header.compression != Compression::None || body.size() < std::max<size_t>(nThreshold, sizeof(uint32_t) + 1))
 				return false;
 
-			uint32_t check = 0;
-			for (auto x : body)
-			{
-				check += x;
-			}
+			// Only worth it if the result (with its size in front) is smaller. The
+			// new body comes from the same pool (like the connection's) as the old one.
+			const Buffer& source = body;
+			Buffer packed(source.size(), source.GetPool());
+			size_t nPacked = LZ4::Compress(source.data(), source.size(), packed.data() + sizeof(uint32_t), source.size() - sizeof(uint32_t) - 1);
+			if (nPacked == 0)
+				return false;
 
-			return (check == header.crc_body);
+			uint32_t nSize = (uint32_t)source.size();
+			std::memcpy(packed.data(), &nSize, sizeof(uint32_t));
+			packed.resize(sizeof(uint32_t) + nPacked);
+
+			body = std::move(packed);
+			header.size = (uint32_t)body.size();
+			header.compression = mode;
+			return true;
 		}
 
 
+		// Restores a compressed body, decompressing straight into the new body
+		// storage. Returns false if the body is corrupt or would be larger than nMaxSize.
+		bool Decompress(size_t nMaxSize = std::numeric_limits<uint32_t>::max())
+		{
+			if (header.compression == Compression::None)
+				return true;
+			if (header.compression != Compression::LZ4 || body.size() < sizeof(uint32_t))
+				return false;
+
+			// Read only, a body which references the receive slab isn't copied
+			const Buffer& packed = body;
+			uint32_t nSize;
+			std::memcpy(&nSize, packed.data(), sizeof(uint32_t));
+			size_t nPacked = packed.size() - sizeof(uint32_t);
+			if (nSize > nMaxSize || nSize > LZ4::GetMaxDecompressedSize(nPacked))
+				return false;
+
+			Buffer unpacked(nSize, packed.GetPool());
+			if (!LZ4::Decompress(packed.data() + sizeof(uint32_t), nPacked, unpacked.data(), nSize))
+				return false;
+
+			body = std::move(unpacked);
+			header.size = nSize;
+			header.compression = Compression::None;
+			return true;
+		}
+
+
+	private:
+		uint32_t ComputeHeaderCRC() const
+		{
+			return CRC32C::Compute(&header, offsetof(message_header, crc_header));
+		}
+
+
+		uint32_t ComputeBodyCRC(Integrity mode) const
+		{
+			// The "trust TCP" mode doesn't touch the body at all
+			if (mode == Integrity::None)
+				return 0;
+			return CRC32C::Compute(body.data(), body.size());
+		}
+
+
+	public:
+
+
 		// Should be implemented by the application to push data onto the body storage
 //		virtual void Serialize() {}
 		// Should be implemented by the application to pop data from the body storage
@@ -110,8 +245,9 @@ namespace NETLIB_NAMESPACE {
 
 			// Cache the location towards the end of the vector where the pulled data starts
 			size_t i = msg.body.size() - sizeof(uint32_t);
-			// Physically copy the data from the vector into the user variable
-			std::memcpy(&data_size, msg.body.data() + i, sizeof(uint32_t));
+			// Physically copy the data from the vector into the user variable (read
+			// only, a body which shares the receive slab isn't copied for it)
+			std::memcpy(&data_size, std::as_const(msg.body).data() + i, sizeof(uint32_t));
 			// Shrink the vector to remove read bytes, and reset end position
 			msg.body.resize(i);
 			// Recalculate the message size
@@ -166,7 +302,7 @@ namespace NETLIB_NAMESPACE {
 				// Cache the location towards the end of the vector where the pulled data starts
 				size_t i = msg.body.size() - sizeof(DataType);
 				// Physically copy the data from the vector into the user variable
-				std::memcpy(&data, msg.body.data() + i, sizeof(DataType));
+				std::memcpy(&data, std::as_const(msg.body).data() + i, sizeof(DataType));
 				// Shrink the vector to remove read bytes, and reset end position
 				msg.body.resize(i);
 				// Recalculate the message size
@@ -213,11 +349,8 @@ namespace NETLIB_NAMESPACE {
 				data.resize(data_size);
 				// Cache the location towards the end of the vector where the pulled data starts
 				size_t i = msg.body.size() - data_size;
-				// Physically copy the data from the vector into the user variable (char by char)
-				for (size_t n = 0; n < data_size; n++)
-				{
-					data[n] = msg.body.data()[i + n];
-				}
+				// Physically copy the data from the vector into the user variable
+				std::memcpy(data.data(), std::as_const(msg.body).data() + i, data_size);
 				// Shrink the vector to remove read bytes, and reset end position
 				msg.body.resize(i);
 				// Recalculate the message size
@@ -230,9 +363,9 @@ namespace NETLIB_NAMESPACE {
 
 
 	public:
-		// Storage for header & body
+		// Storage for header & body (the body is shared, not copied, when the message is copied)
 		message_header header{};
-		std::vector<uint8_t> body;
+		Buffer body;
 
 		// Remote-Connection of the message
 		//   On a server, remote would be the client that sent the message
@@ -0,0 +1,318 @@
+#pragma once
+
+#include "NetCommon.h"
+
+#include "NetConnection.h"
+#include "NetMessage.h"
+#include "NetSerializer.h"
+
+#include <tuple>
+#include <limits>
+#include <concepts>
+
+
+namespace NETLIB_NAMESPACE {
+
+
+	// Message types are declared by the application as structs, tagged with
+	// their type id. The body is either the struct itself (if it's trivially
+	// copyable), or the fields returned by Fields() (written by MessageWriter
+	// in compact mode):
+	//
+	//   struct PingMsg
+	//   {
+	//       static constexpr uint32_t TYPE = MsgTypes::ServerPing;
+	//       std::chrono::system_clock::time_point timeSent;
+	//   };
+	//
+	//   struct ChatMsg
+	//   {
+	//       static constexpr uint32_t TYPE = MsgTypes::Chat;
+	//       uint16_t from;
+	//       std::string text;
+	//       auto Fields() { return std::tie(from, text); }
+	//   };
+	template<typename T>
+	concept MessageType = requires
+	{
+		{ T::TYPE } -> std::convertible_to<uint32_t>;
+	};
+
+
+	template<typename T>
+	concept FieldsMessageType = MessageType<T> && requires(T& data)
+	{
+		data.Fields();
+	};
+
+
+	// Encodes/decodes a message type and knows the sizes its body may have
+	template<MessageType T>
+	class MessageCodec
+	{
+	public:
+		static_assert(FieldsMessageType<T> || std::is_trivially_copyable_v<T>, "Message needs Fields() if it isn't trivially copyable");
+		static_assert(!IsControlMessage(T::TYPE), "Message type id is reserved for control messages");
+
+
+		static constexpr uint32_t TYPE = T::TYPE;
+
+
+		// Writes data into the body of msg and sets its type
+		static void Encode(Message& msg, const T& data)
+		{
+			msg.header.type = TYPE;
+
+			if constexpr (FieldsMessageType<T>)
+			{
+				MessageWriter writer(msg);
+				writer.Reserve(MIN_SIZE);
+				// Fields() returns references, which are only read here
+				std::apply([&writer](const auto&... fields) { (writer.Write(fields), ...); }, const_cast<T&>(data).Fields());
+			}
+			else if constexpr (!std::is_empty_v<T>)
+			{
+				msg.body.resize(sizeof(T));
+				std::memcpy(msg.body.data(), &data, sizeof(T));
+				msg.header.size = (uint32_t)msg.body.size();
+			}
+		}
+
+
+		static Message Encode(const T& data)
+		{
+			Message msg;
+			Encode(msg, data);
+			return msg;
+		}
+
+
+		// Reads data from the body of msg, returns false if the body doesn't fit
+		static bool Decode(const Message& msg, T& data)
+		{
+			if (!IsSizeValid(msg.body.size()))
+				return false;
+
+			if constexpr (FieldsMessageType<T>)
+			{
+				MessageReader reader(msg);
+				std::apply([&reader](auto&... fields) { (reader.Read(fields), ...); }, data.Fields());
+				return reader.IsValid() && reader.GetRemaining() == 0;
+			}
+			else if constexpr (!std::is_empty_v<T>)
+			{
+				std::memcpy(&data, msg.body.data(), sizeof(T));
+				return true;
+			}
+			else
+			{
+				return true;
+			}
+		}
+
+
+		// Checks the body size, before anything is decoded
+		static constexpr bool IsSizeValid(size_t nSize)
+		{
+			return nSize >= MIN_SIZE && nSize <= MAX_SIZE;
+		}
+
+
+	private:
+		// Minimum and maximum size of a single field in the body
+		template<typename F>
+		struct FieldSize
+		{
+			static constexpr size_t MIN = sizeof(uint32_t);
+			static constexpr size_t MAX = std::numeric_limits<uint32_t>::max();
+		};
+
+		// Views are trivially copyable, but written like the ranges they view (a
+		// count and the elements), so they come before the fixed size fields
+		template<typename CharT, typename Traits>
+		struct FieldSize<std::basic_string_view<CharT, Traits>>
+		{
+			static constexpr size_t MIN = sizeof(uint32_t);
+			static constexpr size_t MAX = std::numeric_limits<uint32_t>::max();
+		};
+
+		template<typename DataType, size_t Extent>
+		struct FieldSize<std::span<DataType, Extent>>
+		{
+			static constexpr size_t MIN = sizeof(uint32_t);
+			static constexpr size_t MAX = std::numeric_limits<uint32_t>::max();
+		};
+
+		template<typename F>
+			requires std::is_trivially_copyable_v<F>
+		struct FieldSize<F>
+		{
+			static constexpr size_t MIN = sizeof(F);
+			static constexpr size_t MAX = sizeof(F);
+		};
+
+
+		template<typename Tuple>
+		struct BodySize;
+
+		template<typename... F>
+		struct BodySize<std::tuple<F...>>
+		{
+			static constexpr size_t MIN = (size_t(0) + ... + FieldSize<std::remove_cvref_t<F>>::MIN);
+			static constexpr size_t MAX = std::min<size_t>((size_t(0) + ... + FieldSize<std::remove_cvref_t<F>>::MAX), std::numeric_limits<uint32_t>::max());
+		};
+
+
+		// Messages without data (empty structs) have no body at all
+		static constexpr size_t GetMinSize()
+		{
+			if constexpr (FieldsMessageType<T>)
+				return BodySize<decltype(std::declval<T&>().Fields())>::MIN;
+			else
+				return std::is_empty_v<T> ? 0 : sizeof(T);
+		}
+
+
+		static constexpr size_t GetMaxSize()
+		{
+			if constexpr (FieldsMessageType<T>)
+				return BodySize<decltype(std::declval<T&>().Fields())>::MAX;
+			else
+				return std::is_empty_v<T> ? 0 : sizeof(T);
+		}
+
+
+	public:
+		static constexpr size_t MIN_SIZE = GetMinSize();
+		static constexpr size_t MAX_SIZE = GetMaxSize();
+	};
+
+
+	// Shorthand for MessageCodec<T>::Encode
+	template<MessageType T>
+	Message Encode(const T& data)
+	{
+		return MessageCodec<T>::Encode(data);
+	}
+
+
+	// Calls the typed handler of the application for each message:
+	//
+	//   void On(const PingMsg& msg, Connection& remote);
+	//
+	// The handlers are found through a jump table, indexed by the type id, which
+	// is built at compile time. Unknown types and bodies of the wrong size are
+	// rejected before anything is decoded, they are passed to
+	//
+	//   void OnRejected(Message& msg);
+	//
+	// if the handler has one. The type ids should be dense, as the table covers
+	// the whole range from the lowest to the highest id.
+	//
+	//   Net::MessageDispatcher<MyServer, PingMsg, ChatMsg> m_Dispatcher{ *this };
+	//   ...
+	//   Update(m_Dispatcher);
+	template<typename Handler, MessageType... MessageTypes>
+	class MessageDispatcher
+	{
+	public:
+		static_assert(sizeof...(MessageTypes) > 0, "Dispatcher needs at least one message type");
+
+
+		static constexpr uint32_t MIN_TYPE = std::min({ (uint32_t)MessageTypes::TYPE... });
+		static constexpr uint32_t MAX_TYPE = std::max({ (uint32_t)MessageTypes::TYPE... });
+		static constexpr size_t TABLE_SIZE = size_t(MAX_TYPE) - MIN_TYPE + 1;
+
+		static_assert(TABLE_SIZE <= NETLIB_DISPATCH_TABLE_MAX, "Message type ids are too sparse for a jump table (see NETLIB_DISPATCH_TABLE_MAX)");
+
+
+		explicit MessageDispatcher(Handler& handler)
+			: m_handler(handler)
+		{
+		}
+
+
+	public:
+		// Passes msg to its handler, returns false if it has been rejected
+		bool Dispatch(Message& msg)
+		{
+			// Type and size are checked first, the handler decodes the body
+			if (IsAcceptable(msg) && s_Table[msg.header.type - MIN_TYPE].pFunc(m_handler, msg))
+				return true;
+
+			Reject(msg);
+			return false;
+		}
+
+
+		// Returns true if msg would be passed to a handler (type and body size only)
+		static bool IsAcceptable(const Message& msg)
+		{
+			// Unsigned, so types below MIN_TYPE wrap around and are out of range too
+			size_t i = size_t(msg.header.type - MIN_TYPE);
+			if (i >= TABLE_SIZE)
+				return false;
+			const Entry& entry = s_Table[i];
+			return entry.pFunc && msg.body.size() >= entry.nMinSize && msg.body.size() <= entry.nMaxSize;
+		}
+
+
+	private:
+		using Func = bool (*)(Handler&, Message&);
+
+		struct Entry
+		{
+			Func pFunc = nullptr;
+			size_t nMinSize = 0;
+			size_t nMaxSize = 0;
+		};
+
+
+		// Decodes the body and calls the handler
+		template<MessageType T>
+		static bool Call(Handler& handler, Message& msg)
+		{
+			T data;
+			if (!MessageCodec<T>::Decode(msg, data))
+				return false;
+			handler.On(static_cast<const T&>(data), *msg.remote);
+			return true;
+		}
+
+
+		static constexpr std::array<Entry, TABLE_SIZE> MakeTable()
+		{
+			std::array<Entry, TABLE_SIZE> table{};
+			bool bDuplicate = false;
+			auto add = [&table, &bDuplicate]<typename T>(std::type_identity<T>)
+			{
+				Entry& entry = table[T::TYPE - MIN_TYPE];
+				bDuplicate |= (entry.pFunc != nullptr);
+				entry = { &Call<T>, MessageCodec<T>::MIN_SIZE, MessageCodec<T>::MAX_SIZE };
+			};
+			(add(std::type_identity<MessageTypes>{}), ...);
+
+			// Not a constant expression, so a duplicate fails to compile
+			if (bDuplicate)
+				throw "Message type id is used by more than one message";
+			return table;
+		}
+
+
+		void Reject(Message& msg)
+		{
+			if constexpr (requires { m_handler.OnRejected(msg); })
+				m_handler.OnRejected(msg);
+			else
+				std::cout << "[" << (msg.remote ? msg.remote->GetID() : 0) << "] Dispatch() type: " << msg.header.type << " size: " << msg.header.size << " - Rejected!!!" << std::endl;
+		}
+
+
+	private:
+		static constexpr std::array<Entry, TABLE_SIZE> s_Table = MakeTable();
+
+		Handler& m_handler;
+	};
+
+
+} // namespace Net
@@ -11,7 +11,13 @@ namespace NETLIB_NAMESPACE {
 	class MsgQueue
 	{
 	public:
-		MsgQueue() = default;
+		// The queue nodes are allocated from pResource, so they are recycled too
+		explicit MsgQueue(std::pmr::memory_resource* pResource = &BufferPool::GetDefault())
+			: m_deque(pResource)
+		{
+		}
+
+
 		MsgQueue(const MsgQueue&) = delete; // no copy constructor
 		~MsgQueue() { Clear(); }
 
@@ -44,6 +50,14 @@ namespace NETLIB_NAMESPACE {
 		}
 
 
+		// Removes count items from front of queue
+		void PopFront(size_t count)
+		{
+			std::scoped_lock scoped_lock(m_mutexQueue);
+			m_deque.erase(m_deque.begin(), m_deque.begin() + std::min(count, m_deque.size()));
+		}
+
+
 		// Removes and returns item from back of queue
 		Message PopBack()
 		{
@@ -57,22 +71,94 @@ namespace NETLIB_NAMESPACE {
 		// Adds an item to front of queue
 		void PushFront(const Message& msg)
 		{
-			std::scoped_lock scoped_lock(m_mutexQueue);
-			m_deque.emplace_front(std::move(msg));
+			EmplaceFront(msg);
+		}
 
-			std::unique_lock<std::mutex> unique_lock(m_mutexBlocking);
-			m_condBlocking.notify_one();
+
+		void PushFront(Message&& msg)
+		{
+			EmplaceFront(std::move(msg));
 		}
 
 
 		// Adds an item to back of queue
 		void PushBack(const Message& msg)
+		{
+			EmplaceBack(msg);
+		}
+
+
+		void PushBack(Message&& msg)
+		{
+			EmplaceBack(std::move(msg));
+		}
+
+
+		// Constructs an item in place at front of queue
+		template<typename... Args>
+		void EmplaceFront(Args&&... args)
+		{
+			{
+				std::scoped_lock scoped_lock(m_mutexQueue);
+				m_deque.emplace_front(std::forward<Args>(args)...);
+			}
+			Notify();
+		}
+
+
+		// Constructs an item in place at back of queue
+		template<typename... Args>
+		void EmplaceBack(Args&&... args)
+		{
+			{
+				std::scoped_lock scoped_lock(m_mutexQueue);
+				m_deque.emplace_back(std::forward<Args>(args)...);
+			}
+			Notify();
+		}
+
+
+		// Moves all items into out, oldest first
+		void Drain(std::pmr::deque<Message>& out)
 		{
 			std::scoped_lock scoped_lock(m_mutexQueue);
-			m_deque.emplace_back(std::move(msg));
+			if (out.empty() && out.get_allocator() == m_deque.get_allocator())
+			{
+				// Simply swap the containers, if possible
+				out.swap(m_deque);
+			}
+			else
+			{
+				std::move(m_deque.begin(), m_deque.end(), std::back_inserter(out));
+				m_deque.clear();
+			}
+		}
 
-			std::unique_lock<std::mutex> unique_lock(m_mutexBlocking);
-			m_condBlocking.notify_one();
+
+		// Swaps msg with the item at nIndex (counted from the front), if there is
+		// one of the same type. Returns true if it has been swapped, msg then
+		// holds the item which was replaced.
+		bool Replace(size_t nIndex, Message& msg)
+		{
+			std::scoped_lock scoped_lock(m_mutexQueue);
+			if (nIndex >= m_deque.size() || m_deque[nIndex].header.type != msg.header.type)
+				return false;
+			std::swap(m_deque[nIndex], msg);
+			return true;
+		}
+
+
+		// Calls func for the items from the front of queue, until it returns false.
+		// The items stay in the queue, and so do the references passed to func.
+		template<typename Func>
+		void Peek(Func func)
+		{
+			std::scoped_lock scoped_lock(m_mutexQueue);
+			for (const auto& msg : m_deque)
+			{
+				if (!func(msg))
+					break;
+			}
 		}
 
 
@@ -103,17 +189,26 @@ namespace NETLIB_NAMESPACE {
 		// Waits until queue has messages
 		void Wait()
 		{
-			while (IsEmpty())
-			{
-				std::unique_lock<std::mutex> unique_lock(m_mutexBlocking);
-				m_condBlocking.wait(unique_lock);
-			}
+			// The check happens under the blocking mutex, so a push can't
+			// slip in between the check and the wait
+			std::unique_lock<std::mutex> unique_lock(m_mutexBlocking);
+			m_condBlocking.wait(unique_lock, [this]() { return !IsEmpty(); });
+		}
+
+
+	protected:
+		// Wakes up a waiting thread (never called with m_mutexQueue held,
+		// as Wait() takes the mutexes in the opposite order)
+		void Notify()
+		{
+			std::unique_lock<std::mutex> unique_lock(m_mutexBlocking);
+			m_condBlocking.notify_one();
 		}
 
 
 	protected:
 		std::mutex m_mutexQueue;
-		std::deque<Message> m_deque;
+		std::pmr::deque<Message> m_deque;
 		std::condition_variable m_condBlocking;
 		std::mutex m_mutexBlocking;
 	};
@@ -0,0 +1,161 @@
+#pragma once
+
+#include "NetCommon.h"
+
+#include "NetMessage.h"
+#include "NetMsgQueue.h"
+
+
+namespace NETLIB_NAMESPACE {
+
+
+	// Lock-free queue for many producers (the I/O threads) and a single
+	// consumer (the thread calling Update).
+	//
+	// Producers push onto an atomic stack with a single compare-and-swap, the
+	// consumer takes the whole stack with a single exchange and restores the
+	// arrival order. Waiting is futex based (std::atomic::wait) and can't miss
+	// a push, because producers only skip the wakeup if nobody is sleeping.
+	class MsgQueueMPSC
+	{
+	public:
+		explicit MsgQueueMPSC(std::pmr::memory_resource* pResource = &BufferPool::GetDefault())
+			: m_Allocator(pResource)
+		{
+		}
+
+
+		MsgQueueMPSC(const MsgQueueMPSC&) = delete; // no copy constructor
+
+
+		~MsgQueueMPSC()
+		{
+			Clear();
+		}
+
+
+	public:
+		// Adds an item to back of queue (may be called by any thread)
+		void PushBack(const Message& msg)
+		{
+			EmplaceBack(msg);
+		}
+
+
+		void PushBack(Message&& msg)
+		{
+			EmplaceBack(std::move(msg));
+		}
+
+
+		// Constructs an item in place at back of queue (may be called by any thread)
+		template<typename... Args>
+		void EmplaceBack(Args&&... args)
+		{
+			Node* pNode = m_Allocator.allocate(1);
+			std::construct_at(pNode, std::forward<Args>(args)...);
+
+			// Link the node in front of the current stack top
+			pNode->pNext = m_pHead.load(std::memory_order_relaxed);
+			while (!m_pHead.compare_exchange_weak(pNode->pNext, pNode, std::memory_order_seq_cst, std::memory_order_relaxed))
+				;
+
+			// Wake up the consumer, but only if it is (about to be) sleeping
+			if (m_bSleeping.load(std::memory_order_seq_cst))
+			{
+				m_nWakeups.fetch_add(1, std::memory_order_release);
+				m_nWakeups.notify_one();
+			}
+		}
+
+
+		// Moves all items into out, oldest first (consumer only)
+		void Drain(std::pmr::deque<Message>& out)
+		{
+			// Take the whole stack in one go...
+			Node* pNode = m_pHead.exchange(nullptr, std::memory_order_acquire);
+
+			// ...which is in reverse order, so turn it around...
+			Node* pFirst = nullptr;
+			while (pNode)
+			{
+				Node* pNext = pNode->pNext;
+				pNode->pNext = pFirst;
+				pFirst = pNode;
+				pNode = pNext;
+			}
+
+			// ...and hand the messages over
+			while (pFirst)
+			{
+				Node* pNext = pFirst->pNext;
+				out.push_back(std::move(pFirst->msg));
+				std::destroy_at(pFirst);
+				m_Allocator.deallocate(pFirst, 1);
+				pFirst = pNext;
+			}
+		}
+
+
+		// Returns true if queue has no items
+		bool IsEmpty() const
+		{
+			return m_pHead.load(std::memory_order_seq_cst) == nullptr;
+		}
+
+
+		// Clears queue (consumer only)
+		void Clear()
+		{
+			std::pmr::deque<Message> discard(m_Allocator.resource());
+			Drain(discard);
+		}
+
+
+		// Waits until queue has messages (consumer only)
+		void Wait()
+		{
+			while (IsEmpty())
+			{
+				uint32_t nWakeups = m_nWakeups.load(std::memory_order_acquire);
+
+				// Announce the sleep before checking the queue again. A producer
+				// either sees the flag (and wakes us), or we see its message.
+				m_bSleeping.store(true, std::memory_order_seq_cst);
+				if (IsEmpty())
+					m_nWakeups.wait(nWakeups, std::memory_order_acquire);
+				m_bSleeping.store(false, std::memory_order_relaxed);
+			}
+		}
+
+
+	private:
+		struct Node
+		{
+			Message msg;
+			Node* pNext = nullptr;
+
+			template<typename... Args>
+			explicit Node(Args&&... args) : msg(std::forward<Args>(args)...) {}
+		};
+
+		std::pmr::polymorphic_allocator<Node> m_Allocator;
+
+		// Top of the stack of pushed messages (newest first)
+		std::atomic<Node*> m_pHead = nullptr;
+
+		// Futex word and flag for Wait()
+		std::atomic<uint32_t> m_nWakeups = 0;
+		std::atomic<bool> m_bSleeping = false;
+	};
+
+
+	// Queue type used for the incoming messages of Server and Client
+#if NETLIB_LOCKFREE_INCOMING
+	using MsgQueueIn = MsgQueueMPSC;
+#else
+	using MsgQueueIn = MsgQueue;
+#endif
+
+
+} // namespace Net
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "NetCommon.h"
+
+#include "NetBufferPool.h"
+
+
+namespace NETLIB_NAMESPACE {
+
+
+	// Buffer pool whose receive slabs come from one memory region, which is
+	// registered with an io_context. With the io_uring backend, the kernel then
+	// reads into these slabs with fixed buffers (IORING_OP_READ_FIXED), so it
+	// doesn't have to map the pages of every single read.
+	//
+	// Only blocks of the receive slab size are taken from the region, everything
+	// else (and slabs once the region is used up) comes from the default pool.
+	// Without io_uring, asio treats registered buffers like any other buffer.
+	//
+	// NOTE: Must be destroyed before its io_context.
+	class RegisteredBufferPool : public BufferPool
+	{
+	public:
+		// Registers nBlocks slabs of NETLIB_RECV_BUFFER_SIZE bytes with context
+		RegisteredBufferPool(asio::io_context& context, size_t nBlocks)
+			: m_nBlockSize(BufferPool::GetBlockSize(NETLIB_RECV_BUFFER_SIZE)), m_nBlocks(nBlocks > 0 ? nBlocks : 1)
+		{
+			// Page aligned, so the kernel pins as few pages as possible
+			m_pRegion = static_cast<uint8_t*>(::operator new(m_nBlockSize * m_nBlocks, std::align_val_t(4096)));
+			for (size_t i = m_nBlocks; i-- > 0; )
+				m_vFreeBlocks.push_back(m_pRegion + i * m_nBlockSize);
+
+			// The whole region is a single registered buffer (index 0)
+			m_Registration.emplace(context, asio::mutable_buffer(m_pRegion, m_nBlockSize * m_nBlocks));
+		}
+
+
+		RegisteredBufferPool(const RegisteredBufferPool&) = delete; // no copy constructor
+
+
+		~RegisteredBufferPool()
+		{
+			m_Registration.reset();
+			::operator delete(m_pRegion, std::align_val_t(4096));
+		}
+
+
+	public:
+		// Returns the registered buffer for nBytes at pData, if pData lies within
+		// the region. Reads into it are done with the fixed buffer.
+		std::optional<asio::mutable_registered_buffer> GetRegisteredBuffer(uint8_t* pData, size_t nBytes)
+		{
+			if (!IsInRegion(pData))
+				return std::nullopt;
+			return asio::buffer((*m_Registration)[0] + size_t(pData - m_pRegion), nBytes);
+		}
+
+
+		// Number of slabs which are currently taken from the region
+		size_t GetUsedBlocks()
+		{
+			std::scoped_lock scoped_lock(m_mutexFree);
+			return m_nBlocks - m_vFreeBlocks.size();
+		}
+
+
+	protected:
+		void* do_allocate(size_t nBytes, size_t nAlignment) override
+		{
+			if (nBytes == m_nBlockSize && nAlignment <= alignof(std::max_align_t))
+			{
+				std::scoped_lock scoped_lock(m_mutexFree);
+				if (!m_vFreeBlocks.empty())
+				{
+					void* p = m_vFreeBlocks.back();
+					m_vFreeBlocks.pop_back();
+					return p;
+				}
+			}
+			return BufferPool::GetDefault().allocate(nBytes, nAlignment);
+		}
+
+
+		void do_deallocate(void* p, size_t nBytes, size_t nAlignment) override
+		{
+			// Slabs are released by whoever drops the last message referencing
+			// them, which is usually not the I/O thread, hence the lock
+			if (IsInRegion(p))
+			{
+				std::scoped_lock scoped_lock(m_mutexFree);
+				m_vFreeBlocks.push_back(static_cast<uint8_t*>(p));
+				return;
+			}
+			BufferPool::GetDefault().deallocate(p, nBytes, nAlignment);
+		}
+
+
+	private:
+		bool IsInRegion(const void* p) const
+		{
+			const uint8_t* pData = static_cast<const uint8_t*>(p);
+			return pData >= m_pRegion && pData < m_pRegion + m_nBlockSize * m_nBlocks;
+		}
+
+
+	private:
+		size_t m_nBlockSize;
+		size_t m_nBlocks;
+		uint8_t* m_pRegion = nullptr;
+
+		// Slabs of the region which aren't in use
+		std::vector<uint8_t*> m_vFreeBlocks;
+		std::mutex m_mutexFree;
+
+		std::optional<asio::buffer_registration<asio::mutable_buffer>> m_Registration;
+	};
+
+
+} // namespace Net
@@ -0,0 +1,400 @@
+#pragma once
+
+#include "NetCommon.h"
+
+#include "NetMessage.h"
+
+#include <span>
+#include <array>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+
+namespace NETLIB_NAMESPACE {
+
+
+	// Layout of the fields written by MessageWriter, the reader has to use the same
+	enum class SerializeMode
+	{
+		// Just the data, no overhead at all
+		Compact,
+		// Every field is preceded by its (element) size, so the reader can
+		// detect a mismatch of the data types (costs 4 bytes per field)
+		Tagged,
+	};
+
+
+	// Writes fields into the body of a message, front to back (First-In, First-Out).
+	//
+	// Fields are any trivially copyable data, strings and contiguous ranges
+	// (std::span, std::vector, std::array) of trivially copyable data, the
+	// latter are copied in one go. Strings and ranges of dynamic size are
+	// preceded by their element count (uint32_t).
+	//
+	//   MessageWriter writer(msg);
+	//   writer.Reserve(...);
+	//   writer << position << name << vPoints;
+	class MessageWriter
+	{
+	public:
+		explicit MessageWriter(Message& msg, SerializeMode mode = SerializeMode::Compact)
+			: m_msg(msg), m_mode(mode)
+		{
+		}
+
+
+		MessageWriter(const MessageWriter&) = delete; // no copy constructor
+
+
+	public:
+		// Makes sure nBytes more bytes fit into the body without another allocation
+		void Reserve(size_t nBytes)
+		{
+			m_msg.body.reserve(m_msg.body.size() + nBytes);
+		}
+
+
+		// Size of the body written so far
+		size_t GetSize() const
+		{
+			return m_msg.body.size();
+		}
+
+
+		// Writes any trivially copyable data
+		template<typename DataType>
+		MessageWriter& Write(const DataType& data)
+		{
+			static_assert(std::is_trivially_copyable_v<DataType>, "Data is too complex to be written into the body");
+
+			WriteTag(sizeof(DataType));
+			std::memcpy(Grow(sizeof(DataType)), &data, sizeof(DataType));
+			return *this;
+		}
+
+
+		// Writes a contiguous range of trivially copyable data, preceded by its count
+		template<typename DataType>
+		MessageWriter& Write(std::span<const DataType> data)
+		{
+			static_assert(std::is_trivially_copyable_v<DataType>, "Data is too complex to be written into the body");
+
+			WriteTag(sizeof(DataType));
+			WriteCount(data.size());
+			if (!data.empty())
+				std::memcpy(Grow(data.size_bytes()), data.data(), data.size_bytes());
+			return *this;
+		}
+
+
+		template<typename DataType>
+		MessageWriter& Write(std::span<DataType> data)
+		{
+			return Write(std::span<const DataType>(data));
+		}
+
+
+		template<typename DataType, typename Alloc>
+		MessageWriter& Write(const std::vector<DataType, Alloc>& data)
+		{
+			return Write(std::span<const DataType>(data));
+		}
+
+
+		// Fixed size arrays don't need a count
+		template<typename DataType, size_t N>
+		MessageWriter& Write(const std::array<DataType, N>& data)
+		{
+			static_assert(std::is_trivially_copyable_v<DataType>, "Data is too complex to be written into the body");
+
+			WriteTag(sizeof(DataType));
+			std::memcpy(Grow(sizeof(DataType) * N), data.data(), sizeof(DataType) * N);
+			return *this;
+		}
+
+
+		// Writes a string, preceded by its length
+		MessageWriter& Write(std::string_view data)
+		{
+			return Write(std::span<const char>(data.data(), data.size()));
+		}
+
+
+		MessageWriter& Write(const std::string& data)
+		{
+			return Write(std::string_view(data));
+		}
+
+
+		MessageWriter& Write(const char* data)
+		{
+			return Write(std::string_view(data));
+		}
+
+
+		// String literals are strings, not arrays of chars
+		template<size_t N>
+		MessageWriter& Write(const char (&data)[N])
+		{
+			return Write(std::string_view(data, strnlen(data, N)));
+		}
+
+
+		template<typename DataType>
+		MessageWriter& operator << (const DataType& data)
+		{
+			return Write(data);
+		}
+
+
+	private:
+		// Appends nBytes to the body and returns where they start
+		uint8_t* Grow(size_t nBytes)
+		{
+			size_t i = m_msg.body.size();
+			m_msg.body.resize(i + nBytes);
+			m_msg.header.size = (uint32_t)m_msg.body.size();
+			return m_msg.body.data() + i;
+		}
+
+
+		void WriteTag(size_t nSize)
+		{
+			if (m_mode == SerializeMode::Tagged)
+				WriteCount(nSize);
+		}
+
+
+		void WriteCount(size_t nCount)
+		{
+			uint32_t count = (uint32_t)nCount;
+			std::memcpy(Grow(sizeof(uint32_t)), &count, sizeof(uint32_t));
+		}
+
+
+	private:
+		Message& m_msg;
+		SerializeMode m_mode;
+	};
+
+
+	// Reads the fields written by MessageWriter, front to back. The message
+	// body isn't changed, so a message may be read several times.
+	//
+	// Strings and byte ranges can be read as views into the body instead of
+	// being copied, these stay valid as long as the message (or a copy of it)
+	// lives.
+	//
+	// Reading past the end of the body (or, in tagged mode, reading a field as
+	// the wrong type) doesn't throw, it yields zeroed data/empty views and
+	// marks the reader as failed, check IsValid() once done.
+	class MessageReader
+	{
+	public:
+		explicit MessageReader(const Message& msg, SerializeMode mode = SerializeMode::Compact)
+			: m_msg(msg), m_mode(mode)
+		{
+		}
+
+
+		MessageReader(const MessageReader&) = delete; // no copy constructor
+
+
+	public:
+		// Returns false if any read so far failed
+		bool IsValid() const
+		{
+			return !m_bFailed;
+		}
+
+
+		// Number of bytes not read yet
+		size_t GetRemaining() const
+		{
+			return m_msg.body.size() - m_nPos;
+		}
+
+
+		// Reads any trivially copyable data
+		template<typename DataType>
+		MessageReader& Read(DataType& data)
+		{
+			static_assert(std::is_trivially_copyable_v<DataType>, "Data is too complex to be read from the body");
+
+			const uint8_t* p = nullptr;
+			if (ReadTag(sizeof(DataType)))
+				p = Take(sizeof(DataType));
+
+			if (p)
+				std::memcpy(&data, p, sizeof(DataType));
+			else
+				data = DataType{};
+			return *this;
+		}
+
+
+		template<typename DataType>
+		DataType Read()
+		{
+			DataType data;
+			Read(data);
+			return data;
+		}
+
+
+		// Reads a range into a vector, the data is copied in one go
+		template<typename DataType, typename Alloc>
+		MessageReader& Read(std::vector<DataType, Alloc>& data)
+		{
+			static_assert(std::is_trivially_copyable_v<DataType>, "Data is too complex to be read from the body");
+
+			std::span<const uint8_t> bytes = ReadRange(sizeof(DataType));
+			data.resize(bytes.size() / sizeof(DataType));
+			if (!bytes.empty())
+				std::memcpy(data.data(), bytes.data(), bytes.size());
+			return *this;
+		}
+
+
+		template<typename DataType, size_t N>
+		MessageReader& Read(std::array<DataType, N>& data)
+		{
+			static_assert(std::is_trivially_copyable_v<DataType>, "Data is too complex to be read from the body");
+
+			const uint8_t* p = nullptr;
+			if (ReadTag(sizeof(DataType)))
+				p = Take(sizeof(DataType) * N);
+
+			if (p)
+				std::memcpy(data.data(), p, sizeof(DataType) * N);
+			else
+				data = {};
+			return *this;
+		}
+
+
+		MessageReader& Read(std::string& data)
+		{
+			data = ReadStringView();
+			return *this;
+		}
+
+
+		// Reads a string without copying it
+		std::string_view ReadStringView()
+		{
+			std::span<const uint8_t> bytes = ReadRange(sizeof(char));
+			return std::string_view(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+		}
+
+
+		// Reads a range without copying it. As the body has no particular alignment,
+		// this is only possible for data types which don't need one (bytes, chars,
+		// packed structs), use Read(std::vector<DataType>&) for everything else.
+		template<typename DataType>
+		std::span<const DataType> ReadSpan()
+		{
+			static_assert(std::is_trivially_copyable_v<DataType>, "Data is too complex to be read from the body");
+			static_assert(alignof(DataType) == 1, "Data can't be viewed in place, read it into a vector instead");
+
+			std::span<const uint8_t> bytes = ReadRange(sizeof(DataType));
+			return std::span<const DataType>(reinterpret_cast<const DataType*>(bytes.data()), bytes.size() / sizeof(DataType));
+		}
+
+
+		MessageReader& Read(std::string_view& data)
+		{
+			data = ReadStringView();
+			return *this;
+		}
+
+
+		template<typename DataType>
+		MessageReader& Read(std::span<const DataType>& data)
+		{
+			data = ReadSpan<DataType>();
+			return *this;
+		}
+
+
+		template<typename DataType>
+		MessageReader& operator >> (DataType& data)
+		{
+			return Read(data);
+		}
+
+
+	private:
+		// Returns where the next nBytes start, nullptr if there aren't enough left
+		const uint8_t* Take(size_t nBytes)
+		{
+			if (m_bFailed || nBytes > GetRemaining())
+			{
+				m_bFailed = true;
+				return nullptr;
+			}
+
+			const uint8_t* p = m_msg.body.data() + m_nPos;
+			m_nPos += nBytes;
+			return p;
+		}
+
+
+		bool ReadCount(uint32_t& nCount)
+		{
+			const uint8_t* p = Take(sizeof(uint32_t));
+			if (!p)
+				return false;
+			std::memcpy(&nCount, p, sizeof(uint32_t));
+			return true;
+		}
+
+
+		// Checks the size tag in front of a field (tagged mode only)
+		bool ReadTag(size_t nSize)
+		{
+			if (m_mode != SerializeMode::Tagged)
+				return !m_bFailed;
+
+			uint32_t nTag = 0;
+			if (!ReadCount(nTag))
+				return false;
+
+			// Stored data size != expected size
+			if (nTag != nSize)
+				m_bFailed = true;
+			return !m_bFailed;
+		}
+
+
+		// Reads a count and the elements which follow it, as bytes
+		std::span<const uint8_t> ReadRange(size_t nElementSize)
+		{
+			uint32_t nCount = 0;
+			if (!ReadTag(nElementSize) || !ReadCount(nCount))
+				return {};
+
+			// Compare by count, so a bogus count can't overflow the size
+			if (nCount > GetRemaining() / nElementSize)
+			{
+				m_bFailed = true;
+				return {};
+			}
+
+			const uint8_t* p = Take(nCount * nElementSize);
+			return std::span<const uint8_t>(p, nCount * nElementSize);
+		}
+
+
+	private:
+		const Message& m_msg;
+		SerializeMode m_mode;
+
+		// Read position within the body
+		size_t m_nPos = 0;
+		bool m_bFailed = false;
+	};
+
+
+} // namespace Net
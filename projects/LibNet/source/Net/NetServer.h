@@ -3,8 +3,18 @@
 #include "NetCommon.h"
 
 #include "NetConnection.h"
+#include "NetContextPool.h"
 #include "NetMessage.h"
+#include "NetMessageRegistry.h"
 #include "NetMsgQueue.h"
+#include "NetSerializer.h"
+#include "NetSlotMap.h"
+#include "NetUdpChannel.h"
+#include "NetWorkerPool.h"
+
+#include <filesystem>
+#include <random>
+#include <unordered_map>
 
 
 namespace NETLIB_NAMESPACE {
@@ -13,8 +23,21 @@ namespace NETLIB_NAMESPACE {
 	class Server
 	{
 	public:
-		Server()
-			: m_asioAcceptor(m_asioContext)
+		// Counters of the parallel dispatch (see SetParallelDispatch)
+		struct DispatchStats
+		{
+			// Messages handed to the workers, but not handled yet
+			size_t nQueuedMessages = 0;
+			uint64_t nHandledMessages = 0;
+			WorkerStats workers;
+		};
+
+
+	public:
+		// nThreads I/O threads will be used to run the connections, either all
+		// sharing one asio context or with one asio context per thread
+		Server(size_t nThreads = 1, ContextPool::Mode mode = ContextPool::Mode::SharedContext)
+			: m_ContextPool(nThreads, mode), m_asioAcceptor(m_ContextPool.GetPrimaryContext()), m_asioLocalAcceptor(m_ContextPool.GetPrimaryContext())
 		{
 		}
 
@@ -23,30 +46,223 @@ namespace NETLIB_NAMESPACE {
 		{
 			if (m_IsListening)
 				Stop();
+			// Unhandled messages keep their connections alive, which must
+			// go before the context(s) they belong to
+			m_MessagesIn.Clear();
+			m_MessagesPending.clear();
+		}
+
+
+		// Select the body checksum the server wants to receive (see Connection::SetIntegrity),
+		// applies to clients connecting afterwards
+		void SetIntegrity(Integrity preferred, bool bTrustLoopback = false)
+		{
+			m_IntegrityPreferred = preferred;
+			m_bTrustLoopback = bTrustLoopback;
+		}
+
+
+		// Select the compression of bodies with at least nThreshold bytes (see
+		// Connection::SetCompression), applies to clients connecting afterwards
+		void SetCompression(Compression mode, size_t nThreshold = NETLIB_COMPRESS_THRESHOLD)
+		{
+			m_CompressionPreferred = mode;
+			m_nCompressThreshold = nThreshold;
+		}
+
+
+		// Set the watermarks of the clients' outgoing queues, and what happens to
+		// messages sent above them (see SendLimits), applies to clients connecting afterwards
+		void SetSendLimits(const SendLimits& limits)
+		{
+			m_SendLimits = limits;
+		}
+
+
+		// Set the heartbeat and the timeouts of the clients (see Timeouts), applies to
+		// clients connecting afterwards. Clients which time out are disconnected, and
+		// reported by OnClientDisconnect.
+		void SetTimeouts(const Timeouts& timeouts)
+		{
+			m_Timeouts = timeouts;
+		}
+
+
+		// Open a UDP channel next to TCP, on the same address and port, must be called
+		// before Start. Every client gets an ID and a token for its datagrams, and
+		// once the client has registered its UDP endpoint, SendUdp and BroadcastUdp
+		// reach it. Incoming datagrams arrive like any other message, from their client.
+		void EnableUdp()
+		{
+			if (!m_pUdp)
+				m_pUdp = std::make_unique<UdpChannel>(m_ContextPool.GetPrimaryContext(),
+					[this](const asio::ip::udp::endpoint& from, const udp_datagram_header& header, Message& msg) { OnUdpDatagram(from, header, msg); });
+		}
+
+
+		// Conflate messages of type by their key (see ConflationTable), applies to
+		// clients connecting afterwards. Must not be called while broadcasting.
+		void SetConflation(uint32_t type, ConflationKey key = nullptr)
+		{
+			m_Conflation.Add(type, std::move(key));
+		}
+
+
+		// Set the factory which creates a sink for every incoming stream (see
+		// Connection::SetStreamSink), applies to clients connecting afterwards
+		void SetStreamSink(StreamSinkFactory factory)
+		{
+			m_StreamSinkFactory = std::move(factory);
+		}
+
+
+		// Handle incoming messages on nWorkers worker threads (0 turns it off), instead
+		// of the thread calling Update, which then only hands the messages over. Must be
+		// called before Start.
+		//
+		// Messages of one client are handled in order, one at a time, while different
+		// clients are handled in parallel. So OnMessage (or the dispatcher's handlers)
+		// must be thread safe across clients. OnClientWritable and OnClientDisconnect
+		// are called on the workers as well, in order with the client's messages, so
+		// OnClientDisconnect comes after the client's last OnMessage.
+		void SetParallelDispatch(size_t nWorkers)
+		{
+			InitWorkers(nWorkers, [this](Message& msg) { OnMessage(msg); });
+		}
+
+
+		// Same, but the workers use dispatcher (see MessageDispatcher) instead of OnMessage
+		template<typename Dispatcher>
+			requires requires(Dispatcher& dispatcher, Message& msg) { dispatcher.Dispatch(msg); }
+		void SetParallelDispatch(size_t nWorkers, Dispatcher& dispatcher)
+		{
+			InitWorkers(nWorkers, [&dispatcher](Message& msg) { dispatcher.Dispatch(msg); });
+		}
+
+
+		// Snapshot of the parallel dispatch counters, to size the worker pool
+		DispatchStats GetDispatchStats() const
+		{
+			DispatchStats stats;
+			stats.nQueuedMessages = m_nMessagesHandling.load(std::memory_order_relaxed);
+			stats.nHandledMessages = m_nMessagesHandled.load(std::memory_order_relaxed);
+			if (m_pWorkers)
+				stats.workers = m_pWorkers->GetStats();
+			return stats;
+		}
+
+
+		// Listen on a unix domain socket at path as well, for clients on the same
+		// host (see Client::ConnectLocal), must be called before Start. A file
+		// which is left at path (by a server which didn't stop) is replaced.
+		void SetLocalPath(const std::string& path)
+		{
+			m_LocalPath = path;
+		}
+
+
+		// Let clients which connect to the unix domain socket (see SetLocalPath)
+		// exchange messages through shared memory rings of nRingBytes each, if
+		// they ask for it (see Client::EnableSharedMemory, Linux only), must be
+		// called before Start
+		void EnableSharedMemory(size_t nRingBytes = NETLIB_SHM_RING_SIZE)
+		{
+			m_nShmRingBytes = nRingBytes;
+		}
+
+
+#if NETLIB_TLS
+		// Encrypt the connections to the TCP port with TLS (see TlsOptions), must be
+		// called before Start. Returns false if the certificate or key can't be loaded.
+		bool EnableTls(const TlsOptions& options)
+		{
+			try
+			{
+				m_pTlsContext = std::make_shared<TlsContext>(true, options);
+			}
+			catch (std::exception& e)
+			{
+				std::cerr << "[SERVER] TLS Exception: " << e.what() << std::endl;
+				return false;
+			}
+			return true;
 		}
 
 
+		// The TLS setup, for settings which TlsOptions doesn't cover (nullptr without TLS)
+		TlsContext* GetTlsContext() { return m_pTlsContext.get(); }
+#endif
+
+
 		// Starts the server, listening on the specified port and optional address
 		bool Start(uint16_t port, const std::string& ip = {})
+		{
+			return Listen(true, port, ip);
+		}
+
+
+		// Starts the server, listening on a unix domain socket at path only
+		bool StartLocal(const std::string& path)
+		{
+			m_LocalPath = path;
+			return Listen(false, 0, {});
+		}
+
+
+	private:
+		bool Listen(bool bTcp, uint16_t port, const std::string& ip)
 		{
 			std::string addr;
 			try
 			{
-				// Setup asio acceptor
-				asio::ip::tcp::endpoint ep(ip.empty() ? asio::ip::address_v6::any() : asio::ip::address::from_string(ip), port);
-				addr = ep.address().to_string();
-				m_asioAcceptor.open(ep.protocol());
-				m_asioAcceptor.bind(ep);
-				m_asioAcceptor.listen();
-
-				// Issue a task to the asio context - This is important as it will
-				// prime the context with "work", and stop it from exiting immediately.
-				// Since this is a server, we want it primed ready to handle clients
-				// trying to connect.
-				ASYNC_WaitForConnection();
-
-				// Launch the asio context in its own thread
-				m_threadContext = std::thread([this]() { m_asioContext.run(); });
+				if (bTcp)
+				{
+					// Setup asio acceptor
+					asio::ip::tcp::endpoint ep(ip.empty() ? asio::ip::address_v6::any() : asio::ip::address::from_string(ip), port);
+					addr = ep.address().to_string() + " : " + std::to_string(port);
+					m_asioAcceptor.open(ep.protocol());
+					// A restarted server can bind again, while connections of the
+					// last run are still in TIME_WAIT (so clients can reconnect)
+					m_asioAcceptor.set_option(asio::socket_base::reuse_address(true));
+					m_asioAcceptor.bind(ep);
+					m_asioAcceptor.listen();
+
+					// UDP ports are separate from TCP ones, so the same port is used
+					if (m_pUdp)
+						m_pUdp->Bind(asio::ip::udp::endpoint(ep.address(), ep.port()));
+
+					// Issue a task to the asio context - This is important as it will
+					// prime the context with "work", and stop it from exiting immediately.
+					// Since this is a server, we want it primed ready to handle clients
+					// trying to connect.
+					ASYNC_WaitForConnection();
+				}
+
+				if (!m_LocalPath.empty())
+				{
+					// The socket file isn't removed by closing, so a file of the
+					// last run would make bind fail
+					std::error_code ec;
+					std::filesystem::remove(m_LocalPath, ec);
+					asio::local::stream_protocol::endpoint ep(m_LocalPath);
+					m_asioLocalAcceptor.open(ep.protocol());
+					m_asioLocalAcceptor.bind(ep);
+					m_asioLocalAcceptor.listen();
+					addr += (addr.empty() ? "" : ", ") + m_LocalPath;
+
+					ASYNC_WaitForLocalConnection();
+				}
+
+				// Launch the asio context(s) in the I/O threads...
+				m_ContextPool.Start();
+#if NETLIB_TLS
+				// ...the threads for the TLS handshakes...
+				if (m_pTlsContext)
+					m_pTlsContext->StartHandshakes();
+#endif
+				// ...and the workers, if the messages are handled in parallel
+				if (m_pWorkers)
+					m_pWorkers->Start();
 			}
 			catch (std::exception& e)
 			{
@@ -56,96 +272,201 @@ namespace NETLIB_NAMESPACE {
 			}
 			m_IsListening = true;
 			// Log
-			std::cout << "[SERVER] Started, listening on: " << addr << " : " << port << std::endl;
+			std::cout << "[SERVER] Started, listening on: " << addr << " (" << m_ContextPool.GetThreadCount() << " I/O threads, " << ContextPool::GetBackendName() << ")" << std::endl;
 			return true;
 		}
 
 
+	public:
+
 		void Stop()
 		{
-			// Request the context to close...
-			m_asioContext.stop();
-			// ...adnd wait for its thread to exit
-			if (m_threadContext.joinable())
-				m_threadContext.join();
+			// Request the context(s) to close and wait for the I/O threads to exit
+			m_ContextPool.Stop();
+#if NETLIB_TLS
+			if (m_pTlsContext)
+				m_pTlsContext->StopHandshakes();
+#endif
+			// No more messages arrive, so let the workers finish what was handed over
+			if (m_pWorkers)
+				m_pWorkers->Stop();
+			// Release the port, so the server may be started again
+			m_asioAcceptor.close();
+			if (m_asioLocalAcceptor.is_open())
+			{
+				m_asioLocalAcceptor.close();
+				std::error_code ec;
+				std::filesystem::remove(m_LocalPath, ec);
+			}
+			if (m_pUdp)
+			{
+				m_pUdp->Close();
+				std::scoped_lock scoped_lock(m_mutexUdpPeers);
+				m_UdpPeers.clear();
+			}
+			m_IsListening = false;
 
 			// Log
 			std::cout << "[SERVER] Stopped!" << std::endl;
 		}
 
 
-		// Send a message to a single client
-		void Send(std::shared_ptr<Connection> client, Message& msg)
+		// Send a message to a single client, the caller keeps its message...
+		// Returns false if it wasn't queued (client gone, or see SetSendLimits)
+		bool Send(std::shared_ptr<Connection> client, const Message& msg)
 		{
-			// Check client is legitimate...
-			if (client && client->IsConnected())
-			{
-				// ...and post the message via the connection
-				client->Send(msg);
-			}
-			else
-			{
-				// If we cant communicate with client then we may as 
-				// well remove the client - let the server know, it may
-				// be tracking it somehow
-				OnClientDisconnect(client);
+			// Check client is legitimate and post the message via the connection
+			if (CheckClient(client))
+				return client->Send(msg);
+			return false;
+		}
 
-				// Off you go now, bye bye!
-				client.reset();
 
-				// Then physically remove it from the container
-				m_Connections.erase(
-					std::remove(m_Connections.begin(), m_Connections.end(), client),
-					m_Connections.end());
-			}
+		// ...or hands it over without any copy
+		bool Send(std::shared_ptr<Connection> client, Message&& msg)
+		{
+			if (CheckClient(client))
+				return client->Send(std::move(msg));
+			return false;
 		}
 
 
-		// Send message to all clients
-		void Broadcast(Message& msg, std::shared_ptr<Connection> clientIgnore = nullptr)
+		// Send message to all clients, returns the number of clients it was queued for
+		size_t Broadcast(const Message& msg, std::shared_ptr<Connection> clientIgnore = nullptr)
 		{
-			bool bInvalidClientExists = false;
+			size_t nQueued = 0;
+
+			// Compress and checksum the message once for all clients (once per
+			// compression and checksum algorithm in use, to be exact). Every
+			// connection queues a copy of it, which shares the body instead of
+			// copying it.
+			std::optional<Message> msgOut[2][2];
 
-			// Iterate through all clients in container
+			// The key is read from the plain body, before it's compressed
+			std::optional<uint64_t> key = m_Conflation.GetKey(msg);
+
+			std::scoped_lock scoped_lock(m_mutexConnections);
+
+			// Iterate through all clients in container, the disconnected ones are
+			// skipped (their Disconnected event removes them)
 			for (auto& client : m_Connections)
 			{
-				// Check client is connected...
-				if (client && client->IsConnected())
+				if (client->IsConnected() && client != clientIgnore)
 				{
-					// ..it is!
-					if (client != clientIgnore)
-						client->Send(msg);
+					Compression compression = client->GetCompression();
+					Integrity mode = client->GetIntegrity();
+					auto& prepared = msgOut[(size_t)compression][(size_t)mode];
+					if (!prepared)
+					{
+						// The other checksum's variant already has the compressed body
+						auto& other = msgOut[(size_t)compression][1 - (size_t)mode];
+						if (other)
+						{
+							prepared.emplace(*other);
+						}
+						else
+						{
+							prepared.emplace(msg);
+							prepared->Compress(compression, m_nCompressThreshold);
+						}
+						prepared->UpdateCRC(mode);
+					}
+					if (client->SendPrepared(*prepared, key))
+						nQueued++;
 				}
-				else
-				{
-					// The client couldnt be contacted, so assume it has
-					// disconnected.
-					OnClientDisconnect(client);
-					client.reset();
+			}
+			return nQueued;
+		}
 
-					// Set this flag to then remove dead clients from container
-					bInvalidClientExists = true;
-				}
+
+		// Send a message to a single client over UDP (see EnableUdp), it may get lost.
+		// Returns false if the client hasn't registered for UDP (yet), or the message
+		// doesn't fit into a datagram (see UdpChannel::GetMaxBodySize).
+		bool SendUdp(std::shared_ptr<Connection> client, const Message& msg)
+		{
+			if (!m_pUdp || !client)
+				return false;
+
+			asio::ip::udp::endpoint to;
+			udp_datagram_header header;
+			{
+				std::scoped_lock scoped_lock(m_mutexUdpPeers);
+				auto it = m_UdpPeers.find(client->GetID());
+				if (it == m_UdpPeers.end() || !it->second.bRegistered)
+					return false;
+				to = it->second.endpoint;
+				header = { client->GetID(), it->second.token };
 			}
 
-			// Remove dead clients, all in one go - this way, we dont invalidate the
-			// container as we iterated through it.
-			if (bInvalidClientExists)
-				m_Connections.erase(
-					std::remove(m_Connections.begin(), m_Connections.end(), nullptr),
-					m_Connections.end());
+			Message msgOut(msg);
+			msgOut.UpdateCRC(Integrity::CRC32C);
+			return m_pUdp->Send(to, header, msgOut);
+		}
+
+
+		// Send message to all clients which registered for UDP, with as few syscalls
+		// as possible. Returns the number of clients it was queued for.
+		size_t BroadcastUdp(const Message& msg, std::shared_ptr<Connection> clientIgnore = nullptr)
+		{
+			if (!m_pUdp)
+				return 0;
+
+			// Checksummed once, every datagram shares the body
+			Message msgOut(msg);
+			msgOut.UpdateCRC(Integrity::CRC32C);
+			uint64_t idIgnore = clientIgnore ? clientIgnore->GetID() : 0;
+
+			return m_pUdp->SendMany(msgOut,
+				[this, idIgnore](auto&& queue)
+				{
+					std::scoped_lock scoped_lock(m_mutexUdpPeers);
+					for (auto& [id, peer] : m_UdpPeers)
+					{
+						if (peer.bRegistered && id != idIgnore)
+							queue(peer.endpoint, udp_datagram_header{ id, peer.token });
+					}
+				});
+		}
+
+
+		// Datagrams sent, received and dropped, and the syscalls used for sending
+		// (see UdpChannel)
+		const UdpChannel* GetUdpChannel() const { return m_pUdp.get(); }
+
+
+		// Memory taken by the outgoing queues of all clients (headers and bodies)
+		size_t GetQueuedBytes() const
+		{
+			return m_pQueuedBytes->load(std::memory_order_relaxed);
+		}
+
+
+		// Returns the client with this ID, nullptr if it's gone
+		std::shared_ptr<Connection> GetClient(uint64_t id)
+		{
+			std::scoped_lock scoped_lock(m_mutexConnections);
+			std::shared_ptr<Connection>* pClient = m_Connections.Get(id);
+			return pClient ? *pClient : nullptr;
+		}
+
+
+		size_t GetClientCount()
+		{
+			std::scoped_lock scoped_lock(m_mutexConnections);
+			return m_Connections.GetCount();
 		}
 
 
 		void DisconnectClient(std::shared_ptr<Connection> client)
 		{
-			// Inform app and reset pointer
-			OnClientDisconnect(client);
-			client.reset();
-			// Remove the client
-			m_Connections.erase(
-				std::remove(m_Connections.begin(), m_Connections.end(), nullptr),
-				m_Connections.end());
+			// Close the socket...
+			if (client)
+				client->Disconnect();
+			// ...then inform app and remove the client. With the workers it's left
+			// to the client's Disconnected event, so OnClientDisconnect still comes
+			// after the client's last OnMessage, on its worker.
+			if (!m_pWorkers)
+				RemoveClient(client);
 		}
 
 
@@ -159,49 +480,36 @@ namespace NETLIB_NAMESPACE {
 		// Process incoming messages
 		void Update(size_t nMaxMessages = -1, bool wait = false)
 		{
-			if (wait) m_MessagesIn.Wait();
-
-			// Process as many messages as we can up to the value specified
-			size_t nMessageCount = 0;
-			while (nMessageCount < nMaxMessages && !m_MessagesIn.IsEmpty())
-			{
-				// Grab the front message
-				auto msg = m_MessagesIn.PopFront();
+			ProcessMessages([this](Message& msg) { OnMessage(msg); }, nMaxMessages, wait);
+		}
 
-				// Pass to message handler
-				OnMessage(msg);
 
-				nMessageCount++;
-			}
-
-			// Search for dead clients...
-			UpdateDeadClients();
+		// Process incoming messages with a MessageDispatcher instead of OnMessage
+		// (in parallel dispatch mode, the dispatcher given there is used instead)
+		template<typename Dispatcher>
+			requires requires(Dispatcher& dispatcher, Message& msg) { dispatcher.Dispatch(msg); }
+		void Update(Dispatcher& dispatcher, size_t nMaxMessages = -1, bool wait = false)
+		{
+			ProcessMessages([&dispatcher](Message& msg) { dispatcher.Dispatch(msg); }, nMaxMessages, wait);
 		}
 
 
-		// Search for and remove dead clients
+		// Search for and remove dead clients. Update doesn't need this, as closed
+		// connections report themselves, it's kept for apps which want to sweep.
 		void UpdateDeadClients()
 		{
-			// Search for dead clients...
-			bool bInvalidClientExists = false;
-			for (auto& client : m_Connections)
+			std::vector<std::shared_ptr<Connection>> deadClients;
 			{
-				// Check client is disconnected
-				if (!client || !client->IsConnected())
+				std::scoped_lock scoped_lock(m_mutexConnections);
+				for (auto& client : m_Connections)
 				{
-					// Inform app and reset pointer
-					OnClientDisconnect(client);
-					client.reset();
-					// Set this flag to then remove dead clients from container
-					bInvalidClientExists = true;
+					if (!client->IsConnected())
+						deadClients.push_back(client);
 				}
 			}
-			// Remove dead clients, all in one go
-			// This way, we dont invalidate the container as we iterated through it.
-			if (bInvalidClientExists)
-				m_Connections.erase(
-					std::remove(m_Connections.begin(), m_Connections.end(), nullptr),
-					m_Connections.end());
+
+			for (auto& client : deadClients)
+				RemoveClient(client);
 		}
 
 
@@ -212,21 +520,184 @@ namespace NETLIB_NAMESPACE {
 		// Called when a client connects, you can veto the connection by returning false
 		virtual bool OnClientConnect(std::shared_ptr<Connection> client) { return true; }
 
-		// Called when a client appears to have disconnected
+		// Called when a client appears to have disconnected, on the thread calling
+		// Update (or DisconnectClient), or on its worker with SetParallelDispatch
 		virtual void OnClientDisconnect(std::shared_ptr<Connection> client) {}
 
+		// Called when the outgoing queue of a client, which had been above a high
+		// watermark, has drained below the low watermarks (see SetSendLimits)
+		virtual void OnClientWritable(std::shared_ptr<Connection> client) {}
+
 		// Called when a message arrives
 		virtual void OnMessage(Message& msg) { }
 
 	private:
+		// Takes the incoming messages and passes them to handler
+		template<typename MessageHandler>
+		void ProcessMessages(MessageHandler&& handler, size_t nMaxMessages, bool wait)
+		{
+			if (wait && m_MessagesPending.empty()) m_MessagesIn.Wait();
+
+			// Take all messages which arrived so far in one go, what isn't
+			// processed this time stays pending for the next Update
+			m_MessagesIn.Drain(m_MessagesPending);
+
+			// Process as many messages as we can up to the value specified
+			size_t nMessageCount = 0;
+			while (nMessageCount < nMaxMessages && !m_MessagesPending.empty())
+			{
+				// Grab the front message
+				auto msg = std::move(m_MessagesPending.front());
+				m_MessagesPending.pop_front();
+
+				// The workers get the events of a client behind its messages, so
+				// they're handled in the order they arrived
+				if (m_pWorkers)
+				{
+					bool bEvent = IsClientEvent(msg);
+					HandOverToWorkers(std::move(msg));
+					if (!bEvent)
+						nMessageCount++;
+					continue;
+				}
+
+				// A connection closed, so the client is removed and the app informed
+				if (HandleClientEvent(msg))
+					continue;
+
+				// Pass to message handler
+				handler(msg);
+
+				nMessageCount++;
+			}
+		}
+
+
+		// Disconnected or Writable, which are queued by the connection itself
+		static bool IsClientEvent(const Message& msg)
+		{
+			return msg.header.type == (uint32_t)ControlMsg::Disconnected
+				|| msg.header.type == (uint32_t)ControlMsg::Writable;
+		}
+
+
+		// Informs the app about a client event, returns false if msg isn't one
+		bool HandleClientEvent(Message& msg)
+		{
+			if (msg.header.type == (uint32_t)ControlMsg::Disconnected)
+			{
+				RemoveClient(msg.remote);
+				return true;
+			}
+			if (msg.header.type == (uint32_t)ControlMsg::Writable)
+			{
+				OnClientWritable(msg.remote);
+				return true;
+			}
+			return false;
+		}
+
+
+		void InitWorkers(size_t nWorkers, std::function<void(Message&)> handler)
+		{
+			m_pWorkers.reset();
+			m_WorkerHandler = std::move(handler);
+			if (nWorkers > 0)
+				m_pWorkers = std::make_unique<WorkerPool<std::shared_ptr<Connection>>>(nWorkers,
+					[this](std::shared_ptr<Connection>& client) { HandleClientMessages(client); });
+		}
+
+
+		// Queue a message at its client, the client is scheduled on the workers
+		// unless it's already waiting for (or being handled by) one
+		void HandOverToWorkers(Message&& msg)
+		{
+			std::shared_ptr<Connection> client = msg.remote;
+			m_nMessagesHandling.fetch_add(1, std::memory_order_relaxed);
+			client->m_MessagesHandling.PushBack(std::move(msg));
+			if (!client->m_bHandlingScheduled.exchange(true, std::memory_order_acq_rel))
+				m_pWorkers->Submit(std::move(client));
+		}
+
+
+		// Worker - handle the waiting messages of a single client
+		void HandleClientMessages(std::shared_ptr<Connection>& client)
+		{
+			thread_local std::pmr::deque<Message> vMessages{ &BufferPool::GetDefault() };
+			client->m_MessagesHandling.Drain(vMessages);
+			while (!vMessages.empty())
+			{
+				auto msg = std::move(vMessages.front());
+				vMessages.pop_front();
+
+				if (!HandleClientEvent(msg))
+					m_WorkerHandler(msg);
+
+				m_nMessagesHandling.fetch_sub(1, std::memory_order_relaxed);
+				m_nMessagesHandled.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			// Give the other clients a turn, this one is scheduled again if more
+			// messages arrived meanwhile (the exchange makes them visible to us)
+			client->m_bHandlingScheduled.exchange(false, std::memory_order_acq_rel);
+			if (!client->m_MessagesHandling.IsEmpty() && !client->m_bHandlingScheduled.exchange(true, std::memory_order_acq_rel))
+				m_pWorkers->Submit(client);
+		}
+
+
+		// Returns true if client is legitimate
+		bool CheckClient(const std::shared_ptr<Connection>& client)
+		{
+			if (client && client->IsConnected())
+				return true;
+
+			// If we cant communicate with client then we may as 
+			// well remove the client - let the server know, it may
+			// be tracking it somehow. With the workers it's left to
+			// the client's Disconnected event, so OnClientDisconnect
+			// isn't called on whichever thread is sending (a closed
+			// connection always queues that event).
+			if (!m_pWorkers)
+				RemoveClient(client);
+			return false;
+		}
+
+
+		// Remove a single client from the container and inform app, if it was still in there
+		void RemoveClient(const std::shared_ptr<Connection>& client)
+		{
+			if (!client)
+				return;
+
+			bool bRemoved = false;
+			{
+				std::scoped_lock scoped_lock(m_mutexConnections);
+				bRemoved = m_Connections.Remove(client->GetID());
+			}
+
+			if (bRemoved && m_pUdp)
+			{
+				std::scoped_lock scoped_lock(m_mutexUdpPeers);
+				m_UdpPeers.erase(client->GetID());
+			}
+
+			// Only the one who removed the client informs the app
+			if (bRemoved)
+				OnClientDisconnect(client);
+		}
+
+
 		// ASYNC - Instruct asio to wait for incomming connection
 		void ASYNC_WaitForConnection()
 		{
+			// Pick the context (and so the I/O thread) which will handle the next client
+			asio::io_context& asioContext = m_ContextPool.GetNextContext();
+
 			// Prime context with an instruction to wait until a socket connects. This
 			// is the purpose of an "acceptor" object. It will provide a unique socket
 			// for each incoming connection attempt
-			m_asioAcceptor.async_accept(
-				[this](std::error_code ec, asio::ip::tcp::socket socket)
+			m_asioAcceptor.async_accept(asioContext,
+				[this, &asioContext](std::error_code ec, asio::ip::tcp::socket socket)
 				{
 					// Triggered by incoming connection request
 					if (!ec)
@@ -235,29 +706,7 @@ namespace NETLIB_NAMESPACE {
 						std::cout << "[SERVER] New Connection: " << socket.remote_endpoint() << std::endl;
 						uint16_t port = socket.remote_endpoint().port();
 
-						// Create a new connection to handle this client 
-						std::shared_ptr<Connection> newconn =
-							std::make_shared<Connection>(true, m_asioContext, std::move(socket), m_MessagesIn, port);
-
-						// Give the user server a chance to deny connection
-						if (OnClientConnect(newconn))
-						{
-							// Connection allowed, so add to container of new connections
-							m_Connections.push_back(std::move(newconn));
-
-							// And very important! Issue a task to the connection's
-							// asio context to sit and wait for bytes to arrive!
-							m_Connections.back()->ConnectToClient(port);
-
-							std::cout << "[" << port << "] Connection Approved" << std::endl;
-						}
-						else
-						{
-							std::cout << "[" << port << "] Connection Denied" << std::endl;
-
-							// Connection will go out of scope with no pending tasks, so will
-							// get destroyed automagically due to the wonder of smart pointers
-						}
+						OnAccept(asioContext, std::move(socket), port);
 					}
 					else
 					{
@@ -272,23 +721,210 @@ namespace NETLIB_NAMESPACE {
 		}
 
 
+		// ASYNC - Same for the unix domain socket (see SetLocalPath)
+		void ASYNC_WaitForLocalConnection()
+		{
+			asio::io_context& asioContext = m_ContextPool.GetNextContext();
+
+			m_asioLocalAcceptor.async_accept(asioContext,
+				[this, &asioContext](std::error_code ec, asio::local::stream_protocol::socket socket)
+				{
+					if (!ec)
+					{
+						std::cout << "[SERVER] New Connection: " << m_LocalPath << std::endl;
+						OnAccept(asioContext, std::move(socket), 0);
+					}
+					else
+					{
+						std::cout << "[SERVER] New Connection Error: " << ec.message() << std::endl;
+					}
+
+					ASYNC_WaitForLocalConnection();
+				});
+		}
+
+
+		// A socket has connected, whichever the protocol is
+		void OnAccept(asio::io_context& asioContext, StreamProtocol::socket socket, uint16_t port)
+		{
+			// Create a new connection to handle this client 
+			std::shared_ptr<Connection> newconn =
+				std::make_shared<Connection>(true, asioContext, std::move(socket), m_MessagesIn, port, m_ContextPool.GetReceivePool(asioContext));
+			newconn->SetIntegrity(m_IntegrityPreferred, m_bTrustLoopback);
+			newconn->SetCompression(m_CompressionPreferred, m_nCompressThreshold);
+			newconn->SetStreamSink(m_StreamSinkFactory);
+			newconn->SetSendLimits(m_SendLimits);
+			newconn->SetConflation(m_Conflation);
+			newconn->SetTimeouts(m_Timeouts, m_ContextPool.GetTimerWheel(asioContext));
+			newconn->SetSharedMemory(m_nShmRingBytes);
+#if NETLIB_TLS
+			newconn->SetTls(m_pTlsContext);
+#endif
+			newconn->m_pServerQueuedBytes = m_pQueuedBytes;
+
+			// Add to container of connections, which hands out its ID
+			{
+				std::scoped_lock scoped_lock(m_mutexConnections);
+				newconn->m_nID = m_Connections.Insert(newconn);
+			}
+
+			// Give the user server a chance to deny connection
+			if (OnClientConnect(newconn))
+			{
+				// And very important! Issue a task to the connection's
+				// asio context to sit and wait for bytes to arrive!
+				newconn->ConnectToClient(port);
+
+				// Hand out the ID and token for its datagrams
+				if (m_pUdp && !newconn->IsLocal())
+				{
+					Message msg;
+					msg.header.type = (uint32_t)ControlMsg::UdpToken;
+					{
+						std::scoped_lock scoped_lock(m_mutexUdpPeers);
+						uint64_t token = NewUdpToken();
+						m_UdpPeers[newconn->GetID()] = { token };
+						msg << newconn->GetID() << token;
+					}
+					newconn->Send(std::move(msg));
+				}
+
+				std::cout << "[" << newconn->GetID() << "] Connection Approved" << std::endl;
+			}
+			else
+			{
+				std::cout << "[" << newconn->GetID() << "] Connection Denied" << std::endl;
+
+				// Quietly remove it again, the app doesn't know the client
+				std::scoped_lock scoped_lock(m_mutexConnections);
+				m_Connections.Remove(newconn->GetID());
+
+				// Connection will go out of scope with no pending tasks, so will
+				// get destroyed automagically due to the wonder of smart pointers
+			}
+		}
+
+
+		// A token which can't be guessed, from the OS's random generator (a seeded
+		// engine would be predictable from the tokens it has handed out), never 0.
+		// Called with m_mutexUdpPeers held.
+		uint64_t NewUdpToken()
+		{
+			uint64_t token = ((uint64_t)m_UdpTokens() << 32) | (uint32_t)m_UdpTokens();
+			return token | 1;
+		}
+
+
+		// A datagram arrived (on the UDP channel's strand), it's only accepted with
+		// the token of its client. The client's UDP endpoint is only (re)registered
+		// by a UdpHello, other datagrams have to come from the registered endpoint.
+		// Every datagram carries the token in the clear, so a token which has been
+		// seen must not be enough to redirect the client's datagrams.
+		void OnUdpDatagram(const asio::ip::udp::endpoint& from, const udp_datagram_header& header, Message& msg)
+		{
+			bool bHello = (msg.header.type == (uint32_t)ControlMsg::UdpHello);
+			{
+				std::scoped_lock scoped_lock(m_mutexUdpPeers);
+				auto it = m_UdpPeers.find(header.id);
+				if (it == m_UdpPeers.end() || it->second.token != header.token)
+					return;
+				if (bHello)
+				{
+					it->second.endpoint = from;
+					it->second.bRegistered = true;
+				}
+				else if (!it->second.bRegistered || it->second.endpoint != from)
+					return;
+			}
+
+			// Let the client know it's registered
+			if (bHello)
+			{
+				Message reply;
+				reply.header.type = (uint32_t)ControlMsg::UdpHello;
+				reply.UpdateCRC(Integrity::CRC32C);
+				m_pUdp->Send(from, header, reply);
+				return;
+			}
+			if (IsControlMessage(msg.header.type))
+				return;
+
+			msg.remote = GetClient(header.id);
+			if (msg.remote)
+				m_MessagesIn.PushBack(std::move(msg));
+		}
+
+
 	private:
-		// Thread safe queue for incoming message packets
-		MsgQueue m_MessagesIn;
+		// Thread safe queue for incoming message packets...
+		MsgQueueIn m_MessagesIn;
+		// ...and the ones taken from it, but not processed yet
+		std::pmr::deque<Message> m_MessagesPending{ &BufferPool::GetDefault() };
 
 		// Status of asio acceptor
 		bool m_IsListening = false;
 
-		// Container of active connections
-		std::deque<std::shared_ptr<Connection>> m_Connections;
+		// Body checksum wanted for receiving (see SetIntegrity)
+		Integrity m_IntegrityPreferred = Integrity::CRC32C;
+		bool m_bTrustLoopback = false;
+
+		// Compression wanted for sending (see SetCompression)
+		Compression m_CompressionPreferred = Compression::None;
+		size_t m_nCompressThreshold = NETLIB_COMPRESS_THRESHOLD;
+
+		// Creates the sinks of incoming streams (see SetStreamSink)
+		StreamSinkFactory m_StreamSinkFactory;
+
+		// Message types which are conflated (see SetConflation)
+		ConflationTable m_Conflation;
 
-		// asio context handles the data transfer...
-		asio::io_context m_asioContext;
-		// ...but needs a thread of its own to execute its work commands
-		std::thread m_threadContext;
+		// Liveness checks of the clients (see SetTimeouts)
+		Timeouts m_Timeouts;
 
-		// Handles new incoming connection attempts
+		// Limits of the outgoing queues (see SetSendLimits), and their total size,
+		// which is shared with the connections (they may outlive the server)
+		SendLimits m_SendLimits;
+		std::shared_ptr<std::atomic<size_t>> m_pQueuedBytes = std::make_shared<std::atomic<size_t>>(0);
+
+		// asio context(s) handle the data transfer, run by a pool of I/O threads
+		ContextPool m_ContextPool;
+
+		// Container of active connections by ID, shared by the
+		// accept handler (I/O thread) and Update (app thread)
+		SlotMap<std::shared_ptr<Connection>> m_Connections;
+		std::mutex m_mutexConnections;
+
+		// Handles new incoming connection attempts, over TCP and the unix domain
+		// socket (see SetLocalPath)
 		asio::ip::tcp::acceptor m_asioAcceptor;
+		asio::local::stream_protocol::acceptor m_asioLocalAcceptor;
+		std::string m_LocalPath;
+		// Size of the shared memory rings of local clients, 0 if they aren't offered
+		size_t m_nShmRingBytes = 0;
+
+#if NETLIB_TLS
+		// TLS setup of the TCP connections (see EnableTls)
+		std::shared_ptr<TlsContext> m_pTlsContext;
+#endif
+
+		// UDP channel (see EnableUdp), and the token and UDP endpoint of each client by ID
+		struct UdpPeer
+		{
+			uint64_t token = 0;
+			asio::ip::udp::endpoint endpoint;
+			bool bRegistered = false;
+		};
+		std::unique_ptr<UdpChannel> m_pUdp;
+		std::unordered_map<uint64_t, UdpPeer> m_UdpPeers;
+		// Source of the tokens (the OS's random generator)
+		std::random_device m_UdpTokens;
+		std::mutex m_mutexUdpPeers;
+
+		// Parallel dispatch - the workers and what they call for each message
+		std::function<void(Message&)> m_WorkerHandler;
+		std::unique_ptr<WorkerPool<std::shared_ptr<Connection>>> m_pWorkers;
+		std::atomic<size_t> m_nMessagesHandling = 0;
+		std::atomic<uint64_t> m_nMessagesHandled = 0;
 	};
 
 
@@ -0,0 +1,478 @@
+#pragma once
+
+#include "NetCommon.h"
+
+#include <array>
+
+#if defined(__linux__)
+#	include <sys/eventfd.h>
+#	include <sys/mman.h>
+#	include <sys/socket.h>
+#	include <sys/stat.h>
+#	include <unistd.h>
+#	include <cerrno>
+#	define NETLIB_HAS_SHM 1
+#else
+#	define NETLIB_HAS_SHM 0
+#endif
+
+
+namespace NETLIB_NAMESPACE {
+
+
+	// Outcome of a step of the shared memory handshake
+	enum class ShmHandshake
+	{
+		Pending,	// Wait until the socket is readable, and try again
+		Yes,
+		No,
+		Failed		// The socket is broken (or closed)
+	};
+
+
+	// Exchanged over the unix domain socket before the session starts: The client
+	// asks for the rings, the server answers with their size, and passes the
+	// memory and the wakeup eventfds along (SCM_RIGHTS), or refuses.
+	struct shm_handshake
+	{
+		char magic[8] = {};
+		uint64_t nRingBytes = 0;
+	};
+
+
+	// Head of a ring in the shared memory, each side's index on its own cache line
+	struct shm_ring_header
+	{
+		alignas(64) std::atomic<uint64_t> nWrite;
+		alignas(64) std::atomic<uint64_t> nRead;
+		// The reader (writer) is waiting for its wakeup, as the ring is empty (full)
+		alignas(64) std::atomic<uint32_t> bReaderWaiting;
+		std::atomic<uint32_t> bWriterWaiting;
+	};
+
+
+	// Transport of a connection between a client and a server on the same host:
+	// Two single producer / single consumer rings in shared memory, one for each
+	// direction, carry the same byte stream as the socket would. So the frames
+	// are copied into the ring by the writer and out of it by the reader, without
+	// any syscall. Only a side which has found its ring empty (or full) sleeps on
+	// its eventfd, and is woken up by the other side.
+	//
+	// The unix domain socket the connection started on stays open, it tells
+	// when the peer has gone. Linux only (memfd and eventfd), elsewhere the
+	// handshake always says no.
+	class ShmTransport
+	{
+	public:
+		ShmTransport(const ShmTransport&) = delete; // no copy constructor
+
+		~ShmTransport()
+		{
+#if NETLIB_HAS_SHM
+			Close();
+			if (m_pMemory)
+				::munmap(m_pMemory, m_nMemoryBytes);
+			if (m_fdPeerWakeup >= 0)
+				::close(m_fdPeerWakeup);
+#endif
+		}
+
+
+	public:
+		static constexpr bool IsSupported() { return NETLIB_HAS_SHM; }
+
+
+		// Client - Ask the server for the rings
+		static bool SendRequest(int fdSocket, size_t nRingBytes)
+		{
+#if NETLIB_HAS_SHM
+			shm_handshake request;
+			std::memcpy(request.magic, c_szRequest, sizeof(request.magic));
+			request.nRingBytes = nRingBytes;
+			return ::send(fdSocket, &request, sizeof(request), MSG_NOSIGNAL) == (ssize_t)sizeof(request);
+#else
+			return false;
+#endif
+		}
+
+
+		// Server - Check whether the client starts with a request (Yes, which is
+		// taken from the socket) or with its session (No, nothing is taken)
+		static ShmHandshake ReceiveRequest(int fdSocket)
+		{
+#if NETLIB_HAS_SHM
+			shm_handshake request;
+			ssize_t n = ::recv(fdSocket, &request, sizeof(request), MSG_PEEK);
+			if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+				return ShmHandshake::Failed;
+			if (n < 0)
+				return ShmHandshake::Pending;
+			if (std::memcmp(request.magic, c_szRequest, std::min<size_t>(n, sizeof(request.magic))) != 0)
+				return ShmHandshake::No;
+			if (n < (ssize_t)sizeof(request))
+				return ShmHandshake::Pending;
+			::recv(fdSocket, &request, sizeof(request), 0);
+			return ShmHandshake::Yes;
+#else
+			return ShmHandshake::No;
+#endif
+		}
+
+
+		// Server - Create the rings (if nRingBytes isn't 0) and pass them to the
+		// client, or tell it to go on with the socket
+		static ShmHandshake SendAnswer(asio::io_context& asioContext, int fdSocket, size_t nRingBytes, std::unique_ptr<ShmTransport>& pShm)
+		{
+#if NETLIB_HAS_SHM
+			shm_handshake answer;
+			std::memcpy(answer.magic, c_szRefuse, sizeof(answer.magic));
+
+			// Rings which can't be created are refused, the socket still works
+			std::array<int, 3> fds = { -1, -1, -1 };
+			if (nRingBytes)
+			{
+				size_t nCapacity = RoundRingCapacity(nRingBytes);
+				fds[0] = ::memfd_create("libnet-shm", MFD_CLOEXEC);
+				fds[1] = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+				fds[2] = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+				if (fds[0] >= 0 && fds[1] >= 0 && fds[2] >= 0 && ::ftruncate(fds[0], GetMemoryBytes(nCapacity)) == 0)
+				{
+					// The server keeps its mapping, its own eventfd and the client's
+					pShm.reset(new ShmTransport(asioContext, true, nCapacity));
+					if (pShm->Map(fds[0], ::dup(fds[1]), ::dup(fds[2])))
+					{
+						std::memcpy(answer.magic, c_szAccept, sizeof(answer.magic));
+						answer.nRingBytes = nCapacity;
+					}
+					else
+						pShm.reset();
+				}
+			}
+
+			bool bSent = pShm ? SendWithFds(fdSocket, answer, fds) : ::send(fdSocket, &answer, sizeof(answer), MSG_NOSIGNAL) == (ssize_t)sizeof(answer);
+			for (int fd : fds)
+			{
+				if (fd >= 0)
+					::close(fd);
+			}
+
+			if (!bSent)
+			{
+				pShm.reset();
+				return ShmHandshake::Failed;
+			}
+			return pShm ? ShmHandshake::Yes : ShmHandshake::No;
+#else
+			return ShmHandshake::No;
+#endif
+		}
+
+
+		// Client - Take the server's answer, and map the rings it has passed along
+		static ShmHandshake ReceiveAnswer(asio::io_context& asioContext, int fdSocket, std::unique_ptr<ShmTransport>& pShm)
+		{
+#if NETLIB_HAS_SHM
+			shm_handshake answer;
+			iovec iov = { &answer, sizeof(answer) };
+			alignas(cmsghdr) char control[CMSG_SPACE(3 * sizeof(int))];
+			msghdr msg = {};
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+
+			ssize_t n = ::recvmsg(fdSocket, &msg, MSG_CMSG_CLOEXEC);
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+				return ShmHandshake::Pending;
+
+			std::array<int, 3> fds = { -1, -1, -1 };
+			for (cmsghdr* pCmsg = CMSG_FIRSTHDR(&msg); pCmsg; pCmsg = CMSG_NXTHDR(&msg, pCmsg))
+			{
+				if (pCmsg->cmsg_level == SOL_SOCKET && pCmsg->cmsg_type == SCM_RIGHTS && pCmsg->cmsg_len == CMSG_LEN(sizeof(fds)))
+					std::memcpy(fds.data(), CMSG_DATA(pCmsg), sizeof(fds));
+			}
+
+			// The answer is sent in one go, before anything else
+			ShmHandshake result = ShmHandshake::Failed;
+			if (n == (ssize_t)sizeof(answer) && std::memcmp(answer.magic, c_szRefuse, sizeof(answer.magic)) == 0)
+				result = ShmHandshake::No;
+			else if (n == (ssize_t)sizeof(answer) && std::memcmp(answer.magic, c_szAccept, sizeof(answer.magic)) == 0 &&
+				fds[0] >= 0 && answer.nRingBytes == RoundRingCapacity(answer.nRingBytes))
+			{
+				// The memory must be as large as the rings say
+				struct stat status = {};
+				if (::fstat(fds[0], &status) == 0 && (size_t)status.st_size == GetMemoryBytes(answer.nRingBytes))
+				{
+					pShm.reset(new ShmTransport(asioContext, false, answer.nRingBytes));
+					if (pShm->Map(fds[0], fds[2], fds[1]))
+						result = ShmHandshake::Yes;
+					else
+						pShm.reset();
+					fds[1] = fds[2] = -1;
+				}
+			}
+
+			for (int fd : fds)
+			{
+				if (fd >= 0)
+					::close(fd);
+			}
+			return result;
+#else
+			return ShmHandshake::Failed;
+#endif
+		}
+
+
+	public:
+		// Copy as much of the buffers as fits into the outgoing ring, skipping the
+		// nTotal bytes which went into it before, and add the bytes copied to nTotal
+		// (nothing is copied if the ring is full). Returns false if the ring is broken.
+		bool Write(const std::vector<asio::const_buffer>& vBuffers, size_t& nTotal)
+		{
+			shm_ring_header& ring = *m_pTx;
+			uint64_t nWrite = ring.nWrite.load(std::memory_order_relaxed);
+			// The peer can't have read more than was written, nor can more than the
+			// ring be unread, a corrupt index would make us write outside of the ring
+			uint64_t nUsed = nWrite - ring.nRead.load(std::memory_order_acquire);
+			if (nUsed > m_nCapacity)
+				return false;
+			size_t nFree = m_nCapacity - (size_t)nUsed;
+
+			size_t nOffset = nTotal;
+			size_t nWritten = 0;
+			for (const asio::const_buffer& buffer : vBuffers)
+			{
+				if (nWritten == nFree)
+					break;
+				if (nOffset >= buffer.size())
+				{
+					nOffset -= buffer.size();
+					continue;
+				}
+				size_t nBytes = std::min(buffer.size() - nOffset, nFree - nWritten);
+				Copy(m_pTxData, nWrite + nWritten, (const uint8_t*)buffer.data() + nOffset, nBytes);
+				nWritten += nBytes;
+				nOffset = 0;
+			}
+
+			if (nWritten)
+			{
+				ring.nWrite.store(nWrite + nWritten, std::memory_order_release);
+				WakePeer(ring.bReaderWaiting);
+			}
+			nTotal += nWritten;
+			return true;
+		}
+
+
+		// Copy up to nSize bytes out of the incoming ring, returns 0 if it's empty
+		size_t Read(void* pData, size_t nSize)
+		{
+			shm_ring_header& ring = *m_pRx;
+			uint64_t nRead = ring.nRead.load(std::memory_order_relaxed);
+			// A corrupt index can't make us read outside of the ring
+			size_t nBytes = std::min({ nSize, m_nCapacity, (size_t)(ring.nWrite.load(std::memory_order_acquire) - nRead) });
+			if (nBytes == 0)
+				return 0;
+
+			size_t nPos = (size_t)nRead & (m_nCapacity - 1);
+			size_t nFirst = std::min(nBytes, m_nCapacity - nPos);
+			std::memcpy(pData, m_pRxData + nPos, nFirst);
+			std::memcpy((uint8_t*)pData + nFirst, m_pRxData, nBytes - nFirst);
+
+			ring.nRead.store(nRead + nBytes, std::memory_order_release);
+			WakePeer(ring.bWriterWaiting);
+			return nBytes;
+		}
+
+
+		// The incoming ring is empty, so sleep until the peer writes. Returns false
+		// if it has written meanwhile, otherwise wait for the wakeup (see ASYNC_WaitWakeup).
+		bool WaitForData()
+		{
+			return Sleep(m_pRx->bReaderWaiting, [this]() { return m_pRx->nWrite.load(std::memory_order_acquire) == m_pRx->nRead.load(std::memory_order_relaxed); });
+		}
+
+
+		// The outgoing ring is full, so sleep until the peer reads, like WaitForData
+		bool WaitForSpace()
+		{
+			return Sleep(m_pTx->bWriterWaiting, [this]() { return m_pTx->nWrite.load(std::memory_order_relaxed) - m_pTx->nRead.load(std::memory_order_acquire) >= m_nCapacity; });
+		}
+
+
+		// ASYNC - Wait until the peer wakes us up (or the transport is closed),
+		// then call ClearWakeup
+		template<typename Handler>
+		void ASYNC_WaitWakeup(Handler&& handler)
+		{
+#if NETLIB_HAS_SHM
+			m_Wakeup.async_wait(asio::posix::stream_descriptor::wait_read, std::forward<Handler>(handler));
+#endif
+		}
+
+
+		// Reset the eventfd, so it only wakes up again when signalled
+		void ClearWakeup()
+		{
+#if NETLIB_HAS_SHM
+			uint64_t nCount;
+			[[maybe_unused]] ssize_t n = ::read(m_Wakeup.native_handle(), &nCount, sizeof(nCount));
+#endif
+		}
+
+
+		// Stop waiting, the rings stay mapped until the transport is destroyed
+		void Close()
+		{
+#if NETLIB_HAS_SHM
+			std::error_code ec;
+			m_Wakeup.close(ec);
+#endif
+		}
+
+
+		size_t GetRingCapacity() const { return m_nCapacity; }
+
+
+	private:
+		ShmTransport(asio::io_context& asioContext, bool bServer, size_t nCapacity)
+#if NETLIB_HAS_SHM
+			: m_Wakeup(asioContext), m_bServer(bServer), m_nCapacity(nCapacity)
+#else
+			: m_bServer(bServer), m_nCapacity(nCapacity)
+#endif
+		{
+		}
+
+
+		// Rings are a power of two, so their indices simply wrap around
+		static size_t RoundRingCapacity(size_t nRingBytes)
+		{
+			size_t nCapacity = 64 * 1024;
+			while (nCapacity < nRingBytes && nCapacity < ((size_t)1 << 40))
+				nCapacity <<= 1;
+			return nCapacity;
+		}
+
+
+		// Each ring's header takes a page, followed by its data
+		static constexpr size_t c_nHeaderBytes = 4096;
+		static size_t GetMemoryBytes(size_t nCapacity)
+		{
+			return 2 * (c_nHeaderBytes + nCapacity);
+		}
+
+
+#if NETLIB_HAS_SHM
+		// Map the memory of the rings (the server to client ring comes first), and
+		// take over the eventfds (fdMemory stays with the caller)
+		bool Map(int fdMemory, int fdWakeup, int fdPeerWakeup)
+		{
+			m_fdPeerWakeup = fdPeerWakeup;
+			m_Wakeup.assign(fdWakeup);
+
+			m_nMemoryBytes = GetMemoryBytes(m_nCapacity);
+			void* pMemory = ::mmap(nullptr, m_nMemoryBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fdMemory, 0);
+			if (pMemory == MAP_FAILED)
+				return false;
+			m_pMemory = (uint8_t*)pMemory;
+
+			uint8_t* pRings[2] = { m_pMemory, m_pMemory + c_nHeaderBytes + m_nCapacity };
+			if (m_bServer)
+			{
+				// The memory is new (and zeroed), so the headers are created in it
+				new (pRings[0]) shm_ring_header{};
+				new (pRings[1]) shm_ring_header{};
+			}
+			m_pTx = (shm_ring_header*)pRings[m_bServer ? 0 : 1];
+			m_pRx = (shm_ring_header*)pRings[m_bServer ? 1 : 0];
+			m_pTxData = (uint8_t*)m_pTx + c_nHeaderBytes;
+			m_pRxData = (uint8_t*)m_pRx + c_nHeaderBytes;
+			return true;
+		}
+
+
+		static bool SendWithFds(int fdSocket, const shm_handshake& answer, const std::array<int, 3>& fds)
+		{
+			iovec iov = { (void*)&answer, sizeof(answer) };
+			alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))] = {};
+			msghdr msg = {};
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+
+			cmsghdr* pCmsg = CMSG_FIRSTHDR(&msg);
+			pCmsg->cmsg_level = SOL_SOCKET;
+			pCmsg->cmsg_type = SCM_RIGHTS;
+			pCmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+			std::memcpy(CMSG_DATA(pCmsg), fds.data(), sizeof(fds));
+			return ::sendmsg(fdSocket, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(answer);
+		}
+#endif
+
+
+		// Copy into a ring at index, wrapping around at its end
+		void Copy(uint8_t* pRing, uint64_t nIndex, const uint8_t* pData, size_t nBytes)
+		{
+			size_t nPos = (size_t)nIndex & (m_nCapacity - 1);
+			size_t nFirst = std::min(nBytes, m_nCapacity - nPos);
+			std::memcpy(pRing + nPos, pData, nFirst);
+			std::memcpy(pRing, pData + nFirst, nBytes - nFirst);
+		}
+
+
+		// Announce that we sleep, then check again: Either the peer sees the flag
+		// after its update (and wakes us), or we see its update (fences on both sides)
+		template<typename Func>
+		bool Sleep(std::atomic<uint32_t>& bWaiting, Func isBlocked)
+		{
+			bWaiting.store(1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (isBlocked())
+				return true;
+			bWaiting.store(0, std::memory_order_relaxed);
+			return false;
+		}
+
+
+		// The peer may sleep, waiting for what we've just done to the ring
+		void WakePeer(std::atomic<uint32_t>& bWaiting)
+		{
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (bWaiting.load(std::memory_order_relaxed) && bWaiting.exchange(0, std::memory_order_relaxed))
+			{
+#if NETLIB_HAS_SHM
+				uint64_t nOne = 1;
+				[[maybe_unused]] ssize_t n = ::write(m_fdPeerWakeup, &nOne, sizeof(nOne));
+#endif
+			}
+		}
+
+
+	private:
+		static constexpr const char* c_szRequest = "LNSHMREQ";
+		static constexpr const char* c_szAccept = "LNSHMACK";
+		static constexpr const char* c_szRefuse = "LNSHMNAK";
+		static_assert(std::atomic<uint64_t>::is_always_lock_free, "The rings need lock-free atomics, they are shared between processes");
+
+#if NETLIB_HAS_SHM
+		// Our eventfd, which the peer signals, and the peer's
+		asio::posix::stream_descriptor m_Wakeup;
+		int m_fdPeerWakeup = -1;
+#endif
+		bool m_bServer;
+
+		uint8_t* m_pMemory = nullptr;
+		size_t m_nMemoryBytes = 0;
+		size_t m_nCapacity;
+		shm_ring_header* m_pTx = nullptr;
+		shm_ring_header* m_pRx = nullptr;
+		uint8_t* m_pTxData = nullptr;
+		uint8_t* m_pRxData = nullptr;
+	};
+
+
+} // namespace Net
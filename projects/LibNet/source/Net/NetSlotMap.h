@@ -0,0 +1,167 @@
+#pragma once
+
+#include "NetCommon.h"
+
+
+namespace NETLIB_NAMESPACE {
+
+
+	// Container which hands out a 64-bit ID for every item, with O(1) insert,
+	// lookup and removal by ID.
+	//
+	// The low 32 bits of an ID select a slot, the high 32 bits are the slot's
+	// generation, which is increased whenever the slot is freed. So an ID of a
+	// removed item never finds the item which reuses its slot. ID 0 is never
+	// handed out (slot 0 is unused), so it can be used as "no ID".
+	//
+	// The items themselves are kept densely packed (removal moves the last
+	// item into the gap), which makes iterating as cheap as with a vector.
+	//
+	// NOTE: Not thread safe, the owner has to lock.
+	template<typename T>
+	class SlotMap
+	{
+	public:
+		using ID = uint64_t;
+		static constexpr ID INVALID_ID = 0;
+
+
+		SlotMap()
+		{
+			// Reserve slot 0, so no valid ID is 0
+			m_vSlots.push_back({ 0, NO_SLOT });
+		}
+
+
+	public:
+		// Adds an item, returns its ID
+		ID Insert(T item)
+		{
+			uint32_t iSlot;
+			if (m_iFreeSlot != NO_SLOT)
+			{
+				// Reuse a freed slot
+				iSlot = m_iFreeSlot;
+				m_iFreeSlot = m_vSlots[iSlot].nIndex;
+			}
+			else
+			{
+				iSlot = (uint32_t)m_vSlots.size();
+				m_vSlots.push_back({ 0, NO_SLOT });
+			}
+
+			Slot& slot = m_vSlots[iSlot];
+			slot.nIndex = (uint32_t)m_vItems.size();
+			m_vItems.push_back(std::move(item));
+			m_vItemSlots.push_back(iSlot);
+
+			return MakeID(iSlot, slot.nGeneration);
+		}
+
+
+		// Returns the item with this ID, nullptr if there is none (anymore)
+		T* Get(ID id)
+		{
+			if (!IsValid(id))
+				return nullptr;
+			return &m_vItems[m_vSlots[GetSlot(id)].nIndex];
+		}
+
+
+		const T* Get(ID id) const
+		{
+			return const_cast<SlotMap*>(this)->Get(id);
+		}
+
+
+		bool Contains(ID id) const
+		{
+			return IsValid(id);
+		}
+
+
+		// Removes the item with this ID, returns false if there is none (anymore)
+		bool Remove(ID id)
+		{
+			if (!IsValid(id))
+				return false;
+
+			uint32_t iSlot = GetSlot(id);
+			Slot& slot = m_vSlots[iSlot];
+
+			// Fill the gap with the last item
+			uint32_t nIndex = slot.nIndex;
+			uint32_t nLast = (uint32_t)m_vItems.size() - 1;
+			if (nIndex != nLast)
+			{
+				m_vItems[nIndex] = std::move(m_vItems[nLast]);
+				m_vItemSlots[nIndex] = m_vItemSlots[nLast];
+				m_vSlots[m_vItemSlots[nIndex]].nIndex = nIndex;
+			}
+			m_vItems.pop_back();
+			m_vItemSlots.pop_back();
+
+			// IDs of this slot are invalid from now on
+			slot.nGeneration++;
+			slot.nIndex = m_iFreeSlot;
+			m_iFreeSlot = iSlot;
+			return true;
+		}
+
+
+		void Clear()
+		{
+			while (!m_vItems.empty())
+				Remove(MakeID(m_vItemSlots.back(), m_vSlots[m_vItemSlots.back()].nGeneration));
+		}
+
+
+		size_t GetCount() const { return m_vItems.size(); }
+		bool IsEmpty() const { return m_vItems.empty(); }
+
+
+		// The items, in no particular order
+		auto begin() { return m_vItems.begin(); }
+		auto end() { return m_vItems.end(); }
+		auto begin() const { return m_vItems.begin(); }
+		auto end() const { return m_vItems.end(); }
+
+
+	private:
+		static constexpr uint32_t NO_SLOT = ~uint32_t(0);
+
+
+		struct Slot
+		{
+			uint32_t nGeneration;
+			// Index of the item if the slot is used, next free slot otherwise
+			uint32_t nIndex;
+		};
+
+
+		static ID MakeID(uint32_t iSlot, uint32_t nGeneration) { return (ID(nGeneration) << 32) | iSlot; }
+		static uint32_t GetSlot(ID id) { return (uint32_t)id; }
+		static uint32_t GetGeneration(ID id) { return (uint32_t)(id >> 32); }
+
+
+		bool IsValid(ID id) const
+		{
+			uint32_t iSlot = GetSlot(id);
+			if (iSlot == 0 || iSlot >= m_vSlots.size())
+				return false;
+			// Freeing a slot increases its generation, so old IDs don't match anymore
+			return m_vSlots[iSlot].nGeneration == GetGeneration(id) && m_vSlots[iSlot].nIndex < m_vItems.size() && m_vItemSlots[m_vSlots[iSlot].nIndex] == iSlot;
+		}
+
+
+	private:
+		std::vector<Slot> m_vSlots;
+		uint32_t m_iFreeSlot = NO_SLOT;
+
+		// The items, and the slot each of them belongs to
+		std::vector<T> m_vItems;
+		std::vector<uint32_t> m_vItemSlots;
+	};
+
+
+} // namespace Net
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "NetCommon.h"
+
+#include "NetBuffer.h"
+
+#include <functional>
+
+
+namespace NETLIB_NAMESPACE {
+
+
+	class Connection;
+
+
+	// Large payloads are sent as a stream of chunks (ControlMsg::StreamChunk),
+	// which are interleaved with the other messages of the connection. Every
+	// chunk body starts with this header, followed by the data.
+	struct stream_chunk_header
+	{
+		// Stream ID, unique per connection and direction
+		uint32_t id = 0;
+		// App defined type of the stream (like a message type)
+		uint32_t type = 0;
+		// StreamFlags
+		uint8_t flags = 0;
+		uint8_t reserved[3] = {};
+	};
+
+
+	enum StreamFlags : uint8_t
+	{
+		// First chunk of a stream, opens its sink
+		StreamBegin = 1 << 0,
+		// Last chunk of a stream (may have no data), closes its sink
+		StreamEnd = 1 << 1,
+		// The sender gave up on the stream, the data is incomplete
+		StreamAbort = 1 << 2,
+	};
+
+
+	// Produces the data of an outgoing stream: Fills up to nMax bytes at pData
+	// and returns how many it wrote, 0 once the stream is complete.
+	//
+	// NOTE: Called on the connection's I/O thread, whenever the next chunk is due.
+	using StreamSource = std::function<size_t(uint8_t* pData, size_t nMax)>;
+
+
+	// Consumer of an incoming stream, implemented by the application
+	//
+	// NOTE: Called on the connection's I/O thread, in order. The chunks are
+	// passed on as they arrive and are not kept, so a sink should not block
+	// for long (which would also hold up the other messages of the connection).
+	class StreamSink
+	{
+	public:
+		virtual ~StreamSink() {}
+
+		// Next bytes of the stream
+		virtual void OnData(const uint8_t* pData, size_t nSize) = 0;
+
+		// The stream is complete (bComplete), or has been aborted by
+		// the sender or by a disconnect
+		virtual void OnEnd(bool bComplete) = 0;
+	};
+
+
+	// Creates the sink for a stream which is starting on remote, nullptr drops the stream
+	using StreamSinkFactory = std::function<std::unique_ptr<StreamSink>(Connection& remote, uint32_t type)>;
+
+
+} // namespace Net
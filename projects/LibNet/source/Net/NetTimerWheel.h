@@ -0,0 +1,207 @@
+#pragma once
+
+#include "NetCommon.h"
+
+#include <chrono>
+#include <functional>
+
+
+namespace NETLIB_NAMESPACE {
+
+
+	// Hashed timer wheel (Varghese & Lauck): A ring of slots, each with a list
+	// of the timers which are due in it. A timer which is due in more than one
+	// revolution sits in the slot of its due tick, and is skipped until it's
+	// there. Scheduling and cancelling are O(1), and every tick only looks at
+	// a single slot, so a large number of connections with timeouts costs
+	// (next to) nothing per tick.
+	//
+	// The wheel is only a data structure, it's advanced by a TimerWheelTicker
+	// running on the io_context of the connections which use it.
+	class TimerWheel
+	{
+	public:
+		// A timer is owned by whoever schedules it, the wheel only links to it
+		struct Timer
+		{
+			// Called when the timer is due (with the wheel locked, so it must
+			// not schedule or cancel timers itself, but post the work instead)
+			std::function<void()> func;
+
+			bool IsScheduled() const { return pNext != nullptr; }
+
+		private:
+			friend class TimerWheel;
+			Timer* pPrev = nullptr;
+			Timer* pNext = nullptr;
+			uint64_t nDue = 0;
+		};
+
+
+	public:
+		explicit TimerWheel(std::chrono::milliseconds tick = std::chrono::milliseconds(NETLIB_TIMER_TICK_MS), size_t nSlots = NETLIB_TIMER_WHEEL_SLOTS)
+			: m_Tick(tick.count() > 0 ? tick : std::chrono::milliseconds(1)), m_vSlots(nSlots > 0 ? nSlots : 1)
+		{
+			// Every slot is a circular list with itself as head
+			for (Timer& slot : m_vSlots)
+				slot.pPrev = slot.pNext = &slot;
+		}
+
+
+		TimerWheel(const TimerWheel&) = delete; // no copy constructor
+
+
+	public:
+		// Length of a tick, which is the resolution of the timers
+		std::chrono::milliseconds GetTick() const { return m_Tick; }
+
+
+		// Number of ticks since the wheel was created, may be read from any thread
+		uint64_t GetNow() const { return m_nNow.load(std::memory_order_relaxed); }
+
+
+		// Ticks which cover duration (rounded up)
+		uint64_t ToTicks(std::chrono::milliseconds duration) const
+		{
+			return duration.count() <= 0 ? 0 : (uint64_t)((duration.count() + m_Tick.count() - 1) / m_Tick.count());
+		}
+
+
+		// (Re)schedule timer to be due nTicks from now (at least one)
+		void Schedule(Timer& timer, uint64_t nTicks)
+		{
+			std::scoped_lock scoped_lock(m_mutexWheel);
+			Unlink(timer);
+			timer.nDue = m_nNow.load(std::memory_order_relaxed) + std::max<uint64_t>(nTicks, 1);
+			Link(m_vSlots[timer.nDue % m_vSlots.size()], timer);
+		}
+
+
+		void Cancel(Timer& timer)
+		{
+			std::scoped_lock scoped_lock(m_mutexWheel);
+			Unlink(timer);
+		}
+
+
+		// Advance the wheel by one tick, and call the timers which are due now
+		void Tick()
+		{
+			std::scoped_lock scoped_lock(m_mutexWheel);
+			uint64_t nNow = m_nNow.load(std::memory_order_relaxed) + 1;
+			m_nNow.store(nNow, std::memory_order_relaxed);
+
+			Timer& slot = m_vSlots[nNow % m_vSlots.size()];
+			Timer* pTimer = slot.pNext;
+			while (pTimer != &slot)
+			{
+				Timer* pNext = pTimer->pNext;
+				// Timers of later revolutions stay where they are
+				if (pTimer->nDue <= nNow)
+				{
+					Unlink(*pTimer);
+					if (pTimer->func)
+						pTimer->func();
+				}
+				pTimer = pNext;
+			}
+		}
+
+
+	private:
+		static void Link(Timer& head, Timer& timer)
+		{
+			timer.pPrev = head.pPrev;
+			timer.pNext = &head;
+			head.pPrev->pNext = &timer;
+			head.pPrev = &timer;
+		}
+
+
+		static void Unlink(Timer& timer)
+		{
+			if (!timer.IsScheduled())
+				return;
+			timer.pPrev->pNext = timer.pNext;
+			timer.pNext->pPrev = timer.pPrev;
+			timer.pPrev = timer.pNext = nullptr;
+		}
+
+
+	private:
+		std::chrono::milliseconds m_Tick;
+		std::atomic<uint64_t> m_nNow = 0;
+
+		// Head of the timer list of each slot
+		std::vector<Timer> m_vSlots;
+		std::mutex m_mutexWheel;
+	};
+
+
+	// Advances a TimerWheel from an io_context, with a single steady_timer
+	class TimerWheelTicker
+	{
+	public:
+		TimerWheelTicker(asio::io_context& context, std::shared_ptr<TimerWheel> pWheel)
+			: m_asioTimer(context), m_pWheel(std::move(pWheel))
+		{
+		}
+
+
+		TimerWheelTicker(const TimerWheelTicker&) = delete; // no copy constructor
+
+
+	public:
+		void Start()
+		{
+			m_nTicks = 0;
+			m_Start = std::chrono::steady_clock::now();
+			m_asioTimer.expires_at(m_Start + m_pWheel->GetTick());
+			ASYNC_Wait();
+		}
+
+
+		void Stop()
+		{
+			m_asioTimer.cancel();
+		}
+
+
+		const std::shared_ptr<TimerWheel>& GetWheel() const { return m_pWheel; }
+
+
+	private:
+		void ASYNC_Wait()
+		{
+			m_asioTimer.async_wait(
+				[this](std::error_code ec)
+				{
+					if (ec)
+						return;
+
+					// Catch up with the ticks which were missed (if the
+					// thread has been busy), so the timers keep their time
+					uint64_t nDue = (uint64_t)((std::chrono::steady_clock::now() - m_Start) / m_pWheel->GetTick());
+					do
+					{
+						m_pWheel->Tick();
+						m_nTicks++;
+					} while (m_nTicks < nDue);
+
+					m_asioTimer.expires_at(m_Start + m_pWheel->GetTick() * (m_nTicks + 1));
+					ASYNC_Wait();
+				});
+		}
+
+
+	private:
+		asio::steady_timer m_asioTimer;
+		std::shared_ptr<TimerWheel> m_pWheel;
+
+		// Ticks done since Start
+		std::chrono::steady_clock::time_point m_Start;
+		uint64_t m_nTicks = 0;
+	};
+
+
+} // namespace Net
@@ -0,0 +1,199 @@
+#pragma once
+
+#include "NetCommon.h"
+
+#if NETLIB_TLS
+
+#include <asio/ssl.hpp>
+
+#include <unordered_map>
+
+
+namespace NETLIB_NAMESPACE {
+
+
+	// The TLS layer of a connection, on top of its socket
+	using TlsStream = asio::ssl::stream<asio::generic::stream_protocol::socket&>;
+
+
+	// How a server or a client sets up TLS (see Server::EnableTls, Client::EnableTls)
+	struct TlsOptions
+	{
+		// PEM files of our certificate chain and its private key (required for a
+		// server, a client only needs them if the server asks for one)
+		std::string certificateFile;
+		std::string privateKeyFile;
+		// PEM file of the CAs which the peer's certificate is verified against
+		// (a client uses the system's CAs if it's empty)
+		std::string caFile;
+		// A client checks the server's certificate and name, a server asks
+		// every client for a certificate if it has a caFile
+		bool bVerifyPeer = true;
+		// Name which the server's certificate must have (and which is sent as SNI),
+		// the host passed to Client::Connect if empty
+		std::string serverName;
+		// Threads of a server which run the handshakes, so the expensive ones don't
+		// hold up the traffic of established connections (0 runs them on the I/O threads)
+		size_t nHandshakeThreads = 1;
+	};
+
+
+	// TLS setup shared by the connections of a server or a client: The OpenSSL
+	// context, the threads which run the handshakes (server), and the sessions
+	// which are resumed when connecting again (client).
+	//
+	// Sessions are resumed with tickets. The server encrypts them with a key of
+	// its context, so it doesn't store anything, and a client which reconnects
+	// presents the latest ticket of the server. A resumed handshake skips the
+	// certificate and its signature, so a storm of reconnects stays cheap.
+	class TlsContext
+	{
+	public:
+		// Throws asio::system_error, if a file can't be loaded
+		TlsContext(bool bServer, const TlsOptions& options)
+			: m_Context(bServer ? asio::ssl::context::tls_server : asio::ssl::context::tls_client), m_Options(options), m_bServer(bServer)
+		{
+			m_Context.set_options(asio::ssl::context::default_workarounds | asio::ssl::context::no_sslv2 |
+				asio::ssl::context::no_sslv3 | asio::ssl::context::no_tlsv1 | asio::ssl::context::no_tlsv1_1);
+			if (!options.certificateFile.empty())
+				m_Context.use_certificate_chain_file(options.certificateFile);
+			if (!options.privateKeyFile.empty())
+				m_Context.use_private_key_file(options.privateKeyFile, asio::ssl::context::pem);
+			if (!options.caFile.empty())
+				m_Context.load_verify_file(options.caFile);
+			else if (!bServer)
+				m_Context.set_default_verify_paths();
+
+			SSL_CTX* pContext = m_Context.native_handle();
+			if (bServer)
+			{
+				if (options.bVerifyPeer && !options.caFile.empty())
+					m_Context.set_verify_mode(asio::ssl::verify_peer | asio::ssl::verify_fail_if_no_peer_cert);
+				// One ticket per handshake is enough, a client only keeps the latest
+				SSL_CTX_set_session_id_context(pContext, (const unsigned char*)"LibNet", 6);
+				SSL_CTX_set_num_tickets(pContext, 1);
+			}
+			else
+			{
+				m_Context.set_verify_mode(options.bVerifyPeer ? asio::ssl::verify_peer : asio::ssl::verify_none);
+				// The tickets are kept by us (see OnNewSession), not by OpenSSL
+				SSL_CTX_set_session_cache_mode(pContext, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+				SSL_CTX_sess_set_new_cb(pContext, &TlsContext::OnNewSession);
+			}
+		}
+
+
+		TlsContext(const TlsContext&) = delete; // no copy constructor
+
+		~TlsContext()
+		{
+			StopHandshakes();
+			for (auto& [name, peer] : m_Peers)
+			{
+				if (peer.pSession)
+					SSL_SESSION_free(peer.pSession);
+			}
+		}
+
+
+	public:
+		// The OpenSSL context, for settings which TlsOptions doesn't cover
+		asio::ssl::context& GetContext() { return m_Context; }
+
+
+		// Server - Start (stop) the threads which run the handshakes
+		void StartHandshakes()
+		{
+			if (m_bServer && m_Options.nHandshakeThreads > 0 && !m_pHandshakeThreads)
+				m_pHandshakeThreads = std::make_unique<asio::thread_pool>(m_Options.nHandshakeThreads);
+		}
+
+
+		void StopHandshakes()
+		{
+			if (m_pHandshakeThreads)
+			{
+				m_pHandshakeThreads->stop();
+				m_pHandshakeThreads->join();
+				m_pHandshakeThreads.reset();
+			}
+		}
+
+
+		// Where the steps of a handshake run, fallback if there are no threads for it
+		asio::any_io_executor GetHandshakeExecutor(asio::any_io_executor fallback)
+		{
+			return m_pHandshakeThreads ? asio::any_io_executor(m_pHandshakeThreads->get_executor()) : fallback;
+		}
+
+
+		// Client - Prepare the stream of a connection to host, to verify the
+		// server and to resume the last session with peer (its host and port)
+		void PrepareClient(TlsStream& stream, const std::string& host, const std::string& peer)
+		{
+			SSL* ssl = stream.native_handle();
+			std::string name = m_Options.serverName.empty() ? host : m_Options.serverName;
+
+			// Servers are told the name, unless it's an address
+			std::error_code ec;
+			asio::ip::make_address(name, ec);
+			if (ec)
+				SSL_set_tlsext_host_name(ssl, name.c_str());
+			if (m_Options.bVerifyPeer)
+				stream.set_verify_callback(asio::ssl::host_name_verification(name));
+
+			std::scoped_lock scoped_lock(m_mutexPeers);
+			Peer& state = m_Peers.try_emplace(peer, Peer{ this }).first->second;
+			if (state.pSession)
+				SSL_set_session(ssl, state.pSession);
+			SSL_set_ex_data(ssl, GetPeerIndex(), &state);
+		}
+
+
+	private:
+		// Latest session of a server, the map doesn't move its items
+		struct Peer
+		{
+			TlsContext* pContext = nullptr;
+			SSL_SESSION* pSession = nullptr;
+		};
+
+
+		static int GetPeerIndex()
+		{
+			static int nIndex = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+			return nIndex;
+		}
+
+
+		// OpenSSL hands us a new session (with TLS 1.3 some time after the handshake),
+		// returns 1 as we keep its reference
+		static int OnNewSession(SSL* ssl, SSL_SESSION* pSession)
+		{
+			Peer* pPeer = (Peer*)SSL_get_ex_data(ssl, GetPeerIndex());
+			if (!pPeer)
+				return 0;
+
+			std::scoped_lock scoped_lock(pPeer->pContext->m_mutexPeers);
+			if (pPeer->pSession)
+				SSL_SESSION_free(pPeer->pSession);
+			pPeer->pSession = pSession;
+			return 1;
+		}
+
+
+	private:
+		asio::ssl::context m_Context;
+		TlsOptions m_Options;
+		bool m_bServer;
+
+		std::unique_ptr<asio::thread_pool> m_pHandshakeThreads;
+
+		std::unordered_map<std::string, Peer> m_Peers;
+		std::mutex m_mutexPeers;
+	};
+
+
+} // namespace Net
+
+#endif // NETLIB_TLS
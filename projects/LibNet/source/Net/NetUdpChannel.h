@@ -0,0 +1,448 @@
+#pragma once
+
+#include "NetCommon.h"
+
+#include "NetMessage.h"
+
+#include <array>
+#include <functional>
+
+#if defined(__linux__)
+#	include <sys/socket.h>
+#	include <cerrno>
+#endif
+
+
+namespace NETLIB_NAMESPACE {
+
+
+	// Every datagram starts with this header, followed by a message header and
+	// its body. The ID and token tie the datagram to a TCP connection (they are
+	// handed out by the server over TCP, see ControlMsg::UdpToken).
+	struct udp_datagram_header
+	{
+		uint64_t id = 0;
+		uint64_t token = 0;
+	};
+
+
+	// Unreliable, unordered channel for messages which would rather be lost than
+	// late (like position updates), next to the TCP connections. A message has to
+	// fit into a single datagram (NETLIB_UDP_MAX_DATAGRAM), its body is always
+	// checked with CRC-32C and never compressed.
+	//
+	// Datagrams are sent and received in batches, on Linux with sendmmsg/recvmmsg,
+	// so a single syscall covers up to NETLIB_UDP_SEND_BATCH datagrams (like a
+	// broadcast to many clients). Elsewhere they are sent one by one.
+	class UdpChannel
+	{
+	public:
+		// A datagram waiting to be sent (the message shares its body with the sender)
+		struct Datagram
+		{
+			asio::ip::udp::endpoint to;
+			udp_datagram_header header;
+			Message msg;
+		};
+
+		// Called on the channel's strand for every valid datagram which arrives
+		using Handler = std::function<void(const asio::ip::udp::endpoint& from, const udp_datagram_header& header, Message& msg)>;
+
+
+	public:
+		UdpChannel(asio::io_context& asioContext, Handler handler)
+			: m_socket(asioContext), m_strand(asio::make_strand(asioContext)), m_Handler(std::move(handler))
+		{
+			m_vRecvBuffer.resize(NETLIB_UDP_RECV_BATCH * NETLIB_UDP_MAX_DATAGRAM);
+			m_vRecvFrom.resize(NETLIB_UDP_RECV_BATCH);
+		}
+
+
+		UdpChannel(const UdpChannel&) = delete; // no copy constructor
+
+
+		~UdpChannel()
+		{
+			Close();
+		}
+
+
+	public:
+		// Receive datagrams on local (server), throws if the port can't be bound
+		void Bind(const asio::ip::udp::endpoint& local)
+		{
+			Open(local.protocol());
+			m_socket.bind(local);
+			m_bConnected = false;
+			ASYNC_Receive();
+		}
+
+
+		// Exchange datagrams with remote only (client)
+		void Connect(const asio::ip::udp::endpoint& remote)
+		{
+			Open(remote.protocol());
+			m_socket.connect(remote);
+			m_bConnected = true;
+			ASYNC_Receive();
+		}
+
+
+		// Close the socket, pending datagrams are dropped
+		void Close()
+		{
+			std::error_code ec;
+			m_socket.close(ec);
+
+			std::scoped_lock scoped_lock(m_mutexPending);
+			m_vPending.clear();
+		}
+
+
+		bool IsOpen() const { return m_socket.is_open(); }
+
+
+		// Largest body a message sent over UDP may have
+		static constexpr size_t GetMaxBodySize()
+		{
+			return NETLIB_UDP_MAX_DATAGRAM - sizeof(udp_datagram_header) - sizeof(message_header);
+		}
+
+
+		// Queue a message for to, returns false if it's too large, the channel is closed,
+		// or too many datagrams are waiting. The datagrams queued by all threads
+		// are sent together, by as few syscalls as possible.
+		bool Send(const asio::ip::udp::endpoint& to, const udp_datagram_header& header, const Message& msg)
+		{
+			if (msg.body.size() > GetMaxBodySize())
+				return false;
+
+			std::scoped_lock scoped_lock(m_mutexPending);
+			if (!m_socket.is_open() || m_vPending.size() >= NETLIB_UDP_SEND_QUEUE_MAX)
+				return false;
+			m_vPending.push_back({ to, header, msg });
+			ScheduleFlush();
+			return true;
+		}
+
+
+		// Queue a message for many receivers at once (see Send), forEach is called with
+		// a function which queues the datagram for a receiver. Returns the number queued.
+		template<typename ForEach>
+		size_t SendMany(const Message& msg, ForEach&& forEach)
+		{
+			if (msg.body.size() > GetMaxBodySize())
+				return 0;
+
+			size_t nQueued = 0;
+			std::scoped_lock scoped_lock(m_mutexPending);
+			if (!m_socket.is_open())
+				return 0;
+			forEach(
+				[this, &msg, &nQueued](const asio::ip::udp::endpoint& to, const udp_datagram_header& header)
+				{
+					if (m_vPending.size() >= NETLIB_UDP_SEND_QUEUE_MAX)
+						return;
+					m_vPending.push_back({ to, header, msg });
+					nQueued++;
+				});
+			if (nQueued > 0)
+				ScheduleFlush();
+			return nQueued;
+		}
+
+
+		// Datagrams which have been sent, received and dropped (invalid ones
+		// received, or ones the socket refused to send)
+		uint64_t GetSentDatagrams() const { return m_nSent.load(std::memory_order_relaxed); }
+		uint64_t GetReceivedDatagrams() const { return m_nReceived.load(std::memory_order_relaxed); }
+		uint64_t GetDroppedDatagrams() const { return m_nDropped.load(std::memory_order_relaxed); }
+		// Syscalls used to send, to see how well the datagrams are batched
+		uint64_t GetSendCalls() const { return m_nSendCalls.load(std::memory_order_relaxed); }
+
+
+	private:
+		void Open(const asio::ip::udp& protocol)
+		{
+			Close();
+			m_socket.open(protocol);
+			// The strand waits for readiness itself, and then drains the socket
+			m_socket.non_blocking(true);
+		}
+
+
+		// Make sure a flush is on its way (m_mutexPending is held)
+		void ScheduleFlush()
+		{
+			if (m_bFlushScheduled)
+				return;
+			m_bFlushScheduled = true;
+			asio::post(m_strand, [this]() { Flush(); });
+		}
+
+
+		// Take the pending datagrams and send them
+		void Flush()
+		{
+			{
+				std::scoped_lock scoped_lock(m_mutexPending);
+				m_bFlushScheduled = false;
+
+				// Still busy with the last ones, waiting for the socket to take
+				// more (the new ones are taken when it's done)
+				if (m_bSending)
+					return;
+
+				m_vSending.clear();
+				m_vSending.swap(m_vPending);
+			}
+			m_nSending = 0;
+			SendBatches();
+		}
+
+
+		// Send what's left of m_vSending, in batches, until the socket would block
+		void SendBatches()
+		{
+			while (m_nSending < m_vSending.size() && m_socket.is_open())
+			{
+				std::error_code ec;
+				size_t nSent = SendBatch(ec);
+				m_nSendCalls.fetch_add(1, std::memory_order_relaxed);
+
+				if (ec == asio::error::would_block || ec == asio::error::try_again)
+				{
+					// Wait until the socket can take more, then go on
+					m_bSending = true;
+					m_socket.async_wait(asio::ip::udp::socket::wait_write, asio::bind_executor(m_strand,
+						[this](std::error_code ec)
+						{
+							m_bSending = false;
+							if (!ec)
+								SendBatches();
+						}));
+					return;
+				}
+				if (ec)
+				{
+					// The datagram which failed is dropped (e.g. unreachable), the rest goes on
+					m_nDropped.fetch_add(1, std::memory_order_relaxed);
+					nSent++;
+				}
+				else
+				{
+					m_nSent.fetch_add(nSent, std::memory_order_relaxed);
+				}
+				m_nSending += nSent;
+			}
+
+			// All sent, the bodies are released
+			m_vSending.clear();
+			m_nSending = 0;
+
+			// Datagrams which were queued while sending
+			std::scoped_lock scoped_lock(m_mutexPending);
+			if (!m_vPending.empty())
+				ScheduleFlush();
+		}
+
+
+#if defined(__linux__)
+		// Send up to NETLIB_UDP_SEND_BATCH datagrams with a single sendmmsg, returns
+		// the number sent (on error, the datagram at m_nSending failed)
+		size_t SendBatch(std::error_code& ec)
+		{
+			size_t nCount = std::min<size_t>(m_vSending.size() - m_nSending, NETLIB_UDP_SEND_BATCH);
+			m_vSendHeaders.resize(nCount);
+			m_vSendBuffers.resize(nCount * 3);
+
+			for (size_t i = 0; i < nCount; i++)
+			{
+				Datagram& datagram = m_vSending[m_nSending + i];
+				iovec* pBuffers = &m_vSendBuffers[i * 3];
+				pBuffers[0] = { &datagram.header, sizeof(udp_datagram_header) };
+				pBuffers[1] = { &datagram.msg.header, sizeof(message_header) };
+				pBuffers[2] = { const_cast<uint8_t*>(std::as_const(datagram.msg.body).data()), datagram.msg.body.size() };
+
+				msghdr& header = m_vSendHeaders[i].msg_hdr;
+				header = {};
+				// A connected socket (client) has no address per datagram
+				if (!m_bConnected)
+				{
+					header.msg_name = datagram.to.data();
+					header.msg_namelen = (socklen_t)datagram.to.size();
+				}
+				header.msg_iov = pBuffers;
+				header.msg_iovlen = datagram.msg.body.empty() ? 2 : 3;
+			}
+
+			int nSent;
+			do
+			{
+				nSent = ::sendmmsg(m_socket.native_handle(), m_vSendHeaders.data(), (unsigned int)nCount, 0);
+			} while (nSent < 0 && errno == EINTR);
+
+			if (nSent < 0)
+			{
+				ec = std::error_code(errno, asio::error::get_system_category());
+				return 0;
+			}
+			return (size_t)nSent;
+		}
+#else
+		// Send a single datagram, returns the number sent
+		size_t SendBatch(std::error_code& ec)
+		{
+			const Datagram& datagram = m_vSending[m_nSending];
+			std::array<asio::const_buffer, 3> buffers =
+			{
+				asio::buffer(&datagram.header, sizeof(udp_datagram_header)),
+				asio::buffer(&datagram.msg.header, sizeof(message_header)),
+				asio::buffer(datagram.msg.body.data(), datagram.msg.body.size())
+			};
+			if (m_bConnected)
+				m_socket.send(buffers, 0, ec);
+			else
+				m_socket.send_to(buffers, datagram.to, 0, ec);
+			return ec ? 0 : 1;
+		}
+#endif
+
+
+		// ASYNC - Wait until datagrams arrive, then take all of them
+		void ASYNC_Receive()
+		{
+			m_socket.async_wait(asio::ip::udp::socket::wait_read, asio::bind_executor(m_strand,
+				[this](std::error_code ec)
+				{
+					if (ec)
+						return;
+					while (ReceiveBatch() == NETLIB_UDP_RECV_BATCH)
+					{
+						// The batch was full, so there may be more
+					}
+					ASYNC_Receive();
+				}));
+		}
+
+
+#if defined(__linux__)
+		// Receive up to NETLIB_UDP_RECV_BATCH datagrams with a single recvmmsg,
+		// returns the number received
+		size_t ReceiveBatch()
+		{
+			mmsghdr headers[NETLIB_UDP_RECV_BATCH];
+			iovec buffers[NETLIB_UDP_RECV_BATCH];
+			for (size_t i = 0; i < NETLIB_UDP_RECV_BATCH; i++)
+			{
+				buffers[i] = { &m_vRecvBuffer[i * NETLIB_UDP_MAX_DATAGRAM], NETLIB_UDP_MAX_DATAGRAM };
+				headers[i] = {};
+				headers[i].msg_hdr.msg_name = m_vRecvFrom[i].data();
+				headers[i].msg_hdr.msg_namelen = (socklen_t)m_vRecvFrom[i].capacity();
+				headers[i].msg_hdr.msg_iov = &buffers[i];
+				headers[i].msg_hdr.msg_iovlen = 1;
+			}
+
+			int nReceived;
+			do
+			{
+				nReceived = ::recvmmsg(m_socket.native_handle(), headers, NETLIB_UDP_RECV_BATCH, MSG_DONTWAIT, nullptr);
+			} while (nReceived < 0 && errno == EINTR);
+			if (nReceived <= 0)
+				return 0;
+
+			for (int i = 0; i < nReceived; i++)
+			{
+				m_vRecvFrom[i].resize(headers[i].msg_hdr.msg_namelen);
+				// Truncated datagrams are larger than anything we'd send
+				if (headers[i].msg_hdr.msg_flags & MSG_TRUNC)
+				{
+					m_nDropped.fetch_add(1, std::memory_order_relaxed);
+					continue;
+				}
+				OnDatagram(m_vRecvFrom[i], &m_vRecvBuffer[i * NETLIB_UDP_MAX_DATAGRAM], headers[i].msg_len);
+			}
+			return (size_t)nReceived;
+		}
+#else
+		// Receive a single datagram, returns the number received
+		size_t ReceiveBatch()
+		{
+			std::error_code ec;
+			size_t nSize = m_socket.receive_from(asio::buffer(m_vRecvBuffer.data(), NETLIB_UDP_MAX_DATAGRAM), m_vRecvFrom[0], 0, ec);
+			if (ec)
+				return 0;
+			OnDatagram(m_vRecvFrom[0], m_vRecvBuffer.data(), nSize);
+			return 1;
+		}
+#endif
+
+
+		// Check a datagram, and pass its message on
+		void OnDatagram(const asio::ip::udp::endpoint& from, const uint8_t* pData, size_t nSize)
+		{
+			udp_datagram_header header;
+			Message msg;
+			if (nSize < sizeof(udp_datagram_header) + sizeof(message_header))
+			{
+				m_nDropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			std::memcpy(&header, pData, sizeof(udp_datagram_header));
+			std::memcpy(&msg.header, pData + sizeof(udp_datagram_header), sizeof(message_header));
+			pData += sizeof(udp_datagram_header) + sizeof(message_header);
+			nSize -= sizeof(udp_datagram_header) + sizeof(message_header);
+
+			if (!msg.IsHeaderValid() || msg.header.size != nSize || msg.header.integrity != Integrity::CRC32C || msg.header.compression != Compression::None)
+			{
+				m_nDropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			if (nSize > 0)
+			{
+				msg.body.resize(nSize);
+				std::memcpy(msg.body.data(), pData, nSize);
+			}
+			if (!msg.IsBodyValid())
+			{
+				m_nDropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+
+			m_nReceived.fetch_add(1, std::memory_order_relaxed);
+			m_Handler(from, header, msg);
+		}
+
+
+	private:
+		asio::ip::udp::socket m_socket;
+		bool m_bConnected = false;
+		// Sending and receiving are serialized through the strand
+		asio::strand<asio::io_context::executor_type> m_strand;
+		Handler m_Handler;
+
+		// Datagrams queued by any thread...
+		std::vector<Datagram> m_vPending;
+		std::mutex m_mutexPending;
+		bool m_bFlushScheduled = false;
+		// ...and the ones being sent by the strand (up to m_nSending they are done)
+		std::vector<Datagram> m_vSending;
+		size_t m_nSending = 0;
+		bool m_bSending = false;
+#if defined(__linux__)
+		std::vector<mmsghdr> m_vSendHeaders;
+		std::vector<iovec> m_vSendBuffers;
+#endif
+
+		// Receive buffers of a batch, and where the datagrams came from
+		std::vector<uint8_t> m_vRecvBuffer;
+		std::vector<asio::ip::udp::endpoint> m_vRecvFrom;
+
+		std::atomic<uint64_t> m_nSent = 0;
+		std::atomic<uint64_t> m_nReceived = 0;
+		std::atomic<uint64_t> m_nDropped = 0;
+		std::atomic<uint64_t> m_nSendCalls = 0;
+	};
+
+
+} // namespace Net
@@ -0,0 +1,262 @@
+#pragma once
+
+#include "NetCommon.h"
+
+#include <chrono>
+#include <functional>
+
+
+namespace NETLIB_NAMESPACE {
+
+
+	// Counters of a WorkerPool. The difference of two snapshots gives the
+	// values of the time in between, eg. the utilization of the last second.
+	struct WorkerStats
+	{
+		size_t nThreads = 0;
+		// Tasks waiting for a worker right now
+		size_t nQueuedTasks = 0;
+		// Tasks executed, and how many of them were stolen from another worker
+		uint64_t nExecutedTasks = 0;
+		uint64_t nStolenTasks = 0;
+		// Time the workers spent executing tasks (all workers together)...
+		uint64_t nBusyNanoseconds = 0;
+		// ...and time the pool was running
+		uint64_t nElapsedNanoseconds = 0;
+
+
+		// Fraction of the available worker time which was spent on tasks (0..1)
+		double GetUtilization() const
+		{
+			if (nThreads == 0 || nElapsedNanoseconds == 0)
+				return 0.0;
+			return (double)nBusyNanoseconds / ((double)nElapsedNanoseconds * (double)nThreads);
+		}
+
+
+		WorkerStats operator - (const WorkerStats& before) const
+		{
+			WorkerStats stats = *this;
+			stats.nExecutedTasks -= before.nExecutedTasks;
+			stats.nStolenTasks -= before.nStolenTasks;
+			stats.nBusyNanoseconds -= before.nBusyNanoseconds;
+			stats.nElapsedNanoseconds -= before.nElapsedNanoseconds;
+			return stats;
+		}
+	};
+
+
+	// Pool of worker threads which execute tasks of type Task.
+	//
+	// Every worker has a queue of its own. Tasks submitted by a worker stay in
+	// its own queue, others are spread round-robin. A worker takes its tasks
+	// from the front of its queue, and once it runs dry, it steals from the
+	// back of the other queues, so a few long tasks can't starve the pool.
+	//
+	// Stop() lets the workers finish all queued tasks before they exit.
+	template<typename Task>
+	class WorkerPool
+	{
+	public:
+		using Executor = std::function<void(Task&)>;
+
+
+		// Every task is passed to executor, on one of the nThreads workers
+		WorkerPool(size_t nThreads, Executor executor)
+			: m_Executor(std::move(executor))
+		{
+			nThreads = (nThreads > 0) ? nThreads : 1;
+			for (size_t i = 0; i < nThreads; i++)
+				m_Workers.push_back(std::make_unique<Worker>());
+		}
+
+
+		WorkerPool(const WorkerPool&) = delete; // no copy constructor
+
+
+		~WorkerPool()
+		{
+			Stop();
+		}
+
+
+	public:
+		// Launch the worker threads
+		void Start()
+		{
+			m_bStop = false;
+			m_timeStart = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < m_Workers.size(); i++)
+				m_Workers[i]->thread = std::thread([this, i]() { Run(i); });
+		}
+
+
+		// Wait until all queued tasks are done and the workers have exited
+		void Stop()
+		{
+			{
+				std::scoped_lock scoped_lock(m_mutexIdle);
+				m_bStop = true;
+			}
+			m_cvIdle.notify_all();
+
+			for (auto& worker : m_Workers)
+			{
+				if (worker->thread.joinable())
+					worker->thread.join();
+			}
+		}
+
+
+		// Queue a task (may be called by any thread)
+		void Submit(Task task)
+		{
+			// A worker keeps its follow-up tasks, everyone else spreads them
+			size_t i = (s_pCurrentPool == this) ? s_nCurrentWorker : m_nNextWorker.fetch_add(1, std::memory_order_relaxed) % m_Workers.size();
+
+			// Counted before it's queued, so the counter can't drop below zero
+			m_nQueued.fetch_add(1, std::memory_order_seq_cst);
+			{
+				Worker& worker = *m_Workers[i];
+				std::scoped_lock scoped_lock(worker.mutex);
+				worker.tasks.push_back(std::move(task));
+			}
+
+			// Wake up a worker, but only if one is sleeping
+			if (m_nSleeping.load(std::memory_order_seq_cst) > 0)
+			{
+				std::scoped_lock scoped_lock(m_mutexIdle);
+				m_cvIdle.notify_one();
+			}
+		}
+
+
+		size_t GetThreadCount() const { return m_Workers.size(); }
+
+
+		// Snapshot of the counters
+		WorkerStats GetStats() const
+		{
+			WorkerStats stats;
+			stats.nThreads = m_Workers.size();
+			stats.nQueuedTasks = m_nQueued.load(std::memory_order_relaxed);
+			for (auto& worker : m_Workers)
+			{
+				stats.nExecutedTasks += worker->nExecuted.load(std::memory_order_relaxed);
+				stats.nStolenTasks += worker->nStolen.load(std::memory_order_relaxed);
+				stats.nBusyNanoseconds += worker->nBusyNanoseconds.load(std::memory_order_relaxed);
+			}
+			stats.nElapsedNanoseconds = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_timeStart).count();
+			return stats;
+		}
+
+
+	private:
+		// A worker's queue and counters, on a cache line of its own
+		struct alignas(64) Worker
+		{
+			std::mutex mutex;
+			std::deque<Task> tasks;
+
+			std::atomic<uint64_t> nExecuted = 0;
+			std::atomic<uint64_t> nStolen = 0;
+			std::atomic<uint64_t> nBusyNanoseconds = 0;
+
+			std::thread thread;
+		};
+
+
+		// Worker thread
+		void Run(size_t iWorker)
+		{
+			s_pCurrentPool = this;
+			s_nCurrentWorker = iWorker;
+			Worker& worker = *m_Workers[iWorker];
+
+			std::optional<Task> task;
+			for (;;)
+			{
+				bool bStolen = false;
+				if (!Pop(iWorker, task, bStolen))
+				{
+					// Nothing to do anywhere, sleep until a task is submitted. The
+					// counter is increased before the queue is checked again, so a
+					// submit either sees it (and wakes us) or we see its task.
+					std::unique_lock lock(m_mutexIdle);
+					m_nSleeping.fetch_add(1, std::memory_order_seq_cst);
+					m_cvIdle.wait(lock, [this]() { return m_nQueued.load(std::memory_order_seq_cst) > 0 || m_bStop; });
+					m_nSleeping.fetch_sub(1, std::memory_order_relaxed);
+
+					// Only exit once everything is done
+					if (m_bStop && m_nQueued.load(std::memory_order_seq_cst) == 0)
+						break;
+					continue;
+				}
+
+				auto timeStart = std::chrono::steady_clock::now();
+				m_Executor(*task);
+				task.reset();
+				auto timeEnd = std::chrono::steady_clock::now();
+
+				worker.nBusyNanoseconds.fetch_add((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(timeEnd - timeStart).count(), std::memory_order_relaxed);
+				worker.nExecuted.fetch_add(1, std::memory_order_relaxed);
+				if (bStolen)
+					worker.nStolen.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			s_pCurrentPool = nullptr;
+		}
+
+
+		// Takes a task from the worker's own queue, or steals one from the others
+		bool Pop(size_t iWorker, std::optional<Task>& task, bool& bStolen)
+		{
+			for (size_t n = 0; n < m_Workers.size(); n++)
+			{
+				Worker& worker = *m_Workers[(iWorker + n) % m_Workers.size()];
+				std::scoped_lock scoped_lock(worker.mutex);
+				if (worker.tasks.empty())
+					continue;
+
+				// Own tasks in order, stolen ones from the other end
+				if (n == 0)
+				{
+					task.emplace(std::move(worker.tasks.front()));
+					worker.tasks.pop_front();
+				}
+				else
+				{
+					task.emplace(std::move(worker.tasks.back()));
+					worker.tasks.pop_back();
+				}
+				bStolen = (n != 0);
+				m_nQueued.fetch_sub(1, std::memory_order_relaxed);
+				return true;
+			}
+			return false;
+		}
+
+
+	private:
+		Executor m_Executor;
+		std::vector<std::unique_ptr<Worker>> m_Workers;
+
+		// Round-robin counter for tasks submitted by other threads
+		std::atomic<size_t> m_nNextWorker = 0;
+
+		// Tasks in all queues, and the idle workers waiting for some
+		std::atomic<size_t> m_nQueued = 0;
+		std::atomic<size_t> m_nSleeping = 0;
+		std::mutex m_mutexIdle;
+		std::condition_variable m_cvIdle;
+		bool m_bStop = false;
+
+		std::chrono::steady_clock::time_point m_timeStart = std::chrono::steady_clock::now();
+
+		// Pool and index of the worker running on this thread
+		static inline thread_local WorkerPool* s_pCurrentPool = nullptr;
+		static inline thread_local size_t s_nCurrentWorker = 0;
+	};
+
+
+} // namespace Net
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#	include <intrin.h>
+#endif
+
+
+namespace Bench {
+
+
+	// Allocations through the global operator new (of all threads), counted
+	// by the replaced operator new in LibNetBench.cpp
+	extern std::atomic<uint64_t> g_nAllocations;
+
+
+	// Handed to a benchmark, which runs its operation GetIterations() times
+	// between Start() and Stop(). Setup and teardown stay outside of them, so
+	// only the operations are timed and their allocations counted.
+	class State
+	{
+	public:
+		explicit State(uint64_t nIterations)
+			: m_nIterations(nIterations)
+		{
+		}
+
+
+	public:
+		uint64_t GetIterations() const { return m_nIterations; }
+
+
+		void Start()
+		{
+			m_nAllocStart = g_nAllocations.load(std::memory_order_relaxed);
+			m_timeStart = std::chrono::steady_clock::now();
+		}
+
+
+		void Stop()
+		{
+			m_Elapsed += std::chrono::steady_clock::now() - m_timeStart;
+			m_nAllocations += g_nAllocations.load(std::memory_order_relaxed) - m_nAllocStart;
+		}
+
+
+		// Bytes processed by one operation, for bytes/s (0 if it doesn't apply)
+		void SetBytesPerOp(uint64_t nBytes) { m_nBytesPerOp = nBytes; }
+
+
+		// The benchmark couldn't run (its results are dropped)
+		void SetError(const std::string& error) { m_Error = error; }
+
+
+		std::chrono::nanoseconds GetElapsed() const { return m_Elapsed; }
+		uint64_t GetAllocations() const { return m_nAllocations; }
+		uint64_t GetBytesPerOp() const { return m_nBytesPerOp; }
+		const std::string& GetError() const { return m_Error; }
+
+
+	private:
+		uint64_t m_nIterations;
+		uint64_t m_nBytesPerOp = 0;
+		std::string m_Error;
+
+		std::chrono::steady_clock::time_point m_timeStart;
+		std::chrono::nanoseconds m_Elapsed{ 0 };
+		uint64_t m_nAllocStart = 0;
+		uint64_t m_nAllocations = 0;
+	};
+
+
+	struct Benchmark
+	{
+		std::string name;
+		std::function<void(State&)> func;
+	};
+
+
+	// All benchmarks, in the order they were added
+	inline std::vector<Benchmark>& GetBenchmarks()
+	{
+		static std::vector<Benchmark> benchmarks;
+		return benchmarks;
+	}
+
+
+	// Adds a benchmark, called by the static initialisers of the Bench*.cpp files
+	inline bool Add(const std::string& name, std::function<void(State&)> func)
+	{
+		GetBenchmarks().push_back({ name, std::move(func) });
+		return true;
+	}
+
+
+	// Keeps the compiler from optimising value (and its computation) away
+	template<typename T>
+	inline void DoNotOptimize(const T& value)
+	{
+#if defined(_MSC_VER)
+		static const volatile void* s_pSink;
+		s_pSink = &value;
+		_ReadWriteBarrier();
+#else
+		asm volatile("" : : "r"(&value) : "memory");
+#endif
+	}
+
+
+} // namespace Bench
@@ -0,0 +1,191 @@
+#include "Bench.h"
+
+#include "Net/NetServer.h"
+#include "Net/NetClient.h"
+
+#include <filesystem>
+
+
+// A client and a server of this process, connected over loopback:
+//   stream   - The client sends as fast as the send queue takes it (see
+//              SendLimits), one operation is one message received by the server
+//   pingpong - The server echoes, one operation is one round trip
+// The server handles its messages on its own thread, the client on the
+// benchmark's thread. Both have one I/O thread.
+
+
+namespace {
+
+
+	// Port of the TCP benchmarks (on 127.0.0.1)
+	constexpr uint16_t PORT = 60100;
+
+
+	enum class Transport
+	{
+		Tcp,
+		Local,
+		SharedMemory,
+	};
+
+
+	class BenchServer : public Net::Server
+	{
+	public:
+		explicit BenchServer(bool bEcho)
+			: m_bEcho(bEcho)
+		{
+		}
+
+
+		void OnMessage(Net::Message& msg) override
+		{
+			m_nReceived++;
+			if (m_bEcho)
+				Send(msg.remote, std::move(msg));
+		}
+
+
+		// Runs until nCount messages have been received
+		void Run(uint64_t nCount)
+		{
+			while (m_nReceived < nCount)
+				Update(-1, true);
+		}
+
+
+	private:
+		bool m_bEcho;
+		uint64_t m_nReceived = 0;
+	};
+
+
+	class BenchClient : public Net::Client
+	{
+	public:
+		void OnMessage(Net::Message& msg) override
+		{
+			m_nReceived++;
+		}
+
+
+	public:
+		uint64_t m_nReceived = 0;
+	};
+
+
+	bool Open(BenchServer& server, BenchClient& client, Transport transport)
+	{
+		if (transport == Transport::Tcp)
+			return server.Start(PORT, "127.0.0.1") && client.Connect("127.0.0.1", PORT);
+
+		if (transport == Transport::SharedMemory)
+		{
+			server.EnableSharedMemory();
+			client.EnableSharedMemory();
+		}
+		std::string path = (std::filesystem::temp_directory_path() / "LibNetBench.sock").string();
+		return server.StartLocal(path) && client.ConnectLocal(path);
+	}
+
+
+	Net::Message MakeMessage(size_t nBodySize)
+	{
+		Net::Message msg;
+		msg.header.type = 1;
+		msg.body.resize(nBodySize);
+		if (nBodySize > 0)
+			std::memset(msg.body.data(), 0x5a, nBodySize);
+		msg.header.size = (uint32_t)nBodySize;
+		return msg;
+	}
+
+
+	void Stream(Bench::State& state, Transport transport, size_t nBodySize)
+	{
+		BenchServer server(false);
+		BenchClient client;
+		if (!Open(server, client, transport))
+		{
+			state.SetError("can't connect");
+			return;
+		}
+
+		uint64_t nCount = state.GetIterations();
+		Net::Message msg = MakeMessage(nBodySize);
+		state.SetBytesPerOp(nBodySize);
+		std::thread receiver([&]() { server.Run(nCount); });
+
+		state.Start();
+		for (uint64_t i = 0; i < nCount; i++)
+		{
+			// A full send queue rejects the message, so wait until it drains
+			while (!client.Send(msg))
+				std::this_thread::yield();
+		}
+		receiver.join();
+		state.Stop();
+
+		client.Disconnect();
+		server.Stop();
+	}
+
+
+	void PingPong(Bench::State& state, Transport transport, size_t nBodySize)
+	{
+		BenchServer server(true);
+		BenchClient client;
+		if (!Open(server, client, transport))
+		{
+			state.SetError("can't connect");
+			return;
+		}
+
+		uint64_t nCount = state.GetIterations();
+		Net::Message msg = MakeMessage(nBodySize);
+		state.SetBytesPerOp(nBodySize);
+		std::thread echo([&]() { server.Run(nCount); });
+
+		state.Start();
+		for (uint64_t i = 0; i < nCount; i++)
+		{
+			client.Send(msg);
+			while (client.m_nReceived <= i)
+				client.Update(-1, true);
+		}
+		state.Stop();
+		echo.join();
+
+		client.Disconnect();
+		server.Stop();
+	}
+
+
+	const bool s_bAdded = []()
+	{
+		std::vector<std::pair<std::string, Transport>> transports = { { "tcp", Transport::Tcp } };
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+		transports.push_back({ "uds", Transport::Local });
+#endif
+#if NETLIB_HAS_SHM
+		transports.push_back({ "shm", Transport::SharedMemory });
+#endif
+
+		for (auto& [name, transport] : transports)
+		{
+			for (size_t nBodySize : { 64, 1024, 16 * 1024, 64 * 1024 })
+			{
+				Bench::Add("loopback/" + name + "/stream/" + std::to_string(nBodySize),
+					[transport, nBodySize](Bench::State& state) { Stream(state, transport, nBodySize); });
+			}
+			for (size_t nBodySize : { 64, 4096 })
+			{
+				Bench::Add("loopback/" + name + "/pingpong/" + std::to_string(nBodySize),
+					[transport, nBodySize](Bench::State& state) { PingPong(state, transport, nBodySize); });
+			}
+		}
+		return true;
+	}();
+
+
+} // namespace
@@ -0,0 +1,162 @@
+#include "Bench.h"
+
+#include "Net/NetMessage.h"
+
+
+// Serialization (operator << and >>) and the checksums of a message
+
+
+namespace {
+
+
+	struct Vector4
+	{
+		float x, y, z, w;
+	};
+
+
+	struct Block64
+	{
+		uint8_t data[64];
+	};
+
+
+	// Values are pushed and pulled in batches, like a message is written and read
+	constexpr uint64_t BATCH = 16;
+
+
+	// One operation pushes a value and pulls it again
+	template<typename DataType>
+	void SerializePod(Bench::State& state)
+	{
+		Net::Message msg;
+		msg.body.reserve(BATCH * (sizeof(DataType) + sizeof(uint32_t)));
+		DataType value{};
+		state.SetBytesPerOp(sizeof(DataType) + sizeof(uint32_t));
+
+		state.Start();
+		for (uint64_t i = 0; i < state.GetIterations(); i += BATCH)
+		{
+			uint64_t nCount = std::min(BATCH, state.GetIterations() - i);
+			for (uint64_t j = 0; j < nCount; j++)
+				msg << value;
+			for (uint64_t j = 0; j < nCount; j++)
+				msg >> value;
+			Bench::DoNotOptimize(value);
+		}
+		state.Stop();
+	}
+
+
+	// One operation pushes a string of nLength characters and pulls it again
+	void SerializeString(Bench::State& state, size_t nLength)
+	{
+		Net::Message msg;
+		msg.body.reserve(BATCH * (nLength + sizeof(uint32_t)));
+		std::string text(nLength, 'x');
+		std::vector<std::string> pulled(BATCH, std::string(nLength, ' '));
+		state.SetBytesPerOp(nLength + sizeof(uint32_t));
+
+		state.Start();
+		for (uint64_t i = 0; i < state.GetIterations(); i += BATCH)
+		{
+			uint64_t nCount = std::min(BATCH, state.GetIterations() - i);
+			for (uint64_t j = 0; j < nCount; j++)
+				msg << text;
+			for (uint64_t j = 0; j < nCount; j++)
+				msg >> pulled[j];
+			Bench::DoNotOptimize(pulled);
+		}
+		state.Stop();
+	}
+
+
+	// One operation builds a new message of nValues uint64_t, with its body
+	// from the default pool, and throws it away
+	void BuildMessage(Bench::State& state, size_t nValues)
+	{
+		state.SetBytesPerOp(nValues * (sizeof(uint64_t) + sizeof(uint32_t)));
+
+		state.Start();
+		for (uint64_t i = 0; i < state.GetIterations(); i++)
+		{
+			Net::Message msg;
+			msg.header.type = 1;
+			for (uint64_t j = 0; j < nValues; j++)
+				msg << j;
+			Bench::DoNotOptimize(msg);
+		}
+		state.Stop();
+	}
+
+
+	Net::Message MakeMessage(size_t nBodySize)
+	{
+		Net::Message msg;
+		msg.header.type = 1;
+		msg.body.resize(nBodySize);
+		if (nBodySize > 0)
+			std::memset(msg.body.data(), 0x5a, nBodySize);
+		msg.header.size = (uint32_t)nBodySize;
+		return msg;
+	}
+
+
+	void UpdateCRC(Bench::State& state, size_t nBodySize)
+	{
+		Net::Message msg = MakeMessage(nBodySize);
+		state.SetBytesPerOp(nBodySize);
+
+		state.Start();
+		for (uint64_t i = 0; i < state.GetIterations(); i++)
+		{
+			msg.UpdateCRC();
+			Bench::DoNotOptimize(msg.header);
+		}
+		state.Stop();
+	}
+
+
+	void IsBodyValid(Bench::State& state, size_t nBodySize)
+	{
+		Net::Message msg = MakeMessage(nBodySize);
+		msg.UpdateCRC();
+		state.SetBytesPerOp(nBodySize);
+
+		bool bValid = true;
+		state.Start();
+		for (uint64_t i = 0; i < state.GetIterations(); i++)
+		{
+			bValid &= msg.IsBodyValid();
+			Bench::DoNotOptimize(bValid);
+		}
+		state.Stop();
+
+		if (!bValid)
+			state.SetError("body not valid");
+	}
+
+
+	const bool s_bAdded = []()
+	{
+		Bench::Add("serialize/pod/uint8", SerializePod<uint8_t>);
+		Bench::Add("serialize/pod/uint64", SerializePod<uint64_t>);
+		Bench::Add("serialize/pod/vector4", SerializePod<Vector4>);
+		Bench::Add("serialize/pod/block64", SerializePod<Block64>);
+
+		for (size_t nLength : { 16, 256, 4096 })
+			Bench::Add("serialize/string/" + std::to_string(nLength), [nLength](Bench::State& state) { SerializeString(state, nLength); });
+
+		for (size_t nValues : { 1, 8, 64 })
+			Bench::Add("serialize/message/" + std::to_string(nValues) + "xuint64", [nValues](Bench::State& state) { BuildMessage(state, nValues); });
+
+		for (size_t nBodySize : { 0, 64, 1024, 16 * 1024, 256 * 1024, 1024 * 1024 })
+		{
+			Bench::Add("crc/update/" + std::to_string(nBodySize), [nBodySize](Bench::State& state) { UpdateCRC(state, nBodySize); });
+			Bench::Add("crc/valid/" + std::to_string(nBodySize), [nBodySize](Bench::State& state) { IsBodyValid(state, nBodySize); });
+		}
+		return true;
+	}();
+
+
+} // namespace
@@ -0,0 +1,71 @@
+#include "Bench.h"
+
+#include "Net/NetMsgQueue.h"
+#include "Net/NetMsgQueueMPSC.h"
+
+
+// The incoming queues: nProducers threads push messages (like the I/O threads
+// of a server), one consumer takes them (like Update). One operation is one
+// message through the queue.
+
+
+namespace {
+
+
+	template<typename Queue>
+	void PushDrain(Bench::State& state, size_t nProducers)
+	{
+		Queue queue;
+		uint64_t nTotal = state.GetIterations();
+
+		// The producers are started before the clock, and wait for the go
+		std::atomic<bool> bGo = false;
+		std::vector<std::thread> producers;
+		for (size_t p = 0; p < nProducers; p++)
+		{
+			uint64_t nCount = nTotal / nProducers + (p < nTotal % nProducers ? 1 : 0);
+			producers.emplace_back([&queue, &bGo, nCount]()
+			{
+				Net::Message msg;
+				msg.header.type = 1;
+				bGo.wait(false);
+				for (uint64_t i = 0; i < nCount; i++)
+					queue.PushBack(msg);
+			});
+		}
+
+		std::pmr::deque<Net::Message> messages(&Net::BufferPool::GetDefault());
+		uint64_t nReceived = 0;
+
+		state.Start();
+		bGo = true;
+		bGo.notify_all();
+		while (nReceived < nTotal)
+		{
+			queue.Wait();
+			queue.Drain(messages);
+			nReceived += messages.size();
+			messages.clear();
+		}
+		state.Stop();
+
+		for (auto& producer : producers)
+			producer.join();
+	}
+
+
+	const bool s_bAdded = []()
+	{
+		// 1, 2, 4... up to the number of cores (at least 4)
+		size_t nMaxProducers = std::max<size_t>(std::thread::hardware_concurrency(), 4);
+		for (size_t nProducers = 1; nProducers <= nMaxProducers; nProducers *= 2)
+		{
+			std::string producers = std::to_string(nProducers);
+			Bench::Add("queue/MsgQueueMPSC/producers=" + producers, [nProducers](Bench::State& state) { PushDrain<Net::MsgQueueMPSC>(state, nProducers); });
+			Bench::Add("queue/MsgQueue/producers=" + producers, [nProducers](Bench::State& state) { PushDrain<Net::MsgQueue>(state, nProducers); });
+		}
+		return true;
+	}();
+
+
+} // namespace
@@ -0,0 +1,215 @@
+#include "Bench.h"
+
+#include "Net/NetCommon.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+
+// Microbenchmarks of LibNet. Every benchmark is written as one line of JSON
+// to stdout, so runs of two builds can be compared line by line:
+//
+//   {"name":"crc/update/16384","iterations":262144,"repeats":3,"ns_per_op":1021.4,
+//    "ns_per_op_min":1018.2,"allocs_per_op":0,"bytes_per_op":16384,"bytes_per_s":1.604e+10}
+//
+// ns_per_op is the median of the repeats. The first line describes the build.
+// The library's own output (std::cout) is dropped while the benchmarks run.
+//
+// Usage: LibNetBench [--filter <text>] [--min-time <ms>] [--repeat <n>] [--list] [--verbose]
+
+
+// Count every allocation, the other forms of operator new and delete
+// forward to these by default
+std::atomic<uint64_t> Bench::g_nAllocations = 0;
+
+void* operator new(std::size_t nSize)
+{
+	Bench::g_nAllocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = std::malloc(nSize ? nSize : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+
+void* operator new(std::size_t nSize, std::align_val_t alignment)
+{
+	Bench::g_nAllocations.fetch_add(1, std::memory_order_relaxed);
+	size_t nAlign = (size_t)alignment;
+	nSize = (std::max<size_t>(nSize, 1) + nAlign - 1) / nAlign * nAlign;
+#if defined(_MSC_VER)
+	if (void* p = _aligned_malloc(nSize, nAlign))
+		return p;
+#else
+	if (void* p = std::aligned_alloc(nAlign, nSize))
+		return p;
+#endif
+	throw std::bad_alloc();
+}
+
+
+void operator delete(void* p, std::align_val_t) noexcept
+{
+#if defined(_MSC_VER)
+	_aligned_free(p);
+#else
+	std::free(p);
+#endif
+}
+
+
+struct Options
+{
+	std::string filter;
+	std::chrono::milliseconds minTime{ 200 };
+	size_t nRepeats = 3;
+	bool bList = false;
+	bool bVerbose = false;
+};
+
+
+struct Result
+{
+	uint64_t nIterations = 0;
+	double nsPerOp = 0;
+	double nsPerOpMin = 0;
+	double allocsPerOp = 0;
+	uint64_t nBytesPerOp = 0;
+	std::string error;
+};
+
+
+static Result Measure(const Bench::Benchmark& bench, const Options& options)
+{
+	Result result;
+
+	// Grow the iterations until a run takes about the minimum time
+	uint64_t nIterations = 1;
+	while (true)
+	{
+		Bench::State state(nIterations);
+		bench.func(state);
+		if (!state.GetError().empty())
+		{
+			result.error = state.GetError();
+			return result;
+		}
+
+		auto elapsed = std::max(state.GetElapsed(), std::chrono::nanoseconds(1000));
+		if (elapsed >= options.minTime)
+			break;
+
+		double scale = (double)std::chrono::nanoseconds(options.minTime).count() / elapsed.count() * 1.2;
+		nIterations = (uint64_t)(nIterations * std::clamp(scale, 2.0, 100.0));
+	}
+
+	// The repeats are all run with the same number of iterations
+	std::vector<Bench::State> states;
+	for (size_t i = 0; i < std::max<size_t>(options.nRepeats, 1); i++)
+	{
+		states.emplace_back(nIterations);
+		bench.func(states.back());
+		if (!states.back().GetError().empty())
+		{
+			result.error = states.back().GetError();
+			return result;
+		}
+	}
+
+	std::sort(states.begin(), states.end(), [](const Bench::State& a, const Bench::State& b) { return a.GetElapsed() < b.GetElapsed(); });
+	const Bench::State& median = states[states.size() / 2];
+
+	result.nIterations = nIterations;
+	result.nsPerOp = (double)median.GetElapsed().count() / nIterations;
+	result.nsPerOpMin = (double)states.front().GetElapsed().count() / nIterations;
+	result.allocsPerOp = (double)median.GetAllocations() / nIterations;
+	result.nBytesPerOp = median.GetBytesPerOp();
+	return result;
+}
+
+
+static void PrintContext(const Options& options)
+{
+#if defined(HE_BUILD_RELEASE)
+	const char* build = "release";
+#elif defined(HE_BUILD_DEBUG)
+	const char* build = "debug";
+#else
+	const char* build = "unknown";
+#endif
+	std::printf("{\"context\":{\"build\":\"%s\",\"threads\":%u,\"lockfree_incoming\":%d,\"io_uring\":%d,\"tls\":%d,\"min_time_ms\":%lld,\"repeats\":%zu}}\n",
+		build, std::thread::hardware_concurrency(), (int)NETLIB_LOCKFREE_INCOMING, (int)NETLIB_IO_URING, (int)NETLIB_TLS,
+		(long long)options.minTime.count(), options.nRepeats);
+}
+
+
+static void PrintResult(const std::string& name, const Result& result, const Options& options)
+{
+	if (!result.error.empty())
+	{
+		std::printf("{\"name\":\"%s\",\"error\":\"%s\"}\n", name.c_str(), result.error.c_str());
+		return;
+	}
+
+	double bytesPerSecond = result.nsPerOp > 0 ? result.nBytesPerOp * 1e9 / result.nsPerOp : 0;
+	std::printf("{\"name\":\"%s\",\"iterations\":%llu,\"repeats\":%zu,\"ns_per_op\":%.1f,\"ns_per_op_min\":%.1f,\"allocs_per_op\":%.3f,\"bytes_per_op\":%llu,\"bytes_per_s\":%.4g}\n",
+		name.c_str(), (unsigned long long)result.nIterations, options.nRepeats, result.nsPerOp, result.nsPerOpMin,
+		result.allocsPerOp, (unsigned long long)result.nBytesPerOp, bytesPerSecond);
+}
+
+
+int main(int argc, char** argv)
+{
+	Options options;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--filter" && i + 1 < argc)
+			options.filter = argv[++i];
+		else if (arg == "--min-time" && i + 1 < argc)
+			options.minTime = std::chrono::milliseconds(std::atoll(argv[++i]));
+		else if (arg == "--repeat" && i + 1 < argc)
+			options.nRepeats = std::max(std::atoi(argv[++i]), 1);
+		else if (arg == "--list")
+			options.bList = true;
+		else if (arg == "--verbose")
+			options.bVerbose = true;
+		else
+		{
+			std::cerr << "Usage: " << argv[0] << " [--filter <text>] [--min-time <ms>] [--repeat <n>] [--list] [--verbose]" << std::endl;
+			return -1;
+		}
+	}
+
+	if (!options.bList)
+		PrintContext(options);
+
+	for (const Bench::Benchmark& bench : Bench::GetBenchmarks())
+	{
+		if (bench.name.find(options.filter) == std::string::npos)
+			continue;
+		if (options.bList)
+		{
+			std::printf("%s\n", bench.name.c_str());
+			continue;
+		}
+
+		// Keep the library's messages out of the results
+		std::streambuf* pCout = std::cout.rdbuf();
+		if (!options.bVerbose)
+			std::cout.rdbuf(nullptr);
+		Result result = Measure(bench, options);
+		std::cout.rdbuf(pCout);
+
+		PrintResult(bench.name, result, options);
+		std::fflush(stdout);
+	}
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+
+// Histogram of latencies (in ns) with log-linear buckets: Every power of two
+// is split into 32 buckets, so a value is kept with a precision of ~3%, from
+// 1 ns up to 2^40 ns (~18 minutes, larger values end up in the last bucket).
+// Histograms of several threads are merged by adding them up.
+class Histogram
+{
+public:
+	static constexpr int SUB_BITS = 5;
+	static constexpr uint64_t SUB_COUNT = 1 << SUB_BITS;
+	static constexpr int MAX_BITS = 40;
+	static constexpr size_t BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_COUNT;
+
+
+public:
+	void Record(uint64_t nValue)
+	{
+		m_vCounts[GetBucket(nValue)]++;
+		m_nCount++;
+		m_nMin = std::min(m_nMin, nValue);
+		m_nMax = std::max(m_nMax, nValue);
+	}
+
+
+	void Merge(const Histogram& other)
+	{
+		for (size_t i = 0; i < BUCKETS; i++)
+			m_vCounts[i] += other.m_vCounts[i];
+		m_nCount += other.m_nCount;
+		m_nMin = std::min(m_nMin, other.m_nMin);
+		m_nMax = std::max(m_nMax, other.m_nMax);
+	}
+
+
+	void Clear()
+	{
+		*this = Histogram();
+	}
+
+
+	uint64_t GetCount() const { return m_nCount; }
+	uint64_t GetMin() const { return m_nCount ? m_nMin : 0; }
+	uint64_t GetMax() const { return m_nMax; }
+
+
+	// Value which fPercentile percent of the values are at or below (the top
+	// of its bucket, but never more than the largest value)
+	uint64_t GetPercentile(double fPercentile) const
+	{
+		if (m_nCount == 0)
+			return 0;
+
+		uint64_t nRank = std::max<uint64_t>((uint64_t)std::ceil(fPercentile / 100.0 * m_nCount), 1);
+		uint64_t nSum = 0;
+		for (size_t i = 0; i < BUCKETS; i++)
+		{
+			nSum += m_vCounts[i];
+			if (nSum >= nRank)
+				return std::min(GetBucketTop(i), m_nMax);
+		}
+		return m_nMax;
+	}
+
+
+	// Number of values in [nFrom, nTo), exact if both are powers of two
+	uint64_t GetCountBetween(uint64_t nFrom, uint64_t nTo) const
+	{
+		uint64_t nSum = 0;
+		for (size_t i = GetBucket(nFrom); i < BUCKETS && GetBucketTop(i) < nTo; i++)
+			nSum += m_vCounts[i];
+		return nSum;
+	}
+
+
+private:
+	static size_t GetBucket(uint64_t nValue)
+	{
+		// The smallest values have a bucket each
+		if (nValue < SUB_COUNT)
+			return (size_t)nValue;
+
+		// The top SUB_BITS bits below the highest one pick the bucket in its power of two
+		int nShift = (int)std::bit_width(nValue) - 1 - SUB_BITS;
+		size_t i = (size_t)(nShift + 1) * SUB_COUNT + (size_t)((nValue >> nShift) - SUB_COUNT);
+		return std::min(i, BUCKETS - 1);
+	}
+
+
+	static uint64_t GetBucketTop(size_t i)
+	{
+		if (i < SUB_COUNT)
+			return i;
+		if (i == BUCKETS - 1)
+			return std::numeric_limits<uint64_t>::max();
+
+		int nShift = (int)(i / SUB_COUNT) - 1;
+		uint64_t nSub = i % SUB_COUNT + SUB_COUNT;
+		return ((nSub + 1) << nShift) - 1;
+	}
+
+
+private:
+	std::array<uint64_t, BUCKETS> m_vCounts{};
+	uint64_t m_nCount = 0;
+	uint64_t m_nMin = std::numeric_limits<uint64_t>::max();
+	uint64_t m_nMax = 0;
+};
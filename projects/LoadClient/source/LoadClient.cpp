@@ -0,0 +1,737 @@
+#include "Net/NetConnection.h"
+#include "Net/NetContextPool.h"
+#include "Net/NetMessageRegistry.h"
+#include "Net/NetMsgQueue.h"
+
+#include "Histogram.h"
+
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <unordered_map>
+
+#if defined(__linux__)
+#	include <sys/resource.h>
+#endif
+
+
+// Headless load generator for TestServer, or any LibNet server which bounces
+// ServerPing messages back and answers MessageAll with a ServerMessage to all
+// other clients (like TestServer, run it with --quiet).
+//
+// It opens many connections, which are run by a few I/O threads (a ContextPool,
+// like the server's), and split over the same number of driver threads. Every
+// connection gets one kind of traffic:
+//   pingpong  - keeps --depth pings in flight, the next one goes out when a reply arrives
+//   fire      - sends --rate pings per second, without waiting for the replies
+//   broadcast - sends --broadcast-rate MessageAll per second (every one of them
+//               makes the server send a message to all other clients)
+// The round trip times of the pings are reported every --interval seconds, and
+// for the whole run (after --warmup) with a histogram.
+//
+//   LoadClient --connections 2000 --threads 2 --mix pingpong=80,fire=15,broadcast=5 --size 64=90,4096=10
+
+
+enum MsgTypes : uint32_t
+{
+	None = 0,      // not allowed!
+
+	ServerAccept,  // server -> client
+	ServerDeny,    // server -> client
+	ServerPing,    // bidirectional
+	MessageAll,    // client -> server
+	ServerMessage, // server -> client
+
+	Uninitialized = ((uint32_t)~((uint32_t)0))
+};
+
+
+// Messages handled by the load client
+struct ServerAcceptMsg
+{
+	static constexpr uint32_t TYPE = MsgTypes::ServerAccept;
+};
+
+struct ServerDenyMsg
+{
+	static constexpr uint32_t TYPE = MsgTypes::ServerDeny;
+};
+
+struct ServerPingMsg
+{
+	static constexpr uint32_t TYPE = MsgTypes::ServerPing;
+	std::chrono::system_clock::time_point timeSent;
+	// Filler, which makes the ping as large as wanted
+	std::vector<uint8_t> payload;
+	auto Fields() { return std::tie(timeSent, payload); }
+};
+
+struct MessageAllMsg
+{
+	static constexpr uint32_t TYPE = MsgTypes::MessageAll;
+};
+
+struct ServerMessageMsg
+{
+	static constexpr uint32_t TYPE = MsgTypes::ServerMessage;
+	uint64_t clientID;
+};
+
+
+// Never sent, it's queued locally to wake up a driver (see Driver::ASYNC_Tick)
+constexpr uint32_t LOCAL_TICK = MsgTypes::None;
+
+
+enum class Traffic
+{
+	PingPong,
+	Fire,
+	Broadcast,
+	Count
+};
+
+const char* TRAFFIC_NAMES[] = { "pingpong", "fire", "broadcast" };
+
+
+struct Options
+{
+	std::string host = "127.0.0.1";
+	uint16_t port = 60000;
+	size_t nConnections = 1000;
+	size_t nThreads = 2;
+	double fConnectRate = 1000;
+	double fDuration = 10;
+	double fWarmup = 2;
+	double fInterval = 1;
+	// Weights of the kinds of traffic, and of the ping sizes (body bytes)
+	std::array<double, (size_t)Traffic::Count> vMix = { 1, 0, 0 };
+	std::vector<std::pair<size_t, double>> vSizes = { { 64, 1 } };
+	size_t nDepth = 1;
+	double fRate = 100;
+	double fBroadcastRate = 1;
+	bool bVerbose = false;
+};
+
+
+// What the drivers have counted since the stats were taken the last time
+struct Stats
+{
+	uint64_t nSent = 0;
+	uint64_t nSentBytes = 0;
+	uint64_t nReceived = 0;
+	uint64_t nReceivedBytes = 0;
+	uint64_t nRejected = 0;
+	uint64_t nDisconnected = 0;
+	// Round trip times of the pings (pingpong and fire)
+	std::array<Histogram, 2> vLatency;
+
+
+	void Merge(const Stats& other)
+	{
+		nSent += other.nSent;
+		nSentBytes += other.nSentBytes;
+		nReceived += other.nReceived;
+		nReceivedBytes += other.nReceivedBytes;
+		nRejected += other.nRejected;
+		nDisconnected += other.nDisconnected;
+		for (size_t i = 0; i < vLatency.size(); i++)
+			vLatency[i].Merge(other.vLatency[i]);
+	}
+};
+
+
+// Runs the traffic of its share of the connections on its own thread: It
+// handles their incoming messages, and sends what is due on every tick.
+class Driver
+{
+public:
+	Driver(const Options& options, Net::ContextPool& pool, uint32_t nSeed)
+		: m_Options(options), m_Pool(pool), m_Random(nSeed), m_Ticker(pool.GetPrimaryContext())
+	{
+		// A ping for every size, only its time is changed when it's sent
+		std::vector<double> vWeights;
+		for (auto& [nSize, fWeight] : options.vSizes)
+		{
+			ServerPingMsg ping;
+			ping.payload.resize(nSize > PING_MIN_SIZE ? nSize - PING_MIN_SIZE : 0);
+			m_vPings.push_back(std::move(ping));
+			vWeights.push_back(fWeight);
+		}
+		m_PingSize = std::discrete_distribution<size_t>(vWeights.begin(), vWeights.end());
+	}
+
+
+	Driver(const Driver&) = delete; // no copy constructor
+
+
+	~Driver()
+	{
+		Stop();
+		m_MessagesIn.Clear();
+	}
+
+
+public:
+	// Open a connection to one of endpoints, must be called before Start
+	void Connect(const std::vector<Net::StreamProtocol::endpoint>& endpoints, Traffic traffic)
+	{
+		asio::io_context& context = m_Pool.GetNextContext();
+		auto connection = std::make_shared<Net::Connection>(false, context, asio::ip::tcp::socket(context), m_MessagesIn, m_Options.port);
+
+		Peer& peer = m_Peers.try_emplace(connection.get()).first->second;
+		peer.connection = connection;
+		peer.traffic = traffic;
+
+		connection->ConnectToServer(endpoints,
+			[this, connection, &peer](std::error_code ec)
+			{
+				if (ec)
+				{
+					peer.bFailed = true;
+					m_nFailed++;
+					connection->Disconnect();
+				}
+				else
+				{
+					m_nConnected++;
+				}
+			});
+	}
+
+
+	// Start the traffic
+	void Start()
+	{
+		m_bRun = true;
+		m_Thread = std::thread([this]() { Run(); });
+		asio::post(m_Ticker.get_executor(), [this]() { ASYNC_Tick(); });
+	}
+
+
+	void Stop()
+	{
+		if (!m_bRun.exchange(false))
+			return;
+
+		// Wake up the thread, in case it's waiting
+		Net::Message msg;
+		msg.header.type = LOCAL_TICK;
+		m_MessagesIn.PushBack(std::move(msg));
+		m_Thread.join();
+	}
+
+
+	void Disconnect()
+	{
+		for (auto& [pConnection, peer] : m_Peers)
+			peer.connection->Disconnect();
+	}
+
+
+	size_t GetConnected() const { return m_nConnected; }
+	size_t GetFailed() const { return m_nFailed; }
+
+
+	// Returns the stats since the last call
+	Stats TakeStats()
+	{
+		std::scoped_lock scoped_lock(m_mutexStats);
+		return std::exchange(m_Stats, Stats());
+	}
+
+
+public:
+	// Message handlers (see m_Dispatcher)
+	void On(const ServerAcceptMsg& msg, Net::Connection& server)
+	{
+	}
+
+
+	void On(const ServerDenyMsg& msg, Net::Connection& server)
+	{
+		std::cerr << "Server denied a connection" << std::endl;
+	}
+
+
+	void On(const ServerPingMsg& msg, Net::Connection& server)
+	{
+		auto rtt = std::chrono::system_clock::now() - msg.timeSent;
+		Peer& peer = m_Peers.at(&server);
+		m_Stats.vLatency[peer.traffic == Traffic::PingPong ? 0 : 1].Record(std::max<int64_t>(std::chrono::nanoseconds(rtt).count(), 0));
+
+		if (peer.traffic == Traffic::PingPong && peer.bAlive)
+			SendPing(peer);
+	}
+
+
+	void On(const ServerMessageMsg& msg, Net::Connection& server)
+	{
+	}
+
+
+	void OnRejected(Net::Message& msg)
+	{
+		std::cerr << "Unknown message type: " << msg.header.type << std::endl;
+	}
+
+
+private:
+	struct Peer
+	{
+		std::shared_ptr<Net::Connection> connection;
+		Traffic traffic = Traffic::PingPong;
+		bool bAlive = true;
+		// Set by the I/O thread if connecting failed (its disconnect isn't a lost connection)
+		std::atomic<bool> bFailed = false;
+		// When the next message of fire and broadcast traffic is due
+		std::chrono::steady_clock::time_point timeNext;
+	};
+
+
+	// Body size of a ping without payload: its time, and the payload's count
+	static constexpr size_t PING_MIN_SIZE = sizeof(std::chrono::system_clock::time_point) + sizeof(uint32_t);
+
+
+	void Run()
+	{
+		// The pingpong connections are started with their pings in flight,
+		// the others at a random point of their first period
+		auto timeNow = std::chrono::steady_clock::now();
+		std::uniform_real_distribution<double> phase(0.0, 1.0);
+		{
+			std::scoped_lock scoped_lock(m_mutexStats);
+			for (auto& [pConnection, peer] : m_Peers)
+			{
+				peer.bAlive = !peer.bFailed;
+				if (!peer.bAlive)
+					continue;
+				if (peer.traffic == Traffic::PingPong)
+				{
+					for (size_t i = 0; i < m_Options.nDepth; i++)
+						SendPing(peer);
+				}
+				else
+				{
+					peer.timeNext = timeNow + std::chrono::duration_cast<std::chrono::steady_clock::duration>(GetPeriod(peer) * phase(m_Random));
+				}
+			}
+		}
+
+		while (m_bRun)
+		{
+			m_MessagesIn.Wait();
+			m_MessagesIn.Drain(m_MessagesPending);
+
+			std::scoped_lock scoped_lock(m_mutexStats);
+			bool bTick = false;
+			for (Net::Message& msg : m_MessagesPending)
+			{
+				if (msg.header.type == LOCAL_TICK)
+				{
+					bTick = true;
+				}
+				else if (Net::IsControlMessage(msg.header.type))
+				{
+					Peer& peer = m_Peers.at(msg.remote.get());
+					if (msg.header.type == (uint32_t)Net::ControlMsg::Disconnected && peer.bAlive)
+					{
+						peer.bAlive = false;
+						if (!peer.bFailed)
+							m_Stats.nDisconnected++;
+					}
+				}
+				else
+				{
+					m_Stats.nReceived++;
+					m_Stats.nReceivedBytes += sizeof(Net::message_header) + msg.body.size();
+					m_Dispatcher.Dispatch(msg);
+				}
+			}
+			m_MessagesPending.clear();
+
+			if (bTick)
+				SendDue();
+		}
+	}
+
+
+	// Send the fire and broadcast messages which are due
+	void SendDue()
+	{
+		auto timeNow = std::chrono::steady_clock::now();
+		for (auto& [pConnection, peer] : m_Peers)
+		{
+			if (peer.traffic == Traffic::PingPong || !peer.bAlive)
+				continue;
+
+			// After a stall, the missed messages aren't sent in one burst
+			auto period = GetPeriod(peer);
+			if (timeNow - peer.timeNext > std::chrono::milliseconds(100))
+				peer.timeNext = timeNow;
+
+			for (; peer.timeNext <= timeNow; peer.timeNext += period)
+			{
+				if (peer.traffic == Traffic::Fire)
+					SendPing(peer);
+				else
+					Send(peer, Net::Encode(MessageAllMsg{}));
+			}
+		}
+	}
+
+
+	void SendPing(Peer& peer)
+	{
+		ServerPingMsg& ping = m_vPings[m_PingSize(m_Random)];
+		ping.timeSent = std::chrono::system_clock::now();
+		Net::Message msg;
+		Net::MessageCodec<ServerPingMsg>::Encode(msg, ping);
+		Send(peer, std::move(msg));
+	}
+
+
+	void Send(Peer& peer, Net::Message&& msg)
+	{
+		size_t nBytes = sizeof(Net::message_header) + msg.body.size();
+		if (peer.connection->Send(std::move(msg)))
+		{
+			m_Stats.nSent++;
+			m_Stats.nSentBytes += nBytes;
+		}
+		else
+		{
+			m_Stats.nRejected++;
+		}
+	}
+
+
+	std::chrono::steady_clock::duration GetPeriod(const Peer& peer) const
+	{
+		double fRate = (peer.traffic == Traffic::Fire) ? m_Options.fRate : m_Options.fBroadcastRate;
+		return std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / std::max(fRate, 1e-3)));
+	}
+
+
+	// ASYNC - Queue a tick every millisecond, which wakes up the thread to send
+	// what is due (it's waiting for incoming messages otherwise)
+	void ASYNC_Tick()
+	{
+		if (!m_bRun)
+			return;
+
+		Net::Message msg;
+		msg.header.type = LOCAL_TICK;
+		m_MessagesIn.PushBack(std::move(msg));
+
+		m_Ticker.expires_after(std::chrono::milliseconds(1));
+		m_Ticker.async_wait(
+			[this](std::error_code ec)
+			{
+				if (!ec)
+					ASYNC_Tick();
+			});
+	}
+
+
+private:
+	const Options& m_Options;
+	Net::ContextPool& m_Pool;
+
+	// Connections of this driver, which is only changed before Start
+	std::unordered_map<Net::Connection*, Peer> m_Peers;
+	std::atomic<size_t> m_nConnected = 0;
+	std::atomic<size_t> m_nFailed = 0;
+
+	Net::MsgQueueIn m_MessagesIn;
+	std::pmr::deque<Net::Message> m_MessagesPending{ &Net::BufferPool::GetDefault() };
+	Net::MessageDispatcher<Driver, ServerAcceptMsg, ServerDenyMsg, ServerPingMsg, ServerMessageMsg> m_Dispatcher{ *this };
+
+	std::vector<ServerPingMsg> m_vPings;
+	std::discrete_distribution<size_t> m_PingSize;
+	std::mt19937 m_Random;
+
+	asio::steady_timer m_Ticker;
+	std::thread m_Thread;
+	std::atomic<bool> m_bRun = false;
+
+	// Taken by the main thread, so it's only changed with the mutex held
+	Stats m_Stats;
+	std::mutex m_mutexStats;
+};
+
+
+static bool ParseWeights(const std::string& text, std::function<bool(const std::string& name, double fWeight)> add)
+{
+	// name=weight,name=weight... (the weight is 1 if it's left out)
+	size_t nStart = 0;
+	while (nStart <= text.size())
+	{
+		size_t nEnd = std::min(text.find(',', nStart), text.size());
+		std::string item = text.substr(nStart, nEnd - nStart);
+		size_t nEqual = item.find('=');
+		double fWeight = (nEqual == std::string::npos) ? 1.0 : std::atof(item.c_str() + nEqual + 1);
+		if (item.empty() || fWeight < 0 || !add(item.substr(0, nEqual), fWeight))
+			return false;
+		nStart = nEnd + 1;
+	}
+	return true;
+}
+
+
+static bool ParseOptions(int argc, char** argv, Options& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		const char* value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+		if (arg == "--verbose")
+		{
+			options.bVerbose = true;
+			continue;
+		}
+		if (!value)
+			return false;
+		i++;
+
+		if (arg == "--host")
+			options.host = value;
+		else if (arg == "--port")
+			options.port = (uint16_t)std::atoi(value);
+		else if (arg == "--connections")
+			options.nConnections = std::max(std::atoll(value), 1ll);
+		else if (arg == "--threads")
+			options.nThreads = std::max(std::atoll(value), 1ll);
+		else if (arg == "--connect-rate")
+			options.fConnectRate = std::max(std::atof(value), 1.0);
+		else if (arg == "--duration")
+			options.fDuration = std::atof(value);
+		else if (arg == "--warmup")
+			options.fWarmup = std::atof(value);
+		else if (arg == "--interval")
+			options.fInterval = std::max(std::atof(value), 0.1);
+		else if (arg == "--depth")
+			options.nDepth = std::max(std::atoll(value), 1ll);
+		else if (arg == "--rate")
+			options.fRate = std::atof(value);
+		else if (arg == "--broadcast-rate")
+			options.fBroadcastRate = std::atof(value);
+		else if (arg == "--mix")
+		{
+			options.vMix = {};
+			bool bValid = ParseWeights(value,
+				[&options](const std::string& name, double fWeight)
+				{
+					for (size_t t = 0; t < (size_t)Traffic::Count; t++)
+					{
+						if (name == TRAFFIC_NAMES[t])
+						{
+							options.vMix[t] = fWeight;
+							return true;
+						}
+					}
+					return false;
+				});
+			if (!bValid || options.vMix[0] + options.vMix[1] + options.vMix[2] <= 0)
+				return false;
+		}
+		else if (arg == "--size")
+		{
+			options.vSizes.clear();
+			if (!ParseWeights(value, [&options](const std::string& name, double fWeight) { options.vSizes.push_back({ std::atoll(name.c_str()), fWeight }); return true; }))
+				return false;
+		}
+		else
+			return false;
+	}
+	return true;
+}
+
+
+static void PrintUsage(const char* name)
+{
+	std::cerr << "Usage: " << name << " [options]\n"
+		"  --host <host>            server (127.0.0.1)\n"
+		"  --port <port>            server port (60000)\n"
+		"  --connections <n>        connections to open (1000)\n"
+		"  --threads <n>            I/O threads, and as many driver threads (2)\n"
+		"  --connect-rate <n>       connections opened per second (1000)\n"
+		"  --duration <s>           measured time, after the warmup (10)\n"
+		"  --warmup <s>             time before measuring (2)\n"
+		"  --interval <s>           time between the reports (1)\n"
+		"  --mix <kind=weight,..>   traffic of the connections: pingpong, fire, broadcast (pingpong)\n"
+		"  --size <bytes=weight,..> body sizes of the pings, 12 bytes at least (64)\n"
+		"  --depth <n>              pings in flight per pingpong connection (1)\n"
+		"  --rate <n>               pings per second per fire connection (100)\n"
+		"  --broadcast-rate <n>     MessageAll per second per broadcast connection (1)\n"
+		"  --verbose                show the library's messages" << std::endl;
+}
+
+
+static void PrintLatency(const char* name, const Histogram& histogram)
+{
+	if (histogram.GetCount() == 0)
+		return;
+	std::printf(" | %s p50 %.1f p99 %.1f p99.9 %.1f us", name,
+		histogram.GetPercentile(50) / 1e3, histogram.GetPercentile(99) / 1e3, histogram.GetPercentile(99.9) / 1e3);
+}
+
+
+static void PrintHistogram(const char* name, const Histogram& histogram)
+{
+	if (histogram.GetCount() == 0)
+		return;
+
+	std::printf("\n%s round trip (%llu pings):\n", name, (unsigned long long)histogram.GetCount());
+	std::printf("  min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  p99.99 %.1f  max %.1f us\n",
+		histogram.GetMin() / 1e3, histogram.GetPercentile(50) / 1e3, histogram.GetPercentile(90) / 1e3, histogram.GetPercentile(99) / 1e3,
+		histogram.GetPercentile(99.9) / 1e3, histogram.GetPercentile(99.99) / 1e3, histogram.GetMax() / 1e3);
+
+	// One row per power of two, from the minimum to the maximum
+	uint64_t nFrom = std::bit_floor(std::max<uint64_t>(histogram.GetMin(), Histogram::SUB_COUNT));
+	for (; nFrom <= histogram.GetMax(); nFrom *= 2)
+	{
+		uint64_t nCount = histogram.GetCountBetween(nFrom, nFrom * 2);
+		double fShare = (double)nCount / histogram.GetCount();
+		std::printf("  %9.1f - %9.1f us %7.3f%% |%s\n", nFrom / 1e3, nFrom * 2 / 1e3, fShare * 100, std::string((size_t)std::ceil(fShare * 50), '#').c_str());
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	Options options;
+	if (!ParseOptions(argc, argv, options))
+	{
+		PrintUsage(argv[0]);
+		return -1;
+	}
+
+#if defined(__linux__)
+	// Every connection is a file descriptor
+	rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+#endif
+
+	// The library reports every connection, which isn't of interest here
+	std::streambuf* pCout = std::cout.rdbuf();
+	if (!options.bVerbose)
+		std::cout.rdbuf(nullptr);
+
+	std::vector<Net::StreamProtocol::endpoint> endpoints;
+	Net::ContextPool pool(options.nThreads, Net::ContextPool::Mode::ContextPerThread);
+	try
+	{
+		asio::ip::tcp::resolver resolver(pool.GetPrimaryContext());
+		for (const auto& result : resolver.resolve(options.host, std::to_string(options.port)))
+			endpoints.emplace_back(result.endpoint());
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << "Resolve error: " << e.what() << std::endl;
+		return -1;
+	}
+
+	std::vector<std::unique_ptr<Driver>> drivers;
+	for (size_t i = 0; i < options.nThreads; i++)
+		drivers.push_back(std::make_unique<Driver>(options, pool, (uint32_t)i + 1));
+
+	// Open the connections at the connect rate, with their traffic spread by the mix
+	pool.Start();
+	auto timeStart = std::chrono::steady_clock::now();
+	std::mt19937 random(0);
+	std::discrete_distribution<size_t> mix(options.vMix.begin(), options.vMix.end());
+	for (size_t i = 0; i < options.nConnections; i++)
+	{
+		std::this_thread::sleep_until(timeStart + std::chrono::duration<double>(i / options.fConnectRate));
+		drivers[i % drivers.size()]->Connect(endpoints, (Traffic)mix(random));
+	}
+
+	size_t nConnected = 0, nFailed = 0;
+	auto timeLimit = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+	while (nConnected + nFailed < options.nConnections && std::chrono::steady_clock::now() < timeLimit)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		nConnected = nFailed = 0;
+		for (auto& driver : drivers)
+		{
+			nConnected += driver->GetConnected();
+			nFailed += driver->GetFailed();
+		}
+	}
+	std::printf("%zu connections (%zu failed) to %s:%u in %.2f s, %zu I/O + %zu driver threads (%s)\n",
+		nConnected, nFailed, options.host.c_str(), options.port,
+		std::chrono::duration<double>(std::chrono::steady_clock::now() - timeStart).count(),
+		options.nThreads, options.nThreads, Net::ContextPool::GetBackendName());
+	if (nConnected == 0)
+	{
+		pool.Stop();
+		return -1;
+	}
+
+	// Run the traffic, reporting every interval
+	for (auto& driver : drivers)
+		driver->Start();
+
+	// The intervals are cut at the end of the warmup, so they are either in or out
+	Stats total;
+	double fTotalSeconds = 0;
+	auto timeTraffic = std::chrono::steady_clock::now();
+	auto timeWarm = timeTraffic + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(options.fWarmup));
+	auto timeEnd = timeWarm + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(options.fDuration));
+	auto timeLast = timeTraffic;
+	auto timeNext = timeTraffic;
+	while (timeNext < timeEnd)
+	{
+		auto timeScheduled = timeNext;
+		timeNext = std::min(timeNext + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(options.fInterval)), timeEnd);
+		if (timeScheduled < timeWarm && timeNext > timeWarm)
+			timeNext = timeWarm;
+		bool bWarmup = timeNext <= timeWarm;
+		std::this_thread::sleep_until(timeNext);
+
+		Stats interval;
+		for (auto& driver : drivers)
+			interval.Merge(driver->TakeStats());
+		auto timeNow = std::chrono::steady_clock::now();
+		double fSeconds = std::chrono::duration<double>(timeNow - timeLast).count();
+		double fElapsed = std::chrono::duration<double>(timeNow - timeTraffic).count();
+		if (!bWarmup)
+		{
+			total.Merge(interval);
+			fTotalSeconds += fSeconds;
+		}
+		timeLast = timeNow;
+
+		std::printf("[%6.1fs]%s sent %.0f/s received %.0f/s rejected %llu lost %llu",
+			fElapsed, bWarmup ? " (warmup)" : "", interval.nSent / fSeconds, interval.nReceived / fSeconds,
+			(unsigned long long)interval.nRejected, (unsigned long long)interval.nDisconnected);
+		PrintLatency(TRAFFIC_NAMES[0], interval.vLatency[0]);
+		PrintLatency(TRAFFIC_NAMES[1], interval.vLatency[1]);
+		std::printf("\n");
+		std::fflush(stdout);
+	}
+
+	for (auto& driver : drivers)
+		driver->Stop();
+
+	double fSeconds = std::max(fTotalSeconds, 1e-3);
+	std::printf("\nTotal (%.1f s after the warmup):\n", fSeconds);
+	std::printf("  sent     %12.0f msg/s %10.2f MB/s\n", total.nSent / fSeconds, total.nSentBytes / fSeconds / 1e6);
+	std::printf("  received %12.0f msg/s %10.2f MB/s\n", total.nReceived / fSeconds, total.nReceivedBytes / fSeconds / 1e6);
+	std::printf("  rejected %llu (send queue full), lost connections %llu\n", (unsigned long long)total.nRejected, (unsigned long long)total.nDisconnected);
+	PrintHistogram(TRAFFIC_NAMES[0], total.vLatency[0]);
+	PrintHistogram(TRAFFIC_NAMES[1], total.vLatency[1]);
+	std::fflush(stdout);
+
+	// Close the connections, give them a moment to go out
+	for (auto& driver : drivers)
+		driver->Disconnect();
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	pool.Stop();
+	std::cout.rdbuf(pCout);
+	return 0;
+}
@@ -15,67 +15,93 @@ enum MsgTypes : uint32_t
 };
 
 
+// Messages handled by the client
+struct ServerAcceptMsg
+{
+	static constexpr uint32_t TYPE = MsgTypes::ServerAccept;
+};
+
+struct ServerDenyMsg
+{
+	static constexpr uint32_t TYPE = MsgTypes::ServerDeny;
+};
+
+struct ServerPingMsg
+{
+	static constexpr uint32_t TYPE = MsgTypes::ServerPing;
+	std::chrono::system_clock::time_point timeSent;
+	// Filler, which makes the ping as large as wanted (see LoadClient)
+	std::vector<uint8_t> payload;
+	auto Fields() { return std::tie(timeSent, payload); }
+};
+
+struct MessageAllMsg
+{
+	static constexpr uint32_t TYPE = MsgTypes::MessageAll;
+};
+
+struct ServerMessageMsg
+{
+	static constexpr uint32_t TYPE = MsgTypes::ServerMessage;
+	uint64_t clientID;
+};
+
+
 class MyClient : public Net::Client
 {
 public:
-	void OnServerAccept(Net::Message& msg)
+	void On(const ServerAcceptMsg& msg, Net::Connection& server)
 	{
 		std::cout << "OnServerAccept() - Server accepted connection" << std::endl;
 	}
 
 
-	void OnServerDeny(Net::Message& msg)
+	void On(const ServerDenyMsg& msg, Net::Connection& server)
 	{
 		std::cout << "OnServerDeny()" << std::endl;
 	}
 
 
-	void OnServerPing(Net::Message& msg)
+	void On(const ServerPingMsg& msg, Net::Connection& server)
 	{
 		std::chrono::system_clock::time_point timeNow = std::chrono::system_clock::now();
-		std::chrono::system_clock::time_point timeThen;
-		msg >> timeThen;
-		std::cout << "OnServerPing() - Ping: " << std::chrono::duration_cast<std::chrono::microseconds>(timeNow - timeThen).count() * 0.001f << "ms" << std::endl;
+		std::cout << "OnServerPing() - Ping: " << std::chrono::duration_cast<std::chrono::microseconds>(timeNow - msg.timeSent).count() * 0.001f << "ms" << std::endl;
 	}
 
 
-	void OnServerMessage(Net::Message& msg)
+	void On(const ServerMessageMsg& msg, Net::Connection& server)
 	{
-		uint16_t clientID;
-		msg >> clientID;
-		std::cout << "OnServerMessage() - From: " << clientID << std::endl;
+		std::cout << "OnServerMessage() - From: " << msg.clientID << std::endl;
 	}
 
 
-	virtual void OnMessage(Net::Message& msg)
+	void OnRejected(Net::Message& msg)
 	{
-		switch (msg.header.type)
-		{
-		case ServerAccept:  OnServerAccept(msg);  return;
-		case ServerDeny:    OnServerDeny(msg);    return;
-		case ServerPing:    OnServerPing(msg);    return;
-		case ServerMessage: OnServerMessage(msg); return;
-		}
 		std::cout << "OnMessage() type: " << msg.header.type << " - Unknown!!!" << std::endl;
 	}
 
 
+	// Process incoming messages
+	void Run()
+	{
+		Update(m_Dispatcher);
+	}
+
+
 	void PingServer()
 	{
-		Net::Message msg;
-		msg.header.type = MsgTypes::ServerPing;
-		std::chrono::system_clock::time_point timeNow = std::chrono::system_clock::now();
-		msg << timeNow;
-		Send(msg);
+		Send(Net::Encode(ServerPingMsg{ std::chrono::system_clock::now() }));
 	}
 
 
 	void MessageAll()
 	{
-		Net::Message msg;
-		msg.header.type = MsgTypes::MessageAll;
-		Send(msg);
+		Send(Net::Encode(MessageAllMsg{}));
 	}
+
+
+private:
+	Net::MessageDispatcher<MyClient, ServerAcceptMsg, ServerDenyMsg, ServerPingMsg, ServerMessageMsg> m_Dispatcher{ *this };
 };
 
 
@@ -99,7 +125,7 @@ int main()
 			std::cout << "Server down!" << std::endl;
 			return -1;
 		}
-		myClient.Update();
+		myClient.Run();
 
 		//     WINDOWS ONLY !!!
 		//     WINDOWS ONLY !!!
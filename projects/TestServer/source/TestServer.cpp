@@ -15,6 +15,33 @@ enum MsgTypes : uint32_t
 };
 
 
+// Messages handled by the server
+struct ServerAcceptMsg
+{
+	static constexpr uint32_t TYPE = MsgTypes::ServerAccept;
+};
+
+struct ServerPingMsg
+{
+	static constexpr uint32_t TYPE = MsgTypes::ServerPing;
+	std::chrono::system_clock::time_point timeSent;
+	// Filler, which makes the ping as large as wanted (see LoadClient)
+	std::vector<uint8_t> payload;
+	auto Fields() { return std::tie(timeSent, payload); }
+};
+
+struct MessageAllMsg
+{
+	static constexpr uint32_t TYPE = MsgTypes::MessageAll;
+};
+
+struct ServerMessageMsg
+{
+	static constexpr uint32_t TYPE = MsgTypes::ServerMessage;
+	uint64_t clientID;
+};
+
+
 class MyServer : public Net::Server
 {
 public:
@@ -23,13 +50,11 @@ public:
 	{
 		std::cout << "[" << client->GetID() << "] OnClientConnect()" << std::endl;
 
-		// std::string id   = client->GetID()       // same value as GetPort()
+		// uint64_t    id   = client->GetID()       // unique per client, see Server::GetClient()
 		// std::string ip   = client->GetAddress()  // remote adress
 		// uint16_t    port = client->GetPort()     // connected on port
 
-		Net::Message msg;
-		msg.header.type = MsgTypes::ServerAccept;
-		Send(client, msg);
+		Send(client, Net::Encode(ServerAcceptMsg{}));
 
 		return true;
 	}
@@ -41,39 +66,45 @@ public:
 	}
 
 
-	void OnServerPing(Net::Message& msg)
+	void On(const ServerPingMsg& msg, Net::Connection& client)
 	{
-		std::cout << "[" << msg.remote->GetID() << "] OnServerPing()" << std::endl;
+		std::cout << "[" << client.GetID() << "] OnServerPing()" << std::endl;
 		// Simply bounce message back
-		Send(msg.remote, msg);
+		Send(client.shared_from_this(), Net::Encode(msg));
 	}
 
 
-	void OnMessageAll(Net::Message& msg)
+	void On(const MessageAllMsg& msg, Net::Connection& client)
 	{
-		std::cout << "[" << msg.remote->GetID() << "] OnMessageAll()" << std::endl;
-		Net::Message msgOut;
-		msgOut.header.type = ServerMessage;
-		msgOut << msg.remote->GetID();
-		Broadcast(msgOut, msg.remote);
+		std::cout << "[" << client.GetID() << "] OnMessageAll()" << std::endl;
+		Broadcast(Net::Encode(ServerMessageMsg{ client.GetID() }), client.shared_from_this());
 	}
 
 
-	void OnMessage(Net::Message& msg) override
+	void OnRejected(Net::Message& msg)
 	{
-		switch (msg.header.type)
-		{
-		case ServerPing: OnServerPing(msg); return;
-		case MessageAll: OnMessageAll(msg); return;
-		}
 		std::cout << "[" << msg.remote->GetID() << "] OnMessage() type: " << msg.header.type << " - Unknown!!!" << std::endl;
 	}
 
+
+	// Process incoming messages, waiting for them
+	void Run()
+	{
+		Update(m_Dispatcher, -1, true);
+	}
+
+
+private:
+	Net::MessageDispatcher<MyServer, ServerPingMsg, MessageAllMsg> m_Dispatcher{ *this };
 };
 
 
-int main()
+int main(int argc, char** argv)
 {
+	// "TestServer --quiet" doesn't log every message, eg. when it's load tested (see LoadClient)
+	if (argc > 1 && std::string(argv[1]) == "--quiet")
+		std::cout.rdbuf(nullptr);
+
 	MyServer myServer;
 
 	if (!myServer.Start(60000, "127.0.0.1"))
@@ -82,6 +113,6 @@ int main()
 	bool bRun = true;
 	while (bRun)
 	{
-		myServer.Update(true);
+		myServer.Run();
 	}
 }